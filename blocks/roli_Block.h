@@ -52,6 +52,23 @@ public:
     */
     enum class ProgramPersistency { setAsTemp, setAsDefault };
 
+    /** Determines how a new program is transferred to a block.
+
+        With fullUpload, the device's memory is treated as unknown and the whole program
+        is rewritten. With differential, only the parts of the new program that differ from
+        what the device is known to be holding are sent, which makes switching between
+        similar programs much quicker.
+    */
+    enum class ProgramUploadMode { fullUpload, differential };
+
+    /** Determines whether program and heap changes can be shared with other blocks.
+
+        With individual, every change is sent to this block on its own. With group, if
+        all the blocks on the same connection use this mode and hold identical program
+        and heap data, each change is broadcast to all of them in a single packet.
+    */
+    enum class HeapSyncMode { individual, group };
+
     /** The Block class is reference-counted, so always use a Block::Ptr when
         you are keeping references to them.
     */
@@ -81,6 +98,17 @@ public:
 
     ProgramPersistency programPersistency { ProgramPersistency::setAsTemp };
 
+    /** The mode used when the next program is loaded onto this block. */
+    ProgramUploadMode programUploadMode { ProgramUploadMode::fullUpload };
+
+    /** The way this block's program and heap changes are sent. */
+    HeapSyncMode heapSyncMode { HeapSyncMode::individual };
+
+    /** This block's share of the bandwidth for program and heap data, relative to
+        the other blocks that are connected through the same device connection.
+    */
+    int bandwidthWeight = 1;
+
     //==============================================================================
     /** Two blocks are considered equal if they have the same UID. */
     bool operator== (const Block& other) const noexcept     { return uid == other.uid; }
@@ -300,6 +328,31 @@ public:
     */
     virtual void sendProgramEvent (const ProgramEventMessage&) = 0;
 
+    /** Sends a number of messages to the currently loaded program.
+        If message packing is enabled, the messages are packed together, so this is
+        cheaper than sending them one at a time.
+    */
+    virtual void sendProgramEvents (const ProgramEventMessage* messages, int numMessages) = 0;
+
+    /** Lets newer program events replace ones with the same key that haven't been sent yet.
+
+        The key is the first numKeyValues values of a message, so e.g. a key size of 1 makes
+        messages with the same first parameter overwrite each other, which is useful when
+        streaming a changing value to the program. An event only replaces the one sent just
+        before it, so events with different keys always arrive in the order they were sent,
+        and any other message that's sent to the block makes the events before it go out unchanged.
+        A key size of 0 turns merging off, which is the default.
+    */
+    virtual void setProgramEventMergeKeySize (int numKeyValues) = 0;
+
+    /** Enables or disables packing several small messages, such as program events and
+        config changes, into each packet sent to the block. Packed messages wait for up
+        to a few milliseconds for others to join them, but save a packet header and MIDI
+        write each. This is off by default, as it hasn't been verified with every firmware
+        version, so only enable it for blocks whose firmware is known to handle it.
+    */
+    virtual void setMessagePackingEnabled (bool shouldPackMessages) = 0;
+
     /** Interface for objects listening to custom program events. */
     struct ProgramEventListener
     {
@@ -348,6 +401,27 @@ public:
     /** Gets a byte from the littlefoot heap. */
     virtual juce::uint8 getDataByte (size_t offset) = 0;
 
+    /** The priority with which changes to a region of the littlefoot heap are sent.
+        Changes to realtime data are sent ahead of any bulk data that's waiting, so
+        that small, latency-critical values don't get held up by large updates.
+    */
+    enum class DataPriority { bulk, realtime };
+
+    /** Sets the priority of a region of the littlefoot heap.
+        All of the heap is bulk data by default, and this is reset whenever a new program is loaded.
+    */
+    virtual void setDataPriority (size_t offset, size_t num, DataPriority priority) = 0;
+
+    /** Statistics for how long changes to the littlefoot heap took to be acknowledged by the block. */
+    struct DataLatencyStats
+    {
+        int numPackets = 0;
+        double averageMs = 0.0, maxMs = 0.0;
+    };
+
+    /** Returns the latency statistics for changes with a given priority. */
+    virtual DataLatencyStats getDataLatencyStats (DataPriority priority) = 0;
+
     /** Sets the current program as the block's default state. */
     virtual void saveProgramAsDefault() = 0;
 
@@ -537,6 +611,35 @@ public:
     */
     using Timestamp = juce::uint32;
 
+    /** Describes when an event from a block happened and when it reached the host, in
+        terms of the host's juce::Time::getHighResolutionTicks() clock.
+
+        The host learns how the block's clock relates to its own from the timestamps of
+        the events it receives and the round trips of the pings it sends, so the origin
+        time is only available once a block has been connected for a second or so.
+    */
+    struct EventTiming
+    {
+        /** The tick count when the packet containing the event arrived, or 0 if unknown. */
+        juce::int64 hostArrivalTime = 0;
+
+        /** The estimated tick count when the block generated the event, or 0 if the block's
+            clock hasn't been synchronised with the host's yet.
+        */
+        juce::int64 estimatedOriginTime = 0;
+
+        /** Returns the estimated time between the block generating the event and the host
+            receiving it, in milliseconds, or a negative value if it isn't known.
+        */
+        double getLatencyMs() const noexcept
+        {
+            if (hostArrivalTime == 0 || estimatedOriginTime == 0)
+                return -1.0;
+
+            return juce::Time::highResolutionTicksToSeconds (hostArrivalTime - estimatedOriginTime) * 1000.0;
+        }
+    };
+
 protected:
     //==============================================================================
     Block (const juce::String& serialNumberToUse);
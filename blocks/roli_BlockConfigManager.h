@@ -66,6 +66,7 @@ struct BlockConfigManager
 
     void setDeviceIndex (TopologyIndex newDeviceIndex)                       { deviceIndex = newDeviceIndex; }
     void setDeviceComms (PhysicalTopologySource::DeviceConnection* newConn)  { deviceConnection = newConn; }
+    void setMessageAggregator (HostMessageAggregator* newAggregator)         { messageAggregator = newAggregator; }
 
     static constexpr juce::uint32 numConfigItems = 97;
 
@@ -309,22 +310,22 @@ struct BlockConfigManager
     // Set Block Configuration
     void setBlockConfig (BlockConfigId id, juce::int32 value)
     {
-        buildAndSendPacket ([id, value] (HostPacketBuilder<32>& p) { p.addConfigSetMessage (id, value); });
+        buildAndSendPacket ([id, value] (auto& p) { return p.addConfigSetMessage (id, value); });
     }
 
     void requestBlockConfig (BlockConfigId id)
     {
-        buildAndSendPacket ([id] (HostPacketBuilder<32>& p) { p.addRequestMessage (id); });
+        buildAndSendPacket ([id] (auto& p) { return p.addRequestMessage (id); });
     }
 
     void requestFactoryConfigSync()
     {
-        buildAndSendPacket ([] (HostPacketBuilder<32>& p) { p.addRequestFactorySyncMessage(); });
+        buildAndSendPacket ([] (auto& p) { return p.addRequestFactorySyncMessage(); });
     }
 
     void requestUserConfigSync()
     {
-        buildAndSendPacket ([] (HostPacketBuilder<32>& p) { p.addRequestUserSyncMessage(); });
+        buildAndSendPacket ([] (auto& p) { return p.addRequestUserSyncMessage(); });
     }
 
     void handleConfigUpdateMessage (juce::int32 id, juce::int32 value, juce::int32 min, juce::int32 max)
@@ -356,6 +357,12 @@ private:
         if (deviceConnection == nullptr)
             return;
 
+        if (messageAggregator != nullptr)
+        {
+            messageAggregator->addMessage (deviceIndex, buildFn);
+            return;
+        }
+
         HostPacketBuilder<32> packet;
         packet.writePacketSysexHeaderBytes (deviceIndex);
         buildFn (packet);
@@ -365,6 +372,7 @@ private:
 
     TopologyIndex deviceIndex {};
     PhysicalTopologySource::DeviceConnection* deviceConnection {};
+    HostMessageAggregator* messageAggregator {};
     std::map <juce::int32, ConfigDescription> configItems;
 };
 
@@ -127,11 +127,18 @@ public:
     /** Removes a listener from the control button. */
     void removeListener (Listener*);
 
+    /** Returns the timing of the most recent press or release, in terms of the host's
+        clock. Listeners can call this from their callbacks to find out more about the
+        event than its device timestamp.
+    */
+    Block::EventTiming getLastEventTiming() const noexcept      { return lastEventTiming; }
+
     /** The control block that this button belongs to. */
     Block& block;
 
 protected:
     juce::ListenerList<Listener> listeners;
+    Block::EventTiming lastEventTiming;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ControlButton)
 };
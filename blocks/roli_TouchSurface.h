@@ -77,6 +77,9 @@ public:
         /** The timestamp of this event, in milliseconds since the device was booted. */
         Block::Timestamp eventTimestamp;
 
+        /** When this event happened and arrived, in terms of the host's clock. */
+        Block::EventTiming timing;
+
         /** True if this is the first event for this finger/index. */
         bool isTouchStart;
 
@@ -39,6 +39,13 @@ namespace littlefoot
     Data in the block can be changed by calling setByte, setBytes, setBits etc, and
     these changes will be flushed to the device when sendChanges is called.
 
+    Regions of the heap can be given a traffic class. Packets are only created once
+    there's room for them to be sent, and changes to realtime bytes always go into the
+    next packet ahead of any bulk changes. Realtime packets may also go a little past
+    the in-flight limit that bulk packets observe, so a realtime change made while a
+    large update is still being acknowledged is sent straight away rather than waiting
+    for the bulk packets ahead of it.
+
     @tags{Blocks}
 */
 template <typename ImplementationClass>
@@ -49,6 +56,22 @@ struct LittleFootRemoteHeap
         resetDeviceStateToUnknown();
     }
 
+    enum TrafficClass
+    {
+        bulk = 0,
+        realtime,
+        numTrafficClasses
+    };
+
+    /** The time taken for the packets of a traffic class to be acknowledged, measured
+        from when the oldest change that they carry was made.
+    */
+    struct LatencyStats
+    {
+        int numPackets = 0;
+        double totalMs = 0.0, maxMs = 0.0;
+    };
+
     void reset()
     {
         JUCE_LOG_LITTLEFOOT_HEAP ("Resetting heap state");
@@ -71,15 +94,64 @@ struct LittleFootRemoteHeap
         needsSyncing = true;
         programStateKnown = false;
         messagesSent.clear();
-        resetDataRangeToUnknown (0, ImplementationClass::maxBlockSize);
+        deviceStateKnown.reset();
+        expectedStateKnown.reset();
     }
 
     void resetDataRangeToUnknown (size_t offset, size_t size) noexcept
     {
-        auto* latestState = getLatestExpectedDataState();
+        jassert (offset + size <= ImplementationClass::maxBlockSize);
 
-        for (size_t i = 0; i < size; ++i)
-            latestState[offset + i] = unknownByte;
+        // If there are packets in flight, the range only becomes unknown once the
+        // last of them has been acknowledged, so it's recorded as part of its changes.
+        if (messagesSent.isEmpty())
+            markRangeUnknown (deviceStateKnown, offset, size);
+        else
+            messagesSent.getLast()->changes.add ({ (int) offset, (int) size, -1 });
+
+        markRangeUnknown (expectedStateKnown, offset, size);
+    }
+
+    /** Tells the heap that the device is already known to hold some data, e.g. a program
+        that it kept in memory while it was disconnected.
+    */
+    void setDeviceStateKnown (size_t offset, const uint8* data, size_t num) noexcept
+    {
+        jassert (messagesSent.isEmpty());
+        jassert (offset + num <= ImplementationClass::maxBlockSize);
+
+        for (size_t i = 0; i < num; ++i)
+        {
+            deviceState[offset + i] = expectedState[offset + i] = data[i];
+            deviceStateKnown.set (offset + i);
+            expectedStateKnown.set (offset + i);
+        }
+
+        programStateKnown = false;
+    }
+
+    void setTrafficClass (size_t offset, size_t size, TrafficClass trafficClass) noexcept
+    {
+        jassert (offset + size <= blockSize);
+
+        for (size_t i = offset; i < juce::jmin (offset + size, blockSize); ++i)
+            realtimeBytes.set (i, trafficClass == realtime);
+    }
+
+    void resetTrafficClasses() noexcept
+    {
+        realtimeBytes.reset();
+    }
+
+    LatencyStats getLatencyStats (TrafficClass trafficClass) const noexcept
+    {
+        return latencyStats[trafficClass];
+    }
+
+    void resetLatencyStats() noexcept
+    {
+        for (auto& s : latencyStats)
+            s = {};
     }
 
     void setByte (size_t offset, uint8 value) noexcept
@@ -94,6 +166,7 @@ struct LittleFootRemoteHeap
         {
             targetData[offset] = value;
             needsSyncing = true;
+            markChangePending (offset);
 
             if (offset < programSize)
                 programStateKnown = false;
@@ -122,6 +195,9 @@ struct LittleFootRemoteHeap
 
             needsSyncing = true;
 
+            for (auto i = startBit / 8; i <= (startBit + juce::jmax (numBits, 1u) - 1) / 8; ++i)
+                markChangePending (i);
+
             if (startBit < programSize)
                 programStateKnown = false;
         }
@@ -152,44 +228,147 @@ struct LittleFootRemoteHeap
 
     void sendChanges (ImplementationClass& bi, bool forceSend)
     {
-        if ((needsSyncing && messagesSent.isEmpty()) || forceSend)
+        for (auto* m : messagesSent)
         {
-            for (int maxChanges = 30; --maxChanges >= 0;)
+            if (m->dispatchTime >= juce::Time::getCurrentTime() - juce::RelativeTime::milliseconds (250))
+                break;
+
+            if (! bi.isReadyToSendHeapData())
+                return;
+
+            // The other devices that received a broadcast packet may have moved on since,
+            // so if it needs resending, it only goes to this device.
+            if (m->isBroadcast)
             {
-                if (isAllZero (targetData, blockSize))
+                if (bi.getDeviceIndex() < 0)
                     break;
 
-                uint16 data[ImplementationClass::maxBlockSize];
-                auto* latestState = getLatestExpectedDataState();
+                m->packet.setPacketSysexDeviceIndex ((uint8) bi.getDeviceIndex());
+                m->isBroadcast = false;
+            }
+
+            dispatchMessage (bi, *m);
+
+            if (getTotalSizeOfMessagesSent() > maxBytesInFlight)
+                return;
+        }
+
+        if (! (needsSyncing || forceSend) || sharingChangesWithGroup)
+            return;
 
-                for (uint32 i = 0; i < blockSize; ++i)
-                    data[i] = latestState[i];
+        // Each new packet takes whatever has the highest priority at the moment it can be sent
+        while (bi.isReadyToSendHeapData())
+        {
+            auto bytesInFlight = getTotalSizeOfMessagesSent();
 
-                uint32 packetIndex = messagesSent.isEmpty() ? lastPacketIndexReceived
-                                                            : messagesSent.getLast()->packetIndex;
+            if (bytesInFlight > maxBytesInFlight + realtimeHeadroom)
+                break;
 
-                packetIndex = (packetIndex + 1) & ImplementationClass::maxPacketCounter;
+            if (! createNextChangeMessage (bi.getDeviceIndex(), getNextPacketIndex(),
+                                           bytesInFlight <= maxBytesInFlight))
+                break;
 
-                if (! Diff (data, targetData, blockSize).createChangeMessage (bi, data, messagesSent, packetIndex))
-                    break;
+            dispatchMessage (bi, *messagesSent.getLast());
+        }
+    }
 
-                dumpStatus();
-            }
+    //==============================================================================
+    /** Returns true if this heap and another one hold identical data and expect their
+        devices to be in identical states, so that any changes to them will be the same.
+    */
+    bool canShareChangesWith (const LittleFootRemoteHeap& other) const noexcept
+    {
+        if (blockSize != other.blockSize
+             || expectedStateKnown != other.expectedStateKnown
+             || realtimeBytes != other.realtimeBytes
+             || memcmp (targetData, other.targetData, blockSize) != 0)
+            return false;
+
+        for (size_t i = 0; i < blockSize; ++i)
+            if (expectedStateKnown[i] && expectedState[i] != other.expectedState[i])
+                return false;
+
+        return true;
+    }
+
+    /** While this is enabled, sendChanges won't create any new packets, and will only
+        (re)send the ones that are already in flight. New packets are instead created
+        for the whole group by sendChangesToGroup.
+    */
+    void setSharingChangesWithGroup (bool shouldShare) noexcept
+    {
+        sharingChangesWithGroup = shouldShare;
+    }
+
+    /** Sends the pending changes of a group of heaps that can all share changes with this
+        one, using packets that are broadcast to all of their devices at once.
+
+        Each heap still keeps its own copy of the packets and tracks the ACKs from its
+        own device, so any packets that get lost are resent to each device individually.
+    */
+    void sendChangesToGroup (ImplementationClass& bi, const juce::Array<LittleFootRemoteHeap*>& otherHeaps)
+    {
+        if (! (needsSyncing && messagesSent.isEmpty()))
+            return;
+
+        for (auto* h : otherHeaps)
+        {
+            jassert (h->canShareChangesWith (*this));
+
+            if (! h->messagesSent.isEmpty())
+                return;
         }
 
-        for (auto* m : messagesSent)
+        if (! bi.isReadyToSendHeapData())
+            return;
+
+        // The packet index must look new to every device in the group
+        auto isLastIndexOfAnyDevice = [&] (uint32 index)
         {
-            if (m->dispatchTime >= juce::Time::getCurrentTime() - juce::RelativeTime::milliseconds (250))
-                break;
+            for (auto* h : otherHeaps)
+                if (h->lastPacketIndexReceived == index)
+                    return true;
 
-            m->dispatchTime = juce::Time::getCurrentTime();
+            return index == lastPacketIndexReceived;
+        };
+
+        auto packetIndex = getNextPacketIndex();
+
+        while (isLastIndexOfAnyDevice (packetIndex))
+            packetIndex = (packetIndex + 1) & ImplementationClass::maxPacketCounter;
+
+        // Only create as many packets as can be in flight at once, so that they're all
+        // dispatched straight away and the group moves on in step.
+        createChangeMessages (ImplementationClass::broadcastDeviceIndex, packetIndex, 2);
+
+        for (auto* h : otherHeaps)
+        {
+            h->createChangeMessages (ImplementationClass::broadcastDeviceIndex, packetIndex, 2);
+            jassert (h->messagesSent.size() == messagesSent.size());
+        }
+
+        auto now = juce::Time::getCurrentTime();
+
+        for (auto* m : messagesSent)
+        {
+            m->dispatchTime = now;
             bi.sendMessageToDevice (m->packet);
 
-            JUCE_LOG_LITTLEFOOT_HEAP ("Sending packet " << (int) m->packetIndex << " - " << m->packet.size() << " bytes, device " << bi.getDeviceIndex());
+            JUCE_LOG_LITTLEFOOT_HEAP ("Broadcasting packet " << (int) m->packetIndex << " - " << m->packet.size()
+                                        << " bytes, " << (otherHeaps.size() + 1) << " devices");
+        }
 
-            if (getTotalSizeOfMessagesSent() > 200)
-                break;
+        for (auto* h : otherHeaps)
+        {
+            for (auto* m : h->messagesSent)
+                m->dispatchTime = now;
+
+            if (h->messagesSent.isEmpty())
+                h->needsSyncing = false;
         }
+
+        if (messagesSent.isEmpty())
+            needsSyncing = false;
     }
 
     void handleACKFromDevice (ImplementationClass& bi, uint32 packetIndex) noexcept
@@ -204,19 +383,32 @@ struct LittleFootRemoteHeap
 
         for (int i = messagesSent.size(); --i >= 0;)
         {
-            auto& m = *messagesSent.getUnchecked(i);
-
-            if (m.packetIndex == packetIndex)
+            if (messagesSent.getUnchecked (i)->packetIndex == packetIndex)
             {
-                for (uint32 j = 0; j < blockSize; ++j)
-                    deviceState[j] = m.resultDataState[j];
+                auto now = juce::Time::getCurrentTime();
+
+                for (int j = 0; j <= i; ++j)
+                {
+                    auto& m = *messagesSent.getUnchecked (j);
+                    applyChanges (m, deviceState, deviceStateKnown);
+
+                    auto& stats = latencyStats[m.trafficClass];
+                    auto latencyMs = (double) (now - m.changeTime).inMilliseconds();
+
+                    ++stats.numPackets;
+                    stats.totalMs += latencyMs;
+                    stats.maxMs = juce::jmax (stats.maxMs, latencyMs);
+                }
 
                 programStateKnown = false;
                 messagesSent.removeRange (0, i + 1);
                 dumpStatus();
                 sendChanges (bi, false);
 
-                if (messagesSent.isEmpty())
+                // When sharing changes, any that are still pending will be sent to the whole group later.
+                // sendChanges may also have been held back by the bandwidth limit, in which case the
+                // remaining changes are still pending and will be sent when there's room for them.
+                if (messagesSent.isEmpty() && ! sharingChangesWithGroup && ! hasUnsentChanges())
                 {
                     JUCE_LOG_LITTLEFOOT_HEAP ("Heap fully synced");
                     needsSyncing = false;
@@ -229,6 +421,12 @@ struct LittleFootRemoteHeap
         resetDeviceStateToUnknown();
     }
 
+    /** Returns the index of the last packet that the device acknowledged. */
+    uint32 getLastPacketIndexReceived() const noexcept     { return lastPacketIndexReceived; }
+
+    /** Returns true if any packets have been sent that the device hasn't acknowledged yet. */
+    bool hasPacketsInFlight() const noexcept               { return ! messagesSent.isEmpty(); }
+
     bool isProgramLoaded() noexcept
     {
         if (! programStateKnown)
@@ -236,7 +434,7 @@ struct LittleFootRemoteHeap
             uint8 deviceMemory[ImplementationClass::maxBlockSize];
 
             for (size_t i = 0; i < blockSize; ++i)
-                deviceMemory[i] = (uint8) deviceState[i];
+                deviceMemory[i] = deviceStateKnown[i] ? deviceState[i] : 0;
 
             littlefoot::Program prog (deviceMemory, (uint32) blockSize);
             programLoaded = prog.checksumMatches();
@@ -250,31 +448,169 @@ struct LittleFootRemoteHeap
 
     const size_t blockSize;
 
-    static constexpr uint16 unknownByte = 0x100;
-
 private:
-    uint16 deviceState[ImplementationClass::maxBlockSize] = { 0 };
+    using StateBits = std::bitset<ImplementationClass::maxBlockSize>;
+
+    /*  deviceState holds what the device has acknowledged, and expectedState is what
+        it will hold once every packet in messagesSent has been acknowledged. A byte's
+        value is only meaningful when its bit is set in the matching "known" set.
+    */
+    uint8 deviceState[ImplementationClass::maxBlockSize] = { 0 };
+    uint8 expectedState[ImplementationClass::maxBlockSize] = { 0 };
+    StateBits deviceStateKnown, expectedStateKnown;
+
     uint8 targetData[ImplementationClass::maxBlockSize] = { 0 };
+    StateBits realtimeBytes;
+    juce::Time oldestPendingChange[numTrafficClasses];
+    LatencyStats latencyStats[numTrafficClasses];
     uint32 programSize = 0;
     bool needsSyncing = true, programStateKnown = true, programLoaded = false;
+    bool sharingChangesWithGroup = false;
 
-    uint16* getLatestExpectedDataState() noexcept
+    /** A range of bytes that a packet will change. The new values are stored in the
+        owning message's value list, or, if valueOffset is negative, the range becomes unknown.
+    */
+    struct DataChange
     {
-        return messagesSent.isEmpty() ? deviceState
-                                      : messagesSent.getLast()->resultDataState;
-    }
+        int index, length, valueOffset;
+    };
 
     struct ChangeMessage
     {
         typename ImplementationClass::PacketBuilder packet;
         juce::Time dispatchTime;
         uint32 packetIndex;
-        uint16 resultDataState[ImplementationClass::maxBlockSize];
+        bool isBroadcast = false;
+        TrafficClass trafficClass = bulk;
+        juce::Time changeTime;
+        juce::Array<DataChange> changes;
+        juce::Array<uint8> values;
     };
 
+    static void markRangeUnknown (StateBits& known, size_t offset, size_t size) noexcept
+    {
+        for (size_t i = 0; i < size; ++i)
+            known.reset (offset + i);
+    }
+
+    static void applyChanges (const ChangeMessage& m, uint8* state, StateBits& known) noexcept
+    {
+        for (auto& c : m.changes)
+        {
+            if (c.valueOffset < 0)
+            {
+                markRangeUnknown (known, (size_t) c.index, (size_t) c.length);
+                continue;
+            }
+
+            for (int i = 0; i < c.length; ++i)
+            {
+                state[c.index + i] = m.values.getUnchecked (c.valueOffset + i);
+                known.set ((size_t) (c.index + i));
+            }
+        }
+    }
+
     juce::OwnedArray<ChangeMessage> messagesSent;
     uint32 lastPacketIndexReceived = 0;
 
+    static constexpr int maxBytesInFlight = 200;
+
+    /** How far realtime packets may exceed maxBytesInFlight. This is kept small, as
+        it's only there so that a realtime change can overtake a full window of bulk
+        packets that are waiting to be acknowledged.
+    */
+    static constexpr int realtimeHeadroom = 64;
+
+    void markChangePending (size_t offset) noexcept
+    {
+        auto& oldest = oldestPendingChange[realtimeBytes[offset] ? realtime : bulk];
+
+        if (oldest == juce::Time())
+            oldest = juce::Time::getCurrentTime();
+    }
+
+    void dispatchMessage (ImplementationClass& bi, ChangeMessage& m)
+    {
+        m.dispatchTime = juce::Time::getCurrentTime();
+        bi.sendMessageToDevice (m.packet);
+
+        JUCE_LOG_LITTLEFOOT_HEAP ("Sending packet " << (int) m.packetIndex << " - " << m.packet.size() << " bytes, device " << bi.getDeviceIndex()
+                                    << (m.trafficClass == realtime ? ", realtime" : ""));
+    }
+
+    uint32 getNextPacketIndex() const noexcept
+    {
+        auto lastIndex = messagesSent.isEmpty() ? lastPacketIndexReceived
+                                                : messagesSent.getLast()->packetIndex;
+
+        return (lastIndex + 1) & ImplementationClass::maxPacketCounter;
+    }
+
+    void createChangeMessages (int deviceIndex, uint32 packetIndex, int maxMessages)
+    {
+        for (int i = 0; i < maxMessages; ++i)
+        {
+            if (! createNextChangeMessage (deviceIndex, packetIndex, true))
+                break;
+
+            packetIndex = (packetIndex + 1) & ImplementationClass::maxPacketCounter;
+        }
+    }
+
+    bool createNextChangeMessage (int deviceIndex, uint32 packetIndex, bool allowBulk)
+    {
+        if (deviceIndex < 0 || isAllZero (targetData, blockSize))
+            return false;
+
+        if (realtimeBytes.any() && createChangeMessage (realtime, ~realtimeBytes, deviceIndex, packetIndex))
+            return true;
+
+        return allowBulk && createChangeMessage (bulk, realtimeBytes, deviceIndex, packetIndex);
+    }
+
+    bool createChangeMessage (TrafficClass trafficClass, const StateBits& bytesToExclude, int deviceIndex, uint32 packetIndex)
+    {
+        auto numMessages = messagesSent.size();
+
+        auto hasMoreChanges = Diff (expectedState, expectedStateKnown, targetData, blockSize, bytesToExclude)
+                                .createChangeMessage (deviceIndex, messagesSent, packetIndex);
+
+        auto& oldestChange = oldestPendingChange[trafficClass];
+
+        if (messagesSent.size() == numMessages)
+        {
+            oldestChange = {};
+            return false;
+        }
+
+        auto& m = *messagesSent.getLast();
+        m.trafficClass = trafficClass;
+        m.changeTime = oldestChange != juce::Time() ? oldestChange : juce::Time::getCurrentTime();
+
+        if (! hasMoreChanges)
+            oldestChange = {};
+
+        dumpStatus();
+        return true;
+    }
+
+    /** Returns true if the device won't hold the target data once every packet in
+        flight has been acknowledged.
+    */
+    bool hasUnsentChanges() const noexcept
+    {
+        // An all-zero target is never sent, so there's nothing to wait for
+        if (isAllZero (targetData, blockSize))
+            return false;
+
+        for (size_t i = 0; i < blockSize; ++i)
+            if (! expectedStateKnown[i] || expectedState[i] != targetData[i])
+                return true;
+
+        return false;
+    }
+
     int getTotalSizeOfMessagesSent() const noexcept
     {
         int total = 0;
@@ -298,7 +634,7 @@ private:
 
         for (int i = 0; i < (int) blockSize; ++i)
         {
-            if (targetData[i] != deviceState[i])
+            if (! deviceStateKnown[(size_t) i] || targetData[i] != deviceState[i])
             {
                 ++differences;
                 areas[i * diffLen / (int) blockSize] = 'X';
@@ -316,38 +652,33 @@ private:
 
     struct Diff
     {
-        Diff (uint16* current, const uint8* target, size_t blockSizeToUse)
-            : newData (target), blockSize (blockSizeToUse)
+        Diff (uint8* current, StateBits& currentKnown, const uint8* target, size_t blockSizeToUse, const StateBits& bytesToExclude)
+            : currentData (current), currentDataKnown (currentKnown), newData (target), blockSize (blockSizeToUse)
         {
             ranges.ensureStorageAllocated ((int) blockSize);
 
             for (int i = 0; i < (int) blockSize; ++i)
-                ranges.add ({ i, 1, newData[i] == current[i], false });
+                ranges.add ({ i, 1, bytesToExclude[(size_t) i] || (currentDataKnown[(size_t) i] && newData[i] == currentData[i]), false });
 
             coalesceUniformRegions();
             coalesceSequences();
             trim();
         }
 
-        bool createChangeMessage (const ImplementationClass& bi,
-                                  const uint16* currentState,
+        bool createChangeMessage (int deviceIndex,
                                   juce::OwnedArray<ChangeMessage>& messagesCreated,
                                   uint32 nextPacketIndex)
         {
             if (ranges.isEmpty())
                 return false;
 
-            auto deviceIndex = bi.getDeviceIndex();
-
             if (deviceIndex < 0)
                 return false;
 
             auto& message = *messagesCreated.add (new ChangeMessage());
 
             message.packetIndex = nextPacketIndex;
-
-            for (uint32 i = 0; i < blockSize; ++i)
-                message.resultDataState[i] = currentState[i];
+            message.isBroadcast = (deviceIndex == ImplementationClass::broadcastDeviceIndex);
 
             auto& p = message.packet;
             p.writePacketSysexHeaderBytes ((uint8) deviceIndex);
@@ -383,8 +714,16 @@ private:
                     break;
 
                 if (! r.isSkipped)
+                {
+                    message.changes.add ({ r.index, r.length, message.values.size() });
+                    message.values.addArray (newData + r.index, r.length);
+
                     for (int i = r.index; i < r.index + r.length; ++i)
-                        message.resultDataState[i] = newData[i];
+                    {
+                        currentData[i] = newData[i];
+                        currentDataKnown.set ((size_t) i);
+                    }
+                }
             }
 
             p.endDataChanges (! packetOverflow);
@@ -400,6 +739,8 @@ private:
             bool isSkipped, isMixed;
         };
 
+        uint8* const currentData;
+        StateBits& currentDataKnown;
         const uint8* const newData;
         const size_t blockSize;
         juce::Array<ByteSequence> ranges;
@@ -124,6 +124,16 @@ struct Packed7BitArrayBuilder
         data[bytesWritten++] = deviceIndex & 0x7f;
     }
 
+    /** Changes the device index of a packet whose header has already been written.
+        The index isn't covered by the checksum, so the rest of the packet stays valid.
+    */
+    void setHeaderSysexDeviceIndex (juce::uint8 deviceIndex) noexcept
+    {
+        jassert (bytesWritten > (int) sizeof (roliSysexHeader));
+        jassert (deviceIndex < 128);
+        data[sizeof (roliSysexHeader)] = deviceIndex & 0x7f;
+    }
+
     void writePacketSysexFooter() noexcept
     {
         if (bitsInCurrentByte != 0)
@@ -144,7 +154,7 @@ struct Packed7BitArrayBuilder
     template <int numBits>
     Packed7BitArrayBuilder& operator<< (IntegerWithBitSize<numBits> value) noexcept
     {
-        writeBits (value.value, numBits);
+        writeBits<numBits> (value.value);
         return *this;
     }
 
@@ -154,43 +164,36 @@ struct Packed7BitArrayBuilder
         jassert (hasCapacity (numBits));
         jassert (numBits == 32 || (value >> numBits) == 0);
 
-        while (numBits > 0)
-        {
-            if (bitsInCurrentByte == 0)
-            {
-                if (numBits < 7)
-                {
-                    data[bytesWritten] = (juce::uint8) value;
-                    bitsInCurrentByte = numBits;
-                    return;
-                }
-
-                if (numBits == 7)
-                {
-                    data[bytesWritten++] = (juce::uint8) value;
-                    return;
-                }
-
-                data[bytesWritten++] = (juce::uint8) (value & 0x7f);
-                value >>= 7;
-                numBits -= 7;
-            }
-            else
-            {
-                const int bitsToDo = juce::jmin (7 - bitsInCurrentByte, numBits);
-
-                data[bytesWritten] = static_cast<juce::uint8> (data[bytesWritten] | ((value & (juce::uint32) ((1 << bitsToDo) - 1)) << bitsInCurrentByte));
-                value >>= bitsToDo;
-                numBits -= bitsToDo;
-                bitsInCurrentByte += bitsToDo;
-
-                if (bitsInCurrentByte == 7)
-                {
-                    bitsInCurrentByte = 0;
-                    ++bytesWritten;
-                }
-            }
-        }
+        auto accumulator = startAccumulator (value);
+        auto bitsInAccumulator = bitsInCurrentByte + numBits;
+
+        while (bitsInAccumulator >= 7)
+            flushByte (accumulator, bitsInAccumulator);
+
+        finishAccumulator (accumulator, bitsInAccumulator);
+    }
+
+    /** Writes a value whose width is known at compile time. The first numBits / 7 bytes
+        are flushed by a loop with a fixed count that the compiler unrolls, and only one
+        branch depends on where the value starts.
+    */
+    template <int numBits>
+    void writeBits (juce::uint32 value) noexcept
+    {
+        static_assert (numBits > 0 && numBits <= 32, "numBits must be between 1 and 32");
+        jassert (hasCapacity (numBits));
+        jassert (numBits == 32 || (value >> numBits) == 0);
+
+        auto accumulator = startAccumulator (value);
+        auto bitsInAccumulator = bitsInCurrentByte + numBits;
+
+        for (int i = 0; i < numBits / 7; ++i)
+            flushByte (accumulator, bitsInAccumulator);
+
+        if (bitsInAccumulator >= 7)
+            flushByte (accumulator, bitsInAccumulator);
+
+        finishAccumulator (accumulator, bitsInAccumulator);
     }
 
     /** Describes the current building state */
@@ -204,15 +207,57 @@ struct Packed7BitArrayBuilder
         return { bytesWritten, bitsInCurrentByte };
     }
 
+    /** Empties the array, so that the builder can be reused. */
+    void reset() noexcept
+    {
+        bytesWritten = 0;
+        bitsInCurrentByte = 0;
+    }
+
     void restore (State state) noexcept
     {
         bytesWritten = state.bytesWritten;
         bitsInCurrentByte = state.bitsInCurrentByte;
+
+        // Anything written after the state was saved may have left bits in the current byte
+        if (bitsInCurrentByte > 0)
+            data[bytesWritten] &= (juce::uint8) ((1 << bitsInCurrentByte) - 1);
     }
 
 private:
     juce::uint8 data[(size_t) allocatedBytes];
     int bytesWritten = 0, bitsInCurrentByte = 0;
+
+    /*  Values are written by shifting them into a 64-bit accumulator above any bits that
+        are already in the current byte, and then writing out the accumulator 7 bits at a time.
+        The bits above bitsInCurrentByte in the current byte are always clear.
+    */
+    juce::uint64 startAccumulator (juce::uint32 value) const noexcept
+    {
+        auto accumulator = (juce::uint64) value << bitsInCurrentByte;
+
+        if (bitsInCurrentByte > 0)
+            accumulator |= data[bytesWritten];
+
+        return accumulator;
+    }
+
+    void flushByte (juce::uint64& accumulator, int& bitsInAccumulator) noexcept
+    {
+        data[bytesWritten++] = (juce::uint8) (accumulator & 0x7f);
+        accumulator >>= 7;
+        bitsInAccumulator -= 7;
+    }
+
+    void finishAccumulator (juce::uint64 accumulator, int bitsInAccumulator) noexcept
+    {
+        jassert (bitsInAccumulator < 7);
+
+        if (bitsInAccumulator > 0)
+            data[bytesWritten] = (juce::uint8) accumulator;
+
+        bitsInCurrentByte = bitsInAccumulator;
+    }
 };
 
 
@@ -0,0 +1,256 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+namespace BlocksProtocol
+{
+
+/**
+    Packs small host messages for a device into as few packets as possible.
+
+    Each message is written into a pending packet, which is sent when the next
+    message won't fit into it, when flush() is called, or when the oldest message
+    in it has waited for the maximum latency. This saves the header, checksum and
+    footer bytes, and the MIDI write, that each message would otherwise need.
+
+    Packing is off unless setPackingEnabled() is called, since not every firmware
+    version has been checked to handle more than one host message in a packet. While
+    it's off, each message is sent in a packet of its own as soon as it's added.
+
+    Any messages that have to reach the device in order with the ones in the
+    aggregator should only be sent after calling flush().
+
+    The aggregator doesn't own a timer. Whenever a pending packet needs a deadline,
+    it asks the FlushScheduler to call flush() after the maximum latency, and it
+    cancels that when the packet is sent.
+
+    @tags{Blocks}
+*/
+struct HostMessageAggregator
+{
+    static constexpr int maxPacketBytes = 128;
+    static constexpr int defaultMaxLatencyMs = 5;
+    static constexpr int maxHeldProgramEvents = 16;
+
+    using PacketBuilder = HostPacketBuilder<maxPacketBytes>;
+    using PacketSender = std::function<bool (const PacketBuilder&)>;
+
+    /** Called with the number of milliseconds after which flush() should be called,
+        or with -1 to cancel a call that was requested earlier.
+    */
+    using FlushScheduler = std::function<void (int delayMs)>;
+
+    HostMessageAggregator (PacketSender sender, FlushScheduler scheduler, int maxLatency = defaultMaxLatencyMs)
+        : sendPacket (std::move (sender)), scheduleFlush (std::move (scheduler)), maxLatencyMs (maxLatency)
+    {
+        heldProgramEvents.ensureStorageAllocated (maxHeldProgramEvents);
+    }
+
+    /** Sets the longest time that a message may wait in the pending packet. */
+    void setMaxLatency (int newMaxLatencyMs) noexcept    { maxLatencyMs = juce::jmax (1, newMaxLatencyMs); }
+
+    /** Enables or disables packing several messages into each packet. If it's disabled,
+        any pending packet is sent straight away.
+    */
+    void setPackingEnabled (bool shouldPack)
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (! shouldPack)
+            sendPendingPacket();
+
+        packingEnabled = shouldPack;
+    }
+
+    bool isPackingEnabled() const noexcept          { return packingEnabled; }
+
+    /** Adds a message to the pending packet. The build function is called with the
+        pending packet builder, and should add the message to it, returning false if
+        the message doesn't fit. Returns false if the message couldn't be added at all.
+    */
+    template <typename BuildFn>
+    bool addMessage (TopologyIndex deviceIndex, BuildFn&& buildFn)
+    {
+        const juce::ScopedLock sl (lock);
+        writeHeldProgramEvents();
+        return writeMessage (deviceIndex, buildFn);
+    }
+
+    /** Adds a program event message.
+
+        If numKeyValues is greater than 0, the event is held back rather than written
+        straight into the packet. It replaces the most recently held event if that one's
+        first numKeyValues values are the same, and is held after it otherwise, so that
+        an event never overtakes one with a different key. Held events are written when
+        anything else is added or the aggregator is flushed, so they stay in order with
+        the other messages, and once maxHeldProgramEvents of them are being held.
+    */
+    bool addProgramEvent (TopologyIndex deviceIndex, const juce::int32* values, int numKeyValues = 0)
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (numKeyValues <= 0 || (! heldProgramEvents.isEmpty() && deviceIndex != heldEventsDeviceIndex))
+            writeHeldProgramEvents();
+
+        if (numKeyValues <= 0)
+            return writeMessage (deviceIndex, [values] (PacketBuilder& p) { return p.addProgramEventMessage (values); });
+
+        numKeyValues = juce::jmin (numKeyValues, (int) numProgramMessageInts);
+
+        if (! heldProgramEvents.isEmpty())
+        {
+            auto& last = heldProgramEvents.getReference (heldProgramEvents.size() - 1);
+
+            if (std::equal (values, values + numKeyValues, last.values))
+            {
+                std::copy (values, values + numProgramMessageInts, last.values);
+                return true;
+            }
+        }
+
+        if (heldProgramEvents.size() >= maxHeldProgramEvents)
+            writeHeldProgramEvents();
+
+        HeldProgramEvent e;
+        std::copy (values, values + numProgramMessageInts, e.values);
+        heldProgramEvents.add (e);
+        heldEventsDeviceIndex = deviceIndex;
+        startDeadline();
+        return true;
+    }
+
+    /** Sends the pending packet, if there is one. */
+    bool flush()
+    {
+        const juce::ScopedLock sl (lock);
+        writeHeldProgramEvents();
+        return sendPendingPacket();
+    }
+
+    /** Throws away any pending messages without sending them. */
+    void discardPendingMessages()
+    {
+        const juce::ScopedLock sl (lock);
+        heldProgramEvents.clearQuick();
+        numPendingMessages = 0;
+        cancelDeadline();
+    }
+
+    int getNumPendingMessages() const noexcept      { return numPendingMessages + heldProgramEvents.size(); }
+
+private:
+    struct HeldProgramEvent
+    {
+        juce::int32 values[numProgramMessageInts];
+    };
+
+    PacketSender sendPacket;
+    FlushScheduler scheduleFlush;
+    PacketBuilder packet;
+    TopologyIndex pendingDeviceIndex = 0, heldEventsDeviceIndex = 0;
+    int numPendingMessages = 0;
+    int maxLatencyMs;
+    bool packingEnabled = false, deadlineScheduled = false;
+    juce::Array<HeldProgramEvent> heldProgramEvents;
+    juce::CriticalSection lock;
+
+    template <typename BuildFn>
+    bool writeMessage (TopologyIndex deviceIndex, BuildFn&& buildFn)
+    {
+        if (numPendingMessages > 0 && deviceIndex != pendingDeviceIndex)
+            sendPendingPacket();
+
+        if (numPendingMessages == 0)
+            startPacket (deviceIndex);
+
+        if (! buildFn (packet))
+        {
+            if (numPendingMessages == 0)
+                return false;
+
+            sendPendingPacket();
+            startPacket (deviceIndex);
+
+            if (! buildFn (packet))
+                return false;
+        }
+
+        ++numPendingMessages;
+
+        if (! packingEnabled)
+            return sendPendingPacket();
+
+        startDeadline();
+        return true;
+    }
+
+    void writeHeldProgramEvents()
+    {
+        for (auto& e : heldProgramEvents)
+            writeMessage (heldEventsDeviceIndex, [&e] (PacketBuilder& p) { return p.addProgramEventMessage (e.values); });
+
+        heldProgramEvents.clearQuick();
+    }
+
+    void startDeadline()
+    {
+        if (! deadlineScheduled && scheduleFlush != nullptr)
+        {
+            deadlineScheduled = true;
+            scheduleFlush (maxLatencyMs);
+        }
+    }
+
+    void cancelDeadline()
+    {
+        if (deadlineScheduled && scheduleFlush != nullptr)
+        {
+            deadlineScheduled = false;
+            scheduleFlush (-1);
+        }
+    }
+
+    void startPacket (TopologyIndex deviceIndex) noexcept
+    {
+        packet.reset();
+        packet.writePacketSysexHeaderBytes (deviceIndex);
+        pendingDeviceIndex = deviceIndex;
+    }
+
+    bool sendPendingPacket()
+    {
+        if (heldProgramEvents.isEmpty())
+            cancelDeadline();
+
+        if (numPendingMessages == 0)
+            return true;
+
+        numPendingMessages = 0;
+
+        packet.writePacketSysexFooter();
+        return sendPacket != nullptr && sendPacket (packet);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (HostMessageAggregator)
+};
+
+} // namespace BlocksProtocol
+} // namespace roli
@@ -38,6 +38,9 @@ struct HostPacketBuilder
     const void* getData() const noexcept        { return data.getData(); }
     int size() const noexcept                   { return data.size(); }
 
+    /** Clears the packet, so that the builder can be used to build another one. */
+    void reset() noexcept                       { data.reset(); }
+
     //==============================================================================
     void writePacketSysexHeaderBytes (TopologyIndex deviceIndex) noexcept
     {
@@ -48,6 +51,13 @@ struct HostPacketBuilder
         data.writeHeaderSysexBytes (deviceIndex);
     }
 
+    void setPacketSysexDeviceIndex (TopologyIndex deviceIndex) noexcept
+    {
+        jassert ((deviceIndex & 64) == 0);
+
+        data.setHeaderSysexDeviceIndex (deviceIndex);
+    }
+
     void writePacketSysexFooter() noexcept
     {
         data.writePacketSysexFooter();
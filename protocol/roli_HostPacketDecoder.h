@@ -23,6 +23,16 @@ namespace roli
 namespace BlocksProtocol
 {
 
+/*  A handler that declares "static constexpr bool ignoresLogMessages = true" has log
+    messages skipped without being decoded, so that no String is built for them.
+*/
+template <typename Handler, typename = void>
+struct HandlerIgnoresLogMessages  : std::false_type {};
+
+template <typename Handler>
+struct HandlerIgnoresLogMessages<Handler, decltype ((void) Handler::ignoresLogMessages)>
+    : std::integral_constant<bool, Handler::ignoresLogMessages> {};
+
 /**
     Parses data packets from a BLOCKS device, and translates them into callbacks
     on a handler object
@@ -364,6 +374,10 @@ struct HostPacketDecoder
 
     static bool handleLogMessage (Handler& handler, Packed7BitArrayReader& reader, TopologyIndex deviceIndex)
     {
+        // A log message takes up the rest of the packet, so skipping it ends the packet
+        if (HandlerIgnoresLogMessages<Handler>::value)
+            return false;
+
         juce::String message;
 
         while (reader.getRemainingBits() >= 7)
@@ -20,6 +20,7 @@
 
 #include "roli_blocks_basics.h"
 
+#include <bitset>
 #include <regex>
 
 namespace roli
@@ -31,12 +32,19 @@ namespace roli
 #include "protocol/roli_BlocksProtocolDefinitions.h"
 #include "protocol/roli_HostPacketDecoder.h"
 #include "protocol/roli_HostPacketBuilder.h"
+#include "protocol/roli_HostMessageAggregator.h"
 #include "blocks/roli_BlockConfigManager.h"
 #include "protocol/roli_BlockModels.h"
 #include "blocks/roli_Block.cpp"
 #include "blocks/roli_BlocksVersion.cpp"
+#include "topology/roli_HeadlessEngine.cpp"
 #include "topology/roli_BlockGraph.cpp"
 #include "topology/roli_PhysicalTopologySource.cpp"
+#include "topology/roli_SysexTrafficRecording.cpp"
+#include "topology/roli_AlsaRawMidiDeviceDetector.cpp"
+#include "topology/roli_SimulatedDeviceDetector.cpp"
+#include "topology/roli_BlocksBroker.cpp"
+#include "topology/roli_NetworkBridge.cpp"
 #include "topology/roli_RuleBasedTopologySource.cpp"
 #include "visualisers/roli_DrumPadLEDProgram.cpp"
 #include "visualisers/roli_BitmapLEDProgram.cpp"
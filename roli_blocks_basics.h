@@ -48,6 +48,7 @@
 //==============================================================================
 #include <juce_events/juce_events.h>
 #include <juce_audio_devices/juce_audio_devices.h>
+#include <unordered_map>
 
 namespace roli
 {
@@ -71,7 +72,14 @@ namespace roli
 #include "topology/roli_Topology.h"
 #include "topology/roli_BlockGraph.h"
 #include "topology/roli_TopologySource.h"
+#include "topology/roli_HeadlessEngine.h"
 #include "topology/roli_PhysicalTopologySource.h"
+#include "topology/roli_RealtimeTouchQueue.h"
+#include "topology/roli_SysexTrafficRecording.h"
+#include "topology/roli_AlsaRawMidiDeviceDetector.h"
+#include "topology/roli_SimulatedDeviceDetector.h"
+#include "topology/roli_BlocksBroker.h"
+#include "topology/roli_NetworkBridge.h"
 #include "topology/roli_RuleBasedTopologySource.h"
 #include "visualisers/roli_DrumPadLEDProgram.h"
 #include "visualisers/roli_BitmapLEDProgram.h"
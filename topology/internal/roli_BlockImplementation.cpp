@@ -24,7 +24,7 @@ namespace roli
 template <typename Detector>
 struct BlockImplementation  : public Block,
                               private MIDIDeviceConnection::Listener,
-                              private juce::Timer
+                              private EventLoopTimer
 {
 public:
     struct ControlButtonImplementation;
@@ -39,8 +39,12 @@ public:
           modelData (deviceInfo.serial),
           remoteHeap (modelData.programAndHeapSize),
           detector (&detectorToUse),
+          outgoingMessages ([this] (const BlocksProtocol::HostMessageAggregator::PacketBuilder& p)
+                            { return detector != nullptr && detector->sendMessageToDevice (uid, p); },
+                            [this] (int delayMs) { outgoingMessagesFlushTimer.schedule (delayMs); }),
           config (modelData.defaultConfig)
     {
+        config.setMessageAggregator (&outgoingMessages);
         markReconnected (deviceInfo);
 
         if (modelData.hasTouchSurface)
@@ -62,22 +66,41 @@ public:
 
     ~BlockImplementation() override
     {
+        flushPendingMessages();
         markDisconnected();
     }
 
     void markDisconnected()
     {
+        outgoingMessages.discardPendingMessages();
+
         if (auto surface = dynamic_cast<TouchSurfaceImplementation*> (touchSurface.get()))
             surface->disableTouchSurface();
 
         disconnectMidiConnectionListener();
         connectionTime = juce::Time();
+
+        if (isProgramLoaded)
+        {
+            lastLoadedProgram.packetCounter = remoteHeap.getLastPacketIndexReceived();
+            lastLoadedProgram.disconnectionTime = juce::Time::getCurrentTime();
+        }
+        else
+        {
+            lastLoadedProgram = {};
+        }
+
+        heldProgramCheck = HeldProgramCheck::none;
+        isProgramLoadWaitingForCheck = false;
     }
 
     void markReconnected (const DeviceInfo& deviceInfo)
     {
         if (wasPowerCycled())
+        {
             resetPowerCycleFlag();
+            lastLoadedProgram = {};
+        }
 
         if (connectionTime == juce::Time())
             connectionTime = juce::Time::getCurrentTime();
@@ -88,6 +111,9 @@ public:
 
         setProgram (nullptr);
 
+        if (lastLoadedProgram.disconnectionTime != juce::Time())
+            startHeldProgramCheck();
+
         if (auto surface = dynamic_cast<TouchSurfaceImplementation*> (touchSurface.get()))
             surface->activateTouchSurface();
 
@@ -217,16 +243,32 @@ public:
     template <typename PacketBuilder>
     bool sendMessageToDevice (const PacketBuilder& builder)
     {
+        // Any queued messages were added before this one, so they have to go first
+        flushPendingMessages();
+
         if (detector != nullptr)
             return detector->sendMessageToDevice (uid, builder);
 
         return false;
     }
 
+    bool isReadyToSendHeapData() const
+    {
+        if (detector != nullptr)
+            return detector->isReadyToSendHeapData (uid, bandwidthWeight);
+
+        return false;
+    }
+
     bool sendCommandMessage (juce::uint32 commandID)
     {
-        return buildAndSendPacket<64> ([commandID] (BlocksProtocol::HostPacketBuilder<64>& p)
-                                       { return p.deviceControlMessage (commandID); });
+        return queueMessage ([commandID] (auto& p) { return p.deviceControlMessage (commandID); });
+    }
+
+    /** Sends any messages that are waiting to be packed together with others. */
+    bool flushPendingMessages()
+    {
+        return outgoingMessages.flush();
     }
 
     void handleProgramEvent (const ProgramEventMessage& message)
@@ -255,6 +297,35 @@ public:
         return getFrom (&b);
     }
 
+    /** Given all the blocks on a connection, checks whether they can share their heap
+        changes, and if so, broadcasts any pending changes to all of them at once.
+        Otherwise each block goes back to sending its own changes.
+    */
+    static void sendSharedHeapChanges (const juce::Array<BlockImplementation*>& blocks)
+    {
+        auto* first = blocks.getFirst();
+        bool canShare = blocks.size() > 1;
+
+        for (auto* b : blocks)
+            canShare = canShare && b->heapSyncMode == HeapSyncMode::group
+                                && b->heldProgramCheck != HeldProgramCheck::awaitingACK
+                                && b->getDeviceIndex() >= 0
+                                && b->remoteHeap.canShareChangesWith (first->remoteHeap);
+
+        juce::Array<RemoteHeapType*> otherHeaps;
+
+        for (auto* b : blocks)
+        {
+            b->remoteHeap.setSharingChangesWithGroup (canShare);
+
+            if (b != first)
+                otherHeaps.add (&b->remoteHeap);
+        }
+
+        if (canShare)
+            first->remoteHeap.sendChangesToGroup (*first, otherHeaps);
+    }
+
     //==============================================================================
     std::function<void (const Block& block, const juce::String&)> logger;
 
@@ -286,7 +357,7 @@ public:
         {
             if (isProgramLoaded)
             {
-                juce::MessageManager::callAsync ([blockRef = Block::Ptr (this), this]
+                callOnEventLoop ([blockRef = Block::Ptr (this), this]
                 {
                     programLoadedListeners.call ([&] (ProgramLoadedListener& l) { l.handleProgramLoaded (*this); });
                 });
@@ -305,6 +376,9 @@ public:
 
         programSize = 0;
         isProgramLoaded = false;
+        isProgramLoadWaitingForCheck = false;
+        programPersistency = persistency;
+        remoteHeap.resetTrafficClasses();
 
         if (program == nullptr)
         {
@@ -319,23 +393,62 @@ public:
 
         programSize = (juce::uint32) compiler.compiledObjectCode.size();
 
-        remoteHeap.resetDataRangeToUnknown (0, remoteHeap.blockSize);
-        remoteHeap.clearTargetData();
-        remoteHeap.sendChanges (*this, true);
+        if (heldProgramCheck == HeldProgramCheck::awaitingACK && deviceMayStillHoldProgram())
+        {
+            // Nothing is sent until the device has said whether it still holds this program
+            isProgramLoadWaitingForCheck = true;
+            startTimer (20);
+            return juce::Result::ok();
+        }
+
+        sendProgram();
+        return juce::Result::ok();
+    }
+
+    void sendProgram()
+    {
+        if (deviceStillHoldsProgram())
+        {
+            // The block kept this program in memory while it was disconnected, so only its heap needs sending
+            LOG_CONNECTIVITY ("Skipping program upload to " << serialNumber << ", the device still holds it");
+            remoteHeap.setDeviceStateKnown (0, compiler.compiledObjectCode.begin(), programSize);
+            remoteHeap.resetDataRangeToUnknown (programSize, remoteHeap.blockSize - programSize);
+        }
+        else if (programUploadMode == ProgramUploadMode::differential)
+        {
+            // The old program is stopped first by zeroing its header, as a full upload does, so
+            // the device never runs bytecode that's been partly patched. The rest of the bytecode
+            // already on the device is kept so that only the differences get sent, but the old
+            // program may have written to its heap, so that can't be trusted.
+            const juce::uint8 emptyHeader[littlefoot::Program::programHeaderSize] = {};
+            remoteHeap.resetDataRangeToUnknown (0, sizeof (emptyHeader));
+            remoteHeap.setBytes (0, emptyHeader, sizeof (emptyHeader));
+            remoteHeap.sendChanges (*this, true);
+
+            remoteHeap.resetDataRangeToUnknown (programSize, remoteHeap.blockSize - programSize);
+        }
+        else
+        {
+            remoteHeap.resetDataRangeToUnknown (0, remoteHeap.blockSize);
+            remoteHeap.clearTargetData();
+            remoteHeap.sendChanges (*this, true);
+
+            remoteHeap.resetDataRangeToUnknown (0, programSize);
+        }
 
-        remoteHeap.resetDataRangeToUnknown (0, programSize);
+        remoteHeap.clearTargetData();
         remoteHeap.setBytes (0, compiler.compiledObjectCode.begin(), programSize);
         remoteHeap.sendChanges (*this, true);
 
+        lastLoadedProgram = {};
+        heldProgramCheck = HeldProgramCheck::none;
+
         this->resetConfigListActiveStatus();
 
         const auto legacyProgramChangeConfigIndex = getMaxConfigIndex();
         handleConfigItemChanged ({ legacyProgramChangeConfigIndex }, legacyProgramChangeConfigIndex);
 
-        programPersistency = persistency;
         startTimer (20);
-
-        return juce::Result::ok();
     }
 
     juce::Result compileProgram()
@@ -359,24 +472,61 @@ public:
     Program* getProgram() const override    { return program.get(); }
 
     void sendProgramEvent (const ProgramEventMessage& message) override
+    {
+        sendProgramEvents (&message, 1);
+    }
+
+    void sendProgramEvents (const ProgramEventMessage* messages, int numMessages) override
     {
         static_assert (sizeof (ProgramEventMessage::values) == 4 * BlocksProtocol::numProgramMessageInts,
                        "Need to keep the internal and external messages structures the same");
 
-        if (remoteHeap.isProgramLoaded())
+        if (! remoteHeap.isProgramLoaded())
+            return;
+
+        auto index = getDeviceIndex();
+
+        if (index < 0)
         {
-            buildAndSendPacket<128> ([&message] (BlocksProtocol::HostPacketBuilder<128>& p)
-                                     { return p.addProgramEventMessage (message.values); });
+            jassertfalse;
+            return;
         }
+
+        for (int i = 0; i < numMessages; ++i)
+            outgoingMessages.addProgramEvent ((BlocksProtocol::TopologyIndex) index, messages[i].values, programEventMergeKeySize);
+    }
+
+    void setProgramEventMergeKeySize (int numKeyValues) override
+    {
+        programEventMergeKeySize = juce::jlimit (0, (int) BlocksProtocol::numProgramMessageInts, numKeyValues);
+    }
+
+    void setMessagePackingEnabled (bool shouldPackMessages) override
+    {
+        outgoingMessages.setPackingEnabled (shouldPackMessages);
     }
 
     void timerCallback() override
     {
+        if (isProgramLoadWaitingForCheck)
+        {
+            if (hasHeldProgramCheckTimedOut())
+                finishHeldProgramCheck (false);
+
+            return;
+        }
+
         if (remoteHeap.isFullySynced() && remoteHeap.isProgramLoaded())
         {
             isProgramLoaded = true;
             stopTimer();
 
+            lastLoadedProgram.checksum = littlefoot::Program (compiler.compiledObjectCode.begin(), programSize).getStoredChecksum();
+            lastLoadedProgram.size = programSize;
+
+            LOG_CONNECTIVITY ("Program loaded on " << serialNumber << ", "
+                              << (juce::Time::getCurrentTime() - connectionTime).inMilliseconds() << " ms after connection");
+
             if (programPersistency == ProgramPersistency::setAsDefault)
                 doSaveProgramAsDefault();
 
@@ -431,6 +581,26 @@ public:
         remoteHeap.setBits (programSize * 8 + startBit, numBits, value);
     }
 
+    void setDataPriority (size_t offset, size_t num, DataPriority priority) override
+    {
+        remoteHeap.setTrafficClass (programSize + offset, num, priority == DataPriority::realtime ? RemoteHeapType::realtime
+                                                                                                 : RemoteHeapType::bulk);
+    }
+
+    DataLatencyStats getDataLatencyStats (DataPriority priority) override
+    {
+        auto stats = remoteHeap.getLatencyStats (priority == DataPriority::realtime ? RemoteHeapType::realtime
+                                                                                    : RemoteHeapType::bulk);
+        DataLatencyStats result;
+        result.numPackets = stats.numPackets;
+        result.maxMs = stats.maxMs;
+
+        if (stats.numPackets > 0)
+            result.averageMs = stats.totalMs / stats.numPackets;
+
+        return result;
+    }
+
     juce::uint8 getDataByte (size_t offset) override
     {
         return remoteHeap.getByte (programSize + offset);
@@ -440,6 +610,9 @@ public:
     {
         pingFromDevice();
         remoteHeap.handleACKFromDevice (*this, packetCounter);
+
+        if (heldProgramCheck == HeldProgramCheck::awaitingACK)
+            finishHeldProgramCheck (packetCounter == lastLoadedProgram.packetCounter);
     }
 
     bool sendFirmwareUpdatePacket (const juce::uint8* data, juce::uint8 size, std::function<void (juce::uint8, juce::uint32)> callback) override
@@ -482,59 +655,68 @@ public:
 
     MIDIDeviceConnection* getDeviceConnection()
     {
-        return dynamic_cast<MIDIDeviceConnection*> (detector->getDeviceConnectionFor (*this));
+        if (detector != nullptr)
+            return dynamic_cast<MIDIDeviceConnection*> (detector->getDeviceConnectionFor (*this));
+
+        return nullptr;
     }
 
     void addDataInputPortListener (DataInputPortListener* listener) override
     {
-        if (auto deviceConnection = getDeviceConnection())
-        {
-            {
-                juce::ScopedLock scopedLock (deviceConnection->criticalSecton);
-                Block::addDataInputPortListener (listener);
-            }
+        dataPortListeners.update ([listener] (juce::Array<DataInputPortListener*>& l) { l.addIfNotAlreadyThere (listener); });
 
+        if (auto deviceConnection = getDeviceConnection())
             deviceConnection->midiInput->start();
-        }
-        else
-        {
-            Block::addDataInputPortListener (listener);
-        }
     }
 
     void removeDataInputPortListener (DataInputPortListener* listener) override
     {
-        if (auto deviceConnection = getDeviceConnection())
-        {
-            {
-                juce::ScopedLock scopedLock (deviceConnection->criticalSecton);
-                Block::removeDataInputPortListener (listener);
-            }
-        }
-        else
-        {
-            Block::removeDataInputPortListener (listener);
-        }
+        dataPortListeners.update ([listener] (juce::Array<DataInputPortListener*>& l) { l.removeFirstMatchingValue (listener); });
     }
 
     void sendMessage (const void* message, size_t messageSize) override
     {
-        if (auto midiOutput = getMidiOutput())
-            midiOutput->sendMessageNow ({ message, (int) messageSize });
+        if (auto deviceConnection = getDeviceConnection())
+            deviceConnection->sendMidiMessage (message, messageSize);
     }
 
     void handleTimerTick()
+    {
+        renderLEDGrid();
+        sendPendingChanges();
+    }
+
+    void renderLEDGrid()
     {
         if (ledGrid != nullptr)
             if (auto renderer = ledGrid->getRenderer())
                 renderer->renderLEDGrid (*ledGrid);
+    }
+
+    /** Sends any queued messages and heap changes, and pings the device if it's time. */
+    void sendPendingChanges()
+    {
+        flushPendingMessages();
 
-        remoteHeap.sendChanges (*this, false);
+        // The heap is left alone until it's known whether the device kept its program
+        if (heldProgramCheck != HeldProgramCheck::awaitingACK)
+            remoteHeap.sendChanges (*this, false);
+        else if (hasHeldProgramCheckTimedOut())
+            finishHeldProgramCheck (false);
 
         if (lastPingSendTime < juce::Time::getCurrentTime() - getPingInterval())
         {
             lastPingSendTime = juce::Time::getCurrentTime();
             sendCommandMessage (BlocksProtocol::ping);
+
+            // The device replies with an ACK for the last heap packet it received, so the
+            // ping is only timed when no other ACK could carry the same counter
+            auto canTimePing = ! remoteHeap.hasPacketsInFlight()
+                                 && heldProgramCheck != HeldProgramCheck::awaitingACK;
+
+            // Send the ping straight away so that its round trip can be timed
+            if (flushPendingMessages() && canTimePing && detector != nullptr)
+                detector->handlePingSent (uid, remoteHeap.getLastPacketIndexReceived());
         }
     }
 
@@ -624,7 +806,7 @@ public:
         buildAndSendPacket<32> ([] (BlocksProtocol::HostPacketBuilder<32>& p)
                                 { return p.addFactoryReset(); });
 
-        juce::Timer::callAfterDelay (5, [ref = juce::WeakReference<BlockImplementation>(this)]
+        EventLoopTimer::callAfterDelay (5, [ref = juce::WeakReference<BlockImplementation>(this)]
         {
             if (ref != nullptr)
                 ref->blockReset();
@@ -676,6 +858,7 @@ public:
     static constexpr juce::uint32 maxBlockSize = BlocksProtocol::padBlockProgramAndHeapSize;
     static constexpr juce::uint32 maxPacketCounter = BlocksProtocol::PacketCounter::maxValue;
     static constexpr juce::uint32 maxPacketSize = 200;
+    static constexpr int broadcastDeviceIndex = BlocksProtocol::topologyIndexForBroadcast;
 
     using PacketBuilder = BlocksProtocol::HostPacketBuilder<maxPacketSize>;
 
@@ -685,14 +868,39 @@ public:
     juce::WeakReference<Detector> detector;
     juce::Time lastPingSendTime, lastPingReceiveTime;
 
+    BlocksProtocol::HostMessageAggregator outgoingMessages;
     BlockConfigManager config;
 
 private:
+    // Flushes the outgoing messages when the aggregator's latency deadline passes
+    struct MessageFlushTimer  : private EventLoopTimer
+    {
+        MessageFlushTimer (BlocksProtocol::HostMessageAggregator& a)  : aggregator (a) {}
+
+        void schedule (int delayMs)
+        {
+            if (delayMs < 0)
+                stopTimer();
+            else
+                startTimer (delayMs);
+        }
+
+        void timerCallback() override       { aggregator.flush(); }
+
+        BlocksProtocol::HostMessageAggregator& aggregator;
+    };
+
+    MessageFlushTimer outgoingMessagesFlushTimer { outgoingMessages };
+
     littlefoot::Compiler compiler;
     std::unique_ptr<Program> program;
     juce::uint32 programSize = 0;
 
     std::function<void (juce::uint8, juce::uint32)> firmwarePacketAckCallback;
+    int programEventMergeKeySize = 0;
+
+    // These are called on the MIDI thread, so they're kept here rather than in Block::dataInputPortListeners
+    CopyOnWriteValue<juce::Array<DataInputPortListener*>> dataPortListeners;
 
     bool isMaster = false;
     Block::UID masterUID = {};
@@ -711,46 +919,116 @@ private:
     bool isProgramLoaded = false;
     bool hasBeenPowerCycled = false;
 
-    void initialiseDeviceIndexAndConnection()
+    /** Identifies the last program that the device was known to be running, so that it doesn't
+        need to be sent again if the block reconnects shortly after dropping out.
+    */
+    struct ProgramImage
     {
-        config.setDeviceIndex ((TopologyIndex) getDeviceIndex());
-        config.setDeviceComms (listenerToMidiConnection);
+        juce::uint16 checksum = 0;
+        juce::uint32 size = 0;
+        juce::uint32 packetCounter = 0; // the last heap packet that the device acknowledged
+        juce::Time disconnectionTime;
+    };
+
+    ProgramImage lastLoadedProgram;
+
+    /*  The block may have been reset or reprogrammed while it was away, so the program
+        it held is only trusted once the device has shown that its heap hasn't changed.
+        A device answers a ping with an ACK for the last heap packet that it received,
+        which will still be the one it acknowledged before disconnecting unless anything
+        else has written to its heap. Until that ACK arrives, no heap changes are sent,
+        and a program that's being loaded waits for it.
+    */
+    enum class HeldProgramCheck
+    {
+        none,
+        awaitingACK,
+        confirmed
+    };
+
+    HeldProgramCheck heldProgramCheck = HeldProgramCheck::none;
+    juce::Time heldProgramCheckStartTime;
+    bool isProgramLoadWaitingForCheck = false;
+
+    static constexpr int maxProgramRetentionMs = 30000;
+    static constexpr int heldProgramCheckTimeoutMs = 1000;
+
+    bool deviceMayStillHoldProgram()
+    {
+        if (lastLoadedProgram.size != programSize || lastLoadedProgram.disconnectionTime == juce::Time())
+            return false;
+
+        if (juce::Time::getCurrentTime() > lastLoadedProgram.disconnectionTime + juce::RelativeTime::milliseconds (maxProgramRetentionMs))
+            return false;
+
+        return littlefoot::Program (compiler.compiledObjectCode.begin(), programSize).getStoredChecksum() == lastLoadedProgram.checksum;
     }
 
-    const juce::MidiInput* getMidiInput() const
+    bool deviceStillHoldsProgram()
     {
-        if (detector != nullptr)
-            if (auto c = dynamic_cast<const MIDIDeviceConnection*> (detector->getDeviceConnectionFor (*this)))
-                return c->midiInput.get();
+        return heldProgramCheck == HeldProgramCheck::confirmed && deviceMayStillHoldProgram();
+    }
 
-        jassertfalse;
-        return nullptr;
+    void startHeldProgramCheck()
+    {
+        heldProgramCheck = HeldProgramCheck::awaitingACK;
+        heldProgramCheckStartTime = juce::Time::getCurrentTime();
+        sendCommandMessage (BlocksProtocol::ping);
     }
 
-    juce::MidiInput* getMidiInput()
+    bool hasHeldProgramCheckTimedOut() const
     {
-        return const_cast<juce::MidiInput*> (static_cast<const BlockImplementation&>(*this).getMidiInput());
+        return juce::Time::getCurrentTime() > heldProgramCheckStartTime + juce::RelativeTime::milliseconds (heldProgramCheckTimeoutMs);
     }
 
-    const juce::MidiOutput* getMidiOutput() const
+    void finishHeldProgramCheck (bool deviceIsUnchanged)
+    {
+        if (deviceIsUnchanged)
+        {
+            heldProgramCheck = HeldProgramCheck::confirmed;
+        }
+        else
+        {
+            LOG_CONNECTIVITY ("The heap of " << serialNumber << " has changed since it disconnected");
+            heldProgramCheck = HeldProgramCheck::none;
+            lastLoadedProgram = {};
+        }
+
+        if (isProgramLoadWaitingForCheck)
+        {
+            isProgramLoadWaitingForCheck = false;
+            sendProgram();
+        }
+    }
+
+    void initialiseDeviceIndexAndConnection()
+    {
+        config.setDeviceIndex ((TopologyIndex) getDeviceIndex());
+        config.setDeviceComms (listenerToMidiConnection);
+    }
+
+    const juce::MidiInput* getMidiInput() const
     {
         if (detector != nullptr)
             if (auto c = dynamic_cast<const MIDIDeviceConnection*> (detector->getDeviceConnectionFor (*this)))
-                return c->midiOutput.get();
+                return c->midiInput.get();
 
         jassertfalse;
         return nullptr;
     }
 
-    juce::MidiOutput* getMidiOutput()
+    juce::MidiInput* getMidiInput()
     {
-        return const_cast<juce::MidiOutput*> (static_cast<const BlockImplementation&>(*this).getMidiOutput());
+        return const_cast<juce::MidiInput*> (static_cast<const BlockImplementation&>(*this).getMidiInput());
     }
 
     void handleIncomingMidiMessage (const juce::MidiMessage& message) override
     {
-        dataInputPortListeners.call ([&] (DataInputPortListener& l) { l.handleIncomingDataPortMessage (*this, message.getRawData(),
-                                                                                                       (size_t) message.getRawDataSize()); });
+        dataPortListeners.read ([&] (const juce::Array<DataInputPortListener*>& listeners)
+        {
+            for (auto* l : listeners)
+                l->handleIncomingDataPortMessage (*this, message.getRawData(), (size_t) message.getRawDataSize());
+        });
     }
 
     void connectionBeingDeleted (const MIDIDeviceConnection& c) override
@@ -786,10 +1064,24 @@ private:
         return sendMessageToDevice (p);
     }
 
+    template <typename MessageBuilderFn>
+    bool queueMessage (MessageBuilderFn buildFn)
+    {
+        auto index = getDeviceIndex();
+
+        if (index < 0)
+        {
+            jassertfalse;
+            return false;
+        }
+
+        return outgoingMessages.addMessage ((BlocksProtocol::TopologyIndex) index, buildFn);
+    }
+
 public:
     //==============================================================================
     struct TouchSurfaceImplementation  : public TouchSurface,
-                                         private Timer
+                                         private EventLoopTimer
     {
         TouchSurfaceImplementation (BlockImplementation& b)  : TouchSurface (b), blockImpl (b)
         {
@@ -881,6 +1173,7 @@ public:
             killTouch.yVelocity         = 0;
             killTouch.zVelocity         = -1.0f;
             killTouch.eventTimestamp    = timeStamp;
+            killTouch.timing            = {};
             killTouch.isTouchStart      = false;
             killTouch.isTouchEnd        = true;
 
@@ -939,10 +1232,13 @@ public:
             return false;
         }
 
-        void broadcastButtonChange (Block::Timestamp timestamp, ControlButton::ButtonFunction button, bool isDown)
+        void broadcastButtonChange (Block::Timestamp timestamp, Block::EventTiming timing,
+                                    ControlButton::ButtonFunction button, bool isDown)
         {
             if (button == buttonInfo.type)
             {
+                lastEventTiming = timing;
+
                 if (wasDown == isDown)
                     sendButtonChangeToListeners (timestamp, ! isDown);
 
@@ -1006,7 +1302,7 @@ public:
 
     //==============================================================================
     struct LEDRowImplementation  : public LEDRow,
-                                   private Timer
+                                   private EventLoopTimer
     {
         LEDRowImplementation (BlockImplementation& b) : LEDRow (b)
         {
@@ -22,7 +22,7 @@ namespace roli
 {
     class BlockSerialReader
         : private MIDIDeviceConnection::Listener,
-          private juce::Timer
+          private EventLoopTimer
     {
     public:
         //==============================================================================
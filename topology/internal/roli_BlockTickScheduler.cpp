@@ -0,0 +1,136 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Decides which blocks should be ticked.
+
+    By default the target rate is the total number of ticks per second, shared between
+    the blocks in turn, with at most one block ticked per call. That's how blocks were
+    always ticked, and it keeps the amount of heap traffic the same however many blocks
+    are connected. Alternatively, the rate can apply to each block separately, so that
+    every block is ticked at the target rate and several can be due at once.
+
+    Every block has a deadline for its next tick, and the blocks whose deadlines have
+    passed are returned in deadline order. The deadlines move on by one block period per
+    tick, so the average rate stays on target even if the caller's timer is a little
+    early or late. A block that misses its deadline by more than a whole block period is
+    rescheduled from the current time, rather than being ticked repeatedly to catch up.
+
+    @tags{Blocks}
+*/
+struct BlockTickScheduler
+{
+    static constexpr double defaultTicksPerSecond = 30.0;
+
+    /** Sets the number of ticks per second, either in total or for each block. */
+    void setTargetRate (double ticksPerSecond, bool isRatePerBlock) noexcept
+    {
+        jassert (ticksPerSecond > 0);
+        targetRate = juce::jlimit (0.1, 1000.0, ticksPerSecond);
+        ratePerBlock = isRatePerBlock;
+        period = juce::Time::secondsToHighResolutionTicks (1.0 / targetRate);
+    }
+
+    double getTargetRate() const noexcept       { return targetRate; }
+    bool isRatePerBlock() const noexcept        { return ratePerBlock; }
+
+    /** Returns the time between ticks at the target rate, which is how often the
+        caller should call getBlocksDue.
+    */
+    juce::int64 getPeriod() const noexcept      { return period; }
+
+    /** Fills dueBlocks with the blocks that should be ticked at the given time, most
+        overdue first. Blocks that aren't in the list are forgotten about, and new ones
+        are due straight away.
+
+        A block is counted as due when its deadline is less than half a period away, so
+        that a caller whose timer runs at the target rate won't skip a tick because it
+        fires slightly early. Unless the rate is per block, only the most overdue block
+        is returned.
+    */
+    void getBlocksDue (const juce::Array<Block::UID>& blocks, juce::int64 now, juce::Array<Block::UID>& dueBlocks)
+    {
+        entries.removeIf ([&blocks] (const Entry& e) { return ! blocks.contains (e.uid); });
+        blockPeriod = ratePerBlock ? period : period * juce::jmax (1, blocks.size());
+
+        for (auto uid : blocks)
+            if (findEntry (uid) == nullptr)
+                entries.add ({ uid, now });
+
+        dueEntries.clearQuick();
+
+        for (auto& e : entries)
+            if (e.deadline - now < period / 2)
+                dueEntries.add (e);
+
+        std::sort (dueEntries.begin(), dueEntries.end(),
+                   [] (const Entry& a, const Entry& b) { return a.deadline < b.deadline; });
+
+        if (! ratePerBlock && dueEntries.size() > 1)
+            dueEntries.resize (1);
+
+        dueBlocks.clearQuick();
+
+        for (auto& e : dueEntries)
+            dueBlocks.add (e.uid);
+    }
+
+    /** Moves a block's deadline on after it has been ticked. Blocks that were due but
+        weren't ticked keep their deadlines, so they'll come first next time.
+    */
+    void blockWasTicked (Block::UID uid, juce::int64 now) noexcept
+    {
+        if (auto* e = findEntry (uid))
+        {
+            e->deadline += blockPeriod;
+
+            if (e->deadline < now - blockPeriod)
+                e->deadline = now + blockPeriod;
+        }
+    }
+
+private:
+    struct Entry
+    {
+        Block::UID uid;
+        juce::int64 deadline;
+    };
+
+    juce::Array<Entry> entries, dueEntries;
+    double targetRate = defaultTicksPerSecond;
+    bool ratePerBlock = false;
+    juce::int64 period = juce::Time::secondsToHighResolutionTicks (1.0 / defaultTicksPerSecond);
+    juce::int64 blockPeriod = period;
+
+    Entry* findEntry (Block::UID uid) noexcept
+    {
+        for (auto& e : entries)
+            if (e.uid == uid)
+                return &e;
+
+        return nullptr;
+    }
+};
+
+} // namespace roli
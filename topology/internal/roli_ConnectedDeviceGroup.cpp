@@ -30,26 +30,20 @@ namespace
 }
 
 template <typename Detector>
-struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
-                               private juce::Timer
+struct ConnectedDeviceGroup  : private EventLoopAsyncUpdater,
+                               private EventLoopTimer
 {
     //==============================================================================
     ConnectedDeviceGroup (Detector& d, const juce::String& name, PhysicalTopologySource::DeviceConnection* connection)
         : detector (d), deviceName (name), deviceConnection (connection)
     {
-        if (auto midiDeviceConnection = static_cast<MIDIDeviceConnection*> (deviceConnection.get()))
-        {
-            juce::ScopedLock lock (midiDeviceConnection->criticalSecton);
-            setMidiMessageCallback();
-        }
-        else
-        {
-            setMidiMessageCallback();
-        }
+        setMidiMessageCallback();
+        deviceConnection->callbacksChanged();
 
         if (shouldCheckMasterSerial())
             initialiseSerialReader();
 
+        updateDeviceInfoTables();
         startTimer (timerInterval);
         sendTopologyRequest();
     }
@@ -70,6 +64,11 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
         return getIndexFromDeviceID (uid) >= 0;
     }
 
+    int getNumDevices() const noexcept
+    {
+        return currentDeviceInfo.size();
+    }
+
     void handleBlockRestarting (Block::UID deviceID)
     {
         const auto wasMaster = deviceID == masterBlockUid;
@@ -85,6 +84,17 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
         }
     }
 
+    /** Called when a ping has been sent to a device, so the ACK it replies with can be
+        used to estimate the latency of its connection. The ping must have been the last
+        message sent on the connection, and the device's reply must be the only ACK that
+        can carry the given packet counter.
+    */
+    void handlePingSent (Block::UID deviceID, juce::uint32 expectedPacketCounter)
+    {
+        if (auto* ping = getPing (deviceID))
+            ping->clock.pingSent (deviceConnection->getLastMessageID(), expectedPacketCounter);
+    }
+
     //==============================================================================
     // The following methods will be called by the HostPacketDecoder:
     void beginTopology (int numDevices, int numConnections)
@@ -155,7 +165,9 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
                                     BlocksProtocol::ControlButtonID buttonID, bool isDown)
     {
         if (auto deviceID = getDeviceIDFromIndex (deviceIndex))
-            detector.handleButtonChange (deviceID, deviceTimestampToHost (timestamp), buttonID.get(), isDown);
+            detector.handleButtonChange (deviceID, deviceTimestampToHost (timestamp),
+                                         getEventTiming (deviceID, timestamp, currentPacketArrivalTime),
+                                         buttonID.get(), isDown);
     }
 
     void handleCustomMessage (BlocksProtocol::TopologyIndex deviceIndex, juce::uint32 timestamp, const juce::int32* data)
@@ -173,26 +185,41 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
     {
         if (auto deviceID = getDeviceIDFromIndex (deviceIndex))
         {
-            TouchSurface::Touch touch;
-
-            touch.index             = (int) touchIndex.get();
-            touch.x                 = (float) position.x.toUnipolarFloat();
-            touch.y                 = (float) position.y.toUnipolarFloat();
-            touch.z                 = (float) position.z.toUnipolarFloat();
-            touch.xVelocity         = velocity.vx.toBipolarFloat();
-            touch.yVelocity         = velocity.vy.toBipolarFloat();
-            touch.zVelocity         = velocity.vz.toBipolarFloat();
-            touch.eventTimestamp    = deviceTimestampToHost (timestamp);
-            touch.isTouchStart      = isStart;
-            touch.isTouchEnd        = isEnd;
-            touch.blockUID          = deviceID;
+            auto touch = createTouch (deviceID, timestamp, touchIndex, position, velocity, isStart, isEnd);
+            touch.timing = getEventTiming (deviceID, timestamp, currentPacketArrivalTime);
 
             setTouchStartPosition (touch);
 
+            detector.realtimeTouches.getLatencyRecorder (PhysicalTopologySource::TouchDeliveryPath::messageThread)
+                                    .record (currentPacketArrivalTime);
             detector.handleTouchChange (deviceID, touch);
         }
     }
 
+    static TouchSurface::Touch createTouch (Block::UID deviceID,
+                                            juce::uint32 timestamp,
+                                            BlocksProtocol::TouchIndex touchIndex,
+                                            BlocksProtocol::TouchPosition position,
+                                            BlocksProtocol::TouchVelocity velocity,
+                                            bool isStart, bool isEnd) noexcept
+    {
+        TouchSurface::Touch touch;
+
+        touch.index             = (int) touchIndex.get();
+        touch.x                 = (float) position.x.toUnipolarFloat();
+        touch.y                 = (float) position.y.toUnipolarFloat();
+        touch.z                 = (float) position.z.toUnipolarFloat();
+        touch.xVelocity         = velocity.vx.toBipolarFloat();
+        touch.yVelocity         = velocity.vy.toBipolarFloat();
+        touch.zVelocity         = velocity.vz.toBipolarFloat();
+        touch.eventTimestamp    = deviceTimestampToHost (timestamp);
+        touch.isTouchStart      = isStart;
+        touch.isTouchEnd        = isEnd;
+        touch.blockUID          = deviceID;
+
+        return touch;
+    }
+
     void setTouchStartPosition (TouchSurface::Touch& touch)
     {
         auto& startPos = touchStartPositions.getValue (touch);
@@ -209,6 +236,12 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
     {
         if (auto deviceID = getDeviceIDFromIndex (deviceIndex))
         {
+            if (auto* ping = getPing (deviceID))
+                if (auto pingMessageID = ping->clock.takePingForACK ((juce::uint32) counter.get()))
+                    if (auto sendTime = deviceConnection->getMessageWriteTime (pingMessageID))
+                        if (currentPacketArrivalTime > sendTime)
+                            ping->clock.addRoundTrip (currentPacketArrivalTime - sendTime);
+
             detector.handleSharedDataACK (deviceID, counter);
             updateApiPing (deviceID);
         }
@@ -259,10 +292,24 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
 
     //==============================================================================
     template <typename PacketBuilder>
-    bool sendMessageToDevice (const PacketBuilder& builder) const
+    bool sendMessageToDevice (const PacketBuilder& builder, Block::UID uid = invalidUid)
     {
         if (deviceConnection->sendMessageToDevice (builder.getData(), (size_t) builder.size()))
         {
+            if (isBroadcastPacket (builder.getData(), builder.size()))
+            {
+                juce::Array<Block::UID> uids;
+
+                for (auto& info : currentDeviceInfo)
+                    uids.add (info.uid);
+
+                bandwidthScheduler.registerBytesSent (uids, builder.size());
+            }
+            else
+            {
+                bandwidthScheduler.registerBytesSent (uid, builder.size());
+            }
+
            #if DUMP_BANDWIDTH_STATS
             registerBytesOut (builder.size());
            #endif
@@ -277,6 +324,25 @@ struct ConnectedDeviceGroup  : private juce::AsyncUpdater,
         return deviceConnection.get();
     }
 
+    ConnectionBandwidthScheduler& getBandwidthScheduler() noexcept
+    {
+        return bandwidthScheduler;
+    }
+
+    bool canControlDevice() const
+    {
+        return deviceConnection->canControlDevice();
+    }
+
+    /** Sets the connection's bandwidth budget, depending on the kind of link it is.
+        A limit of 0 means that the connection's bandwidth isn't limited.
+    */
+    void setBandwidthLimit (int usbBytesPerSecond, int bluetoothBytesPerSecond)
+    {
+        bandwidthScheduler.setBytesPerSecond (Detector::isBluetoothConnection (deviceConnection.get())
+                                                ? bluetoothBytesPerSecond : usbBytesPerSecond);
+    }
+
     juce::Array<BlockDeviceConnection> getCurrentDeviceConnections()
     {
         juce::Array<BlockDeviceConnection> connections;
@@ -301,8 +367,13 @@ private:
 
     std::unique_ptr<PhysicalTopologySource::DeviceConnection> deviceConnection;
 
-    juce::CriticalSection incomingPacketLock;
-    juce::Array<juce::MemoryBlock> incomingPackets;
+    ConnectionBandwidthScheduler bandwidthScheduler;
+
+    PacketFifo incomingPackets;
+    int numIncomingPacketsDropped = 0;
+
+    // The arrival time of the packet that the HostPacketDecoder is passing to the handlers
+    juce::int64 currentPacketArrivalTime = 0;
 
     std::unique_ptr<DepreciatedVersionReader> depreciatedVersionReader;
     std::unique_ptr<BlockSerialReader> masterSerialReader;
@@ -310,6 +381,98 @@ private:
     struct TouchStart { float x, y; };
     TouchList<TouchStart> touchStartPositions;
 
+    //==============================================================================
+    /*  When there are real-time touch listeners, each packet is also decoded on the
+        thread that received it, and only its touches are used. That thread can't
+        look at currentDeviceInfo, so it uses these copies of the UID and size of
+        each API-connected device, indexed by topology index.
+    */
+    static constexpr int maxTopologyIndex = 1 << BlocksProtocol::topologyIndexBits;
+    std::atomic<Block::UID> realtimeDeviceUIDs[maxTopologyIndex] = {};
+    std::atomic<juce::uint32> realtimeDeviceSizes[maxTopologyIndex] = {};
+
+    /*  Every packet that arrives names its device by topology index, so rather than
+        searching currentDeviceInfo, these tables hold the position of each device's
+        info by index and by UID. They're rebuilt whenever the list changes, and -1
+        means that there's no such device.
+    */
+    int deviceInfoPositionsByIndex[maxTopologyIndex];
+    std::unordered_map<Block::UID, int> deviceInfoPositionsByUID;
+
+    struct RealtimeTouchDecoder
+    {
+        RealtimeTouchDecoder (ConnectedDeviceGroup& g)  : group (g) {}
+
+        void decode (const juce::uint8* data, int size, juce::int64 packetArrivalTime)
+        {
+            arrivalTime = packetArrivalTime;
+            BlocksProtocol::HostPacketDecoder<RealtimeTouchDecoder>::processNextPacket (*this, *data, data + 1, size - 1);
+        }
+
+        void handleTouchChange (BlocksProtocol::TopologyIndex deviceIndex,
+                                juce::uint32 timestamp,
+                                BlocksProtocol::TouchIndex touchIndex,
+                                BlocksProtocol::TouchPosition position,
+                                BlocksProtocol::TouchVelocity velocity,
+                                bool isStart, bool isEnd)
+        {
+            auto index = deviceIndex & (maxTopologyIndex - 1);
+            auto deviceID = group.realtimeDeviceUIDs[index].load();
+
+            if (deviceID == invalidUid)
+                return;
+
+            auto touch = createTouch (deviceID, timestamp, touchIndex, position, velocity, isStart, isEnd);
+            auto& startPos = startPositions[index][touchIndex.get()];
+
+            if (isStart)
+                startPos = { touch.x, touch.y };
+
+            auto size = group.realtimeDeviceSizes[index].load();
+            auto width  = (float) (size >> 16);
+            auto height = (float) (size & 0xffff);
+
+            touch.x      *= width;
+            touch.y      *= height;
+            touch.startX  = startPos.x * width;
+            touch.startY  = startPos.y * height;
+
+            // The clock estimates belong to the message thread, so only the arrival is known here
+            touch.timing.hostArrivalTime = arrivalTime;
+
+            group.detector.realtimeTouches.dispatch (touch, arrivalTime);
+        }
+
+        // Everything else is left for the message thread, and log messages aren't even
+        // decoded, as that would mean building a String on this thread
+        static constexpr bool ignoresLogMessages = true;
+
+        void beginTopology (int, int)                                                       {}
+        void extendTopology (int, int)                                                      {}
+        void handleTopologyDevice (BlocksProtocol::DeviceStatus)                            {}
+        void handleTopologyConnection (BlocksProtocol::DeviceConnection)                    {}
+        void endTopology()                                                                  {}
+        void handleVersion (BlocksProtocol::DeviceVersion)                                  {}
+        void handleName (BlocksProtocol::DeviceName)                                        {}
+        void handleControlButtonUpDown (BlocksProtocol::TopologyIndex, juce::uint32,
+                                        BlocksProtocol::ControlButtonID, bool)              {}
+        void handleCustomMessage (BlocksProtocol::TopologyIndex, juce::uint32, const juce::int32*) {}
+        void handlePacketACK (BlocksProtocol::TopologyIndex, BlocksProtocol::PacketCounter) {}
+        void handleFirmwareUpdateACK (BlocksProtocol::TopologyIndex, BlocksProtocol::FirmwareUpdateACKCode,
+                                      BlocksProtocol::FirmwareUpdateACKDetail)              {}
+        void handleConfigUpdateMessage (BlocksProtocol::TopologyIndex, juce::int32, juce::int32, juce::int32, juce::int32) {}
+        void handleConfigSetMessage (BlocksProtocol::TopologyIndex, juce::int32, juce::int32) {}
+        void handleConfigFactorySyncEndMessage (BlocksProtocol::TopologyIndex)              {}
+        void handleConfigFactorySyncResetMessage (BlocksProtocol::TopologyIndex)            {}
+        void handleLogMessage (BlocksProtocol::TopologyIndex, const juce::String&)          {}
+
+        ConnectedDeviceGroup& group;
+        juce::int64 arrivalTime = 0;
+        TouchStart startPositions[maxTopologyIndex][1 << BlocksProtocol::TouchIndex::bits] = {};
+    };
+
+    RealtimeTouchDecoder realtimeTouchDecoder { *this };
+
     static constexpr Block::UID invalidUid = 0;
     Block::UID masterBlockUid = invalidUid;
 
@@ -342,13 +505,12 @@ private:
 
     void handleIncomingMessage (const void* data, size_t dataSize)
     {
-        juce::MemoryBlock mb (data, dataSize);
+        auto arrivalTime = juce::Time::getHighResolutionTicks();
 
-        {
-            const juce::ScopedLock sl (incomingPacketLock);
-            incomingPackets.add (std::move (mb));
-        }
+        if (dataSize > 1 && detector.realtimeTouches.hasListeners())
+            realtimeTouchDecoder.decode (static_cast<const juce::uint8*> (data), (int) dataSize, arrivalTime);
 
+        incomingPackets.push (data, dataSize, arrivalTime);
         triggerAsyncUpdate();
 
        #if DUMP_BANDWIDTH_STATS
@@ -358,24 +520,30 @@ private:
 
     void handleAsyncUpdate() override
     {
-        juce::Array<juce::MemoryBlock> packets;
-        packets.ensureStorageAllocated (32);
+        incomingPackets.popAll ([this] (const juce::uint8* data, int size, juce::int64 arrivalTime)
+        {
+            currentPacketArrivalTime = arrivalTime;
+            BlocksProtocol::HostPacketDecoder<ConnectedDeviceGroup>::processNextPacket (*this, *data, data + 1, size - 1);
+        });
 
+        auto numDropped = incomingPackets.getNumPacketsDropped();
+
+        if (numDropped != numIncomingPacketsDropped)
         {
-            const juce::ScopedLock sl (incomingPacketLock);
-            incomingPackets.swapWith (packets);
+            LOG_CONNECTIVITY ("Dropped " << (numDropped - numIncomingPacketsDropped) << " incoming packets from " << deviceName);
+            numIncomingPacketsDropped = numDropped;
         }
+    }
 
-        for (auto& packet : packets)
-        {
-            auto data = static_cast<const juce::uint8*> (packet.getData());
+    static bool isBroadcastPacket (const void* data, int size) noexcept
+    {
+        constexpr auto headerSize = (int) sizeof (BlocksProtocol::roliSysexHeader);
 
-            BlocksProtocol::HostPacketDecoder<ConnectedDeviceGroup>
-            ::processNextPacket (*this, *data, data + 1, (int) packet.getSize() - 1);
-        }
+        return size > headerSize
+                && static_cast<const juce::uint8*> (data)[headerSize] == BlocksProtocol::topologyIndexForBroadcast;
     }
 
-    bool sendCommandMessage (BlocksProtocol::TopologyIndex deviceIndex, juce::uint32 commandID) const
+    bool sendCommandMessage (BlocksProtocol::TopologyIndex deviceIndex, juce::uint32 commandID)
     {
         BlocksProtocol::HostPacketBuilder<64> p;
         p.writePacketSysexHeaderBytes (deviceIndex);
@@ -527,6 +695,7 @@ private:
         Block::UID blockUID;
         juce::Time lastPing;
         juce::Time connected;
+        DeviceClockEstimator clock;
     };
 
     juce::Array<BlockPingTime> blockPings;
@@ -572,9 +741,25 @@ private:
 
             if (const auto info = getDeviceInfoFromUID (uid))
                 detector.handleDeviceAdded (*info);
+
+            updateRealtimeDeviceTable();
         }
     }
 
+    Block::EventTiming getEventTiming (Block::UID uid, juce::uint32 timestamp, juce::int64 arrivalTime)
+    {
+        Block::EventTiming timing;
+        timing.hostArrivalTime = arrivalTime;
+
+        if (auto* ping = getPing (uid))
+        {
+            ping->clock.addEvent (timestamp, arrivalTime);
+            timing.estimatedOriginTime = ping->clock.getHostTimeForEvent (timestamp);
+        }
+
+        return timing;
+    }
+
     bool isApiConnected (Block::UID uid)
     {
         return getPing (uid) != nullptr;
@@ -630,9 +815,8 @@ private:
     //==============================================================================
     Block::UID getDeviceIDFromIndex (BlocksProtocol::TopologyIndex index) noexcept
     {
-        for (const auto& device : currentDeviceInfo)
-            if (device.index == index)
-                return device.uid;
+        if (auto* info = getDeviceInfoFromIndex (index))
+            return info->uid;
 
         scheduleNewTopologyRequest();
         return {};
@@ -640,34 +824,57 @@ private:
 
     int getIndexFromDeviceID (Block::UID uid) const noexcept
     {
-        for (auto& d : currentDeviceInfo)
-            if (d.uid == uid)
-                return d.index;
+        auto found = deviceInfoPositionsByUID.find (uid);
+
+        if (found != deviceInfoPositionsByUID.end())
+            return currentDeviceInfo.getReference (found->second).index;
 
         return -1;
     }
 
     DeviceInfo* getDeviceInfoFromUID (Block::UID uid) noexcept
     {
-        for (auto& d : currentDeviceInfo)
-            if (d.uid == uid)
-                return &d;
+        auto found = deviceInfoPositionsByUID.find (uid);
+
+        if (found != deviceInfoPositionsByUID.end())
+            return &currentDeviceInfo.getReference (found->second);
 
         return nullptr;
     }
 
     DeviceInfo* getDeviceInfoFromIndex (BlocksProtocol::TopologyIndex index) noexcept
     {
-        for (auto& d : currentDeviceInfo)
-            if (d.index == index)
-                return &d;
+        if (index < maxTopologyIndex && deviceInfoPositionsByIndex[index] >= 0)
+            return &currentDeviceInfo.getReference (deviceInfoPositionsByIndex[index]);
 
         return nullptr;
     }
 
     void removeDeviceInfo (Block::UID uid)
     {
+        bandwidthScheduler.removeBlock (uid);
         currentDeviceInfo.removeIf ([uid] (const DeviceInfo& info) { return info.uid == uid; });
+        updateDeviceInfoTables();
+    }
+
+    void updateDeviceInfoTables()
+    {
+        std::fill (std::begin (deviceInfoPositionsByIndex), std::end (deviceInfoPositionsByIndex), -1);
+        deviceInfoPositionsByUID.clear();
+
+        for (int i = 0; i < currentDeviceInfo.size(); ++i)
+            addToDeviceInfoTables (i);
+    }
+
+    void addToDeviceInfoTables (int position)
+    {
+        const auto& info = currentDeviceInfo.getReference (position);
+
+        // If two devices share an index or UID, the first one is found, as it was when the list was searched
+        if (info.index < maxTopologyIndex && deviceInfoPositionsByIndex[info.index] < 0)
+            deviceInfoPositionsByIndex[info.index] = position;
+
+        deviceInfoPositionsByUID.emplace (info.uid, position);
     }
 
     const DeviceStatus* getIncomingDeviceStatus (BlockSerialNumber serialNumber) const
@@ -689,6 +896,7 @@ private:
 
         removeDeviceInfo (uid);
         removePing (uid);
+        updateRealtimeDeviceTable();
     }
 
     void updateCurrentDeviceList()
@@ -726,6 +934,8 @@ private:
             }
         }
 
+        updateDeviceInfoTables();
+
         for (const auto& uid : toRemove)
             removeDevice (uid);
 
@@ -750,6 +960,37 @@ private:
                                          device.batteryLevel,
                                          device.batteryCharging,
                                          masterBlockUid });
+
+                addToDeviceInfoTables (currentDeviceInfo.size() - 1);
+            }
+        }
+
+        updateRealtimeDeviceTable();
+    }
+
+    void updateRealtimeDeviceTable()
+    {
+        Block::UID uids[maxTopologyIndex] = {};
+        juce::uint32 sizes[maxTopologyIndex] = {};
+
+        for (const auto& info : currentDeviceInfo)
+        {
+            if (info.index < maxTopologyIndex && isApiConnected (info.uid))
+            {
+                BlocksProtocol::BlockDataSheet dataSheet (info.serial);
+
+                uids[info.index] = info.uid;
+                sizes[info.index] = ((juce::uint32) dataSheet.widthUnits << 16) | (juce::uint32) dataSheet.heightUnits;
+            }
+        }
+
+        // The size is stored first, so that it's never out of date for a newly visible UID
+        for (int i = 0; i < maxTopologyIndex; ++i)
+        {
+            if (realtimeDeviceUIDs[i].load() != uids[i] || realtimeDeviceSizes[i].load() != sizes[i])
+            {
+                realtimeDeviceSizes[i].store (sizes[i]);
+                realtimeDeviceUIDs[i].store (uids[i]);
             }
         }
     }
@@ -790,13 +1031,13 @@ private:
 
     void initialiseVersionReader()
     {
-        if (auto midiDeviceConnection = static_cast<MIDIDeviceConnection*> (deviceConnection.get()))
+        if (auto midiDeviceConnection = dynamic_cast<MIDIDeviceConnection*> (deviceConnection.get()))
             depreciatedVersionReader = std::make_unique<DepreciatedVersionReader> (*midiDeviceConnection);
     }
 
     void initialiseSerialReader()
     {
-        if (auto midiDeviceConnection = static_cast<MIDIDeviceConnection*> (deviceConnection.get()))
+        if (auto midiDeviceConnection = dynamic_cast<MIDIDeviceConnection*> (deviceConnection.get()))
             masterSerialReader = std::make_unique<BlockSerialReader> (*midiDeviceConnection);
     }
 
@@ -0,0 +1,220 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Shares the bandwidth of a single device connection between all the blocks that
+    are reached through it.
+
+    Every byte sent over the connection is charged to a token bucket that refills at
+    the link's budget. Before a block sends any heap data, it has to ask whether it's
+    allowed to. Heap data is held back while the budget is used up, and the blocks
+    that are kept waiting are served in weighted fair order. So a block streaming LED
+    frames can't starve the others.
+
+    There's no budget unless one is set, in which case nothing is ever held back and
+    the scheduler only counts the bytes sent to each block.
+
+    @tags{Blocks}
+*/
+struct ConnectionBandwidthScheduler
+{
+    ConnectionBandwidthScheduler() = default;
+
+    /** Sets the budget for the connection, or removes it if this is 0. */
+    void setBytesPerSecond (int newBytesPerSecond) noexcept
+    {
+        jassert (newBytesPerSecond >= 0);
+        bytesPerSecond = juce::jmax (0, newBytesPerSecond);
+        maxTokens = juce::jmax (bytesPerSecond / 10.0, 512.0);
+        tokens = juce::jmin (tokens, maxTokens);
+
+        if (! isLimited())
+            for (auto& f : flows)
+                f.isWaiting = false;
+    }
+
+    bool isLimited() const noexcept             { return bytesPerSecond > 0; }
+
+    int getBytesPerSecond() const noexcept      { return bytesPerSecond; }
+
+    /** Returns true if a block may send some heap data now. If not, the block is added
+        to the queue of blocks waiting for their turn.
+    */
+    bool isReadyToSend (Block::UID uid, int weight)
+    {
+        if (! isLimited())
+            return true;
+
+        refill();
+
+        auto& flow = getFlow (uid);
+        flow.weight = juce::jmax (1, weight);
+
+        if (tokens > 0)
+        {
+            auto* next = getNextWaitingFlow();
+
+            if (next == nullptr || next == &flow || ! (next->finishTag < flow.finishTag))
+            {
+                flow.isWaiting = false;
+                return true;
+            }
+        }
+
+        if (! flow.isWaiting)
+        {
+            flow.isWaiting = true;
+            ++numTimesDeferred;
+        }
+
+        return false;
+    }
+
+    /** Charges the budget for some bytes sent over the connection. The UID of the
+        block they were sent to should be given, or 0 if they weren't for any particular block.
+    */
+    void registerBytesSent (Block::UID uid, int numBytes)
+    {
+        refill();
+        tokens -= numBytes;
+
+        if (uid != 0)
+            chargeFlow (getFlow (uid), numBytes);
+    }
+
+    /** Charges the budget for a packet that was broadcast to several blocks at once.
+        Its bytes are split evenly between them.
+    */
+    void registerBytesSent (const juce::Array<Block::UID>& uids, int numBytes)
+    {
+        refill();
+        tokens -= numBytes;
+
+        for (int i = 0; i < uids.size(); ++i)
+            if (uids.getUnchecked (i) != 0)
+                chargeFlow (getFlow (uids.getUnchecked (i)), numBytes / uids.size() + (i < numBytes % uids.size() ? 1 : 0));
+    }
+
+    /** If the budget allows some data to be sent now, this takes the waiting block
+        whose turn is next off the queue and returns its UID. Otherwise it returns 0.
+    */
+    Block::UID getNextBlockToService()
+    {
+        if (! isLimited())
+            return 0;
+
+        refill();
+
+        if (tokens > 0)
+        {
+            if (auto* next = getNextWaitingFlow())
+            {
+                next->isWaiting = false;
+                return next->uid;
+            }
+        }
+
+        return 0;
+    }
+
+    void removeBlock (Block::UID uid)
+    {
+        flows.removeIf ([uid] (const Flow& f) { return f.uid == uid; });
+    }
+
+    juce::uint64 getBytesSent (Block::UID uid) const noexcept
+    {
+        for (auto& f : flows)
+            if (f.uid == uid)
+                return f.bytesSent;
+
+        return 0;
+    }
+
+    int getNumTimesDeferred() const noexcept    { return numTimesDeferred; }
+
+private:
+    struct Flow
+    {
+        Block::UID uid = 0;
+        int weight = 1;
+        double finishTag = 0.0;
+        bool isWaiting = false;
+        juce::uint64 bytesSent = 0;
+    };
+
+    juce::Array<Flow> flows;
+    int bytesPerSecond = 0, numTimesDeferred = 0;
+    double tokens = 0.0, maxTokens = 0.0, virtualTime = 0.0;
+    juce::Time lastRefillTime;
+
+    void chargeFlow (Flow& flow, int numBytes)
+    {
+        auto startTag = juce::jmax (virtualTime, flow.finishTag);
+
+        flow.finishTag = startTag + numBytes / (double) flow.weight;
+        flow.bytesSent += (juce::uint64) numBytes;
+        virtualTime = startTag;
+    }
+
+    void refill()
+    {
+        auto now = juce::Time::getCurrentTime();
+
+        if (lastRefillTime != juce::Time())
+            tokens = juce::jmin (maxTokens, tokens + bytesPerSecond * (now - lastRefillTime).inSeconds());
+        else
+            tokens = maxTokens;
+
+        lastRefillTime = now;
+    }
+
+    Flow& getFlow (Block::UID uid)
+    {
+        for (auto& f : flows)
+            if (f.uid == uid)
+                return f;
+
+        Flow newFlow;
+        newFlow.uid = uid;
+        newFlow.finishTag = virtualTime;
+        flows.add (newFlow);
+        return flows.getReference (flows.size() - 1);
+    }
+
+    Flow* getNextWaitingFlow()
+    {
+        Flow* next = nullptr;
+
+        for (auto& f : flows)
+            if (f.isWaiting && (next == nullptr || f.finishTag < next->finishTag))
+                next = &f;
+
+        return next;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ConnectionBandwidthScheduler)
+};
+
+} // namespace roli
@@ -0,0 +1,137 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Holds a value that can be read from any thread without locking or waiting,
+    while other threads change it.
+
+    A change is made to a copy of the value, which then replaces it. Before
+    update() returns, it waits for any reads of the old value on other threads to
+    finish, so once an object has been removed from a list held this way, it won't
+    be used again. Changes may also be made from inside a read, in which case the
+    old value is kept until the next change made outside a read. Old values are
+    only ever deleted by update(), never by a reader.
+
+    @tags{Blocks}
+*/
+template <typename Type>
+class CopyOnWriteValue
+{
+public:
+    CopyOnWriteValue()  : current (std::make_unique<Type>())
+    {
+        published = current.get();
+    }
+
+    /** Calls the function with the current value. This never blocks. */
+    template <typename Function>
+    void read (Function&& fn) const
+    {
+        ++numReaders;
+
+        auto& innermostRead = getInnermostRead();
+        const ReadScope scope { this, innermostRead };
+        innermostRead = &scope;
+
+        fn (static_cast<const Type&> (*published.load()));
+
+        innermostRead = scope.previous;
+        --numReaders;
+    }
+
+    /** Returns a copy of the current value. */
+    Type getCopy() const
+    {
+        const juce::ScopedLock sl (writeLock);
+        return *current;
+    }
+
+    /** Calls the function to change a copy of the value, and then replaces the
+        current value with it.
+    */
+    template <typename Function>
+    void update (Function&& change)
+    {
+        auto numReadsOnThisThread = countReadsOnThisThread();
+        juce::OwnedArray<Type> oldValues;
+
+        {
+            const juce::ScopedLock sl (writeLock);
+
+            auto newValue = std::make_unique<Type> (*current);
+            change (*newValue);
+            published.store (newValue.get());
+
+            if (numReadsOnThisThread > 0)
+            {
+                retired.add (current.release());
+            }
+            else
+            {
+                oldValues.swapWith (retired);
+                oldValues.add (current.release());
+            }
+
+            current = std::move (newValue);
+        }
+
+        // The lock is released first, so that a reader can make its own change without deadlocking
+        while (numReaders.load() > numReadsOnThisThread)
+            juce::Thread::yield();
+    }
+
+private:
+    struct ReadScope
+    {
+        const CopyOnWriteValue* value;
+        const ReadScope* previous;
+    };
+
+    static const ReadScope*& getInnermostRead() noexcept
+    {
+        thread_local const ReadScope* innermostRead = nullptr;
+        return innermostRead;
+    }
+
+    int countReadsOnThisThread() const noexcept
+    {
+        int n = 0;
+
+        for (auto* scope = getInnermostRead(); scope != nullptr; scope = scope->previous)
+            if (scope->value == this)
+                ++n;
+
+        return n;
+    }
+
+    std::unique_ptr<Type> current;
+    juce::OwnedArray<Type> retired;
+    std::atomic<Type*> published { nullptr };
+    mutable std::atomic<int> numReaders { 0 };
+    juce::CriticalSection writeLock;
+
+    JUCE_DECLARE_NON_COPYABLE (CopyOnWriteValue)
+};
+
+} // namespace roli
@@ -26,7 +26,7 @@ namespace roli
     This class can make requests and process responses to retrieve the master Block version.
 */
 class DepreciatedVersionReader :  private MIDIDeviceConnection::Listener,
-                                  private juce::Timer
+                                  private EventLoopTimer
 {
 public:
     //==============================================================================
@@ -24,25 +24,28 @@ namespace roli
 //==============================================================================
 /** This is the main singleton object that keeps track of connected blocks */
 struct Detector   : public juce::ReferenceCountedObject,
-                    private juce::Timer,
-                    private juce::AsyncUpdater
+                    private EventLoopTimer,
+                    private EventLoopAsyncUpdater
 {
     using BlockImpl = BlockImplementation<Detector>;
     using DeviceConnection = PhysicalTopologySource::DeviceConnection;
     
     Detector()  : defaultDetector (new MIDIDeviceDetector()), deviceDetector (*defaultDetector)
     {
+        listenForDeviceChanges();
         startTimer (10);
     }
 
     Detector (PhysicalTopologySource::DeviceDetector& dd)  : deviceDetector (dd)
     {
+        listenForDeviceChanges();
         startTimer (10);
     }
 
     ~Detector() override
     {
         jassert (activeTopologySources.isEmpty());
+        deviceDetector.setDevicesChangedCallback (nullptr);
     }
 
     using Ptr = juce::ReferenceCountedObjectPtr<Detector>;
@@ -71,9 +74,13 @@ struct Detector   : public juce::ReferenceCountedObject,
         {
             for (auto& b : currentTopology.blocks)
                 if (auto bi = BlockImpl::getFrom (b))
+                {
                     bi->sendCommandMessage (BlocksProtocol::endAPIMode);
+                    bi->flushPendingMessages();
+                }
 
             currentTopology = {};
+            topologyIndex.clear();
 
             auto& d = getDefaultDetectorPointer();
 
@@ -84,13 +91,9 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     bool isConnected (Block::UID deviceID) const noexcept
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED // This method must only be called from the message thread!
-
-        for (auto&& b : currentTopology.blocks)
-            if (b->uid == deviceID)
-                return true;
+        ROLI_ASSERT_EVENT_LOOP_THREAD // This method must only be called from the message thread!
 
-        return false;
+        return topologyIndex.getBlockWithUID (deviceID) != nullptr;
     }
 
     bool isConnectedViaBluetooth (const Block& block) const noexcept
@@ -112,7 +115,7 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleDeviceAdded (const DeviceInfo& info)
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
         const auto blockWasRemoved = containsBlockWithUID (blocksToRemove, info.uid);
         const auto knownBlock = std::find_if (previouslySeenBlocks.begin(), previouslySeenBlocks.end(),
@@ -136,6 +139,7 @@ struct Detector   : public juce::ReferenceCountedObject,
         }
 
         currentTopology.blocks.addIfNotAlreadyThere (block);
+        topologyIndex.addBlock (block);
 
         if (blockWasRemoved)
         {
@@ -155,19 +159,15 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleDeviceRemoved (const DeviceInfo& info)
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
-
-        const auto blockIt = std::find_if (currentTopology.blocks.begin(), currentTopology.blocks.end(),
-                                           [uid = info.uid] (Block::Ptr block) { return uid == block->uid; });
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
-        if (blockIt != currentTopology.blocks.end())
+        if (const Block::Ptr block { topologyIndex.getBlockWithUID (info.uid) })
         {
-            const Block::Ptr block { *blockIt };
-
             if (auto blockImpl = BlockImpl::getFrom (block.get()))
                 blockImpl->markDisconnected();
 
             currentTopology.blocks.removeObject (block);
+            topologyIndex.removeBlock (info.uid);
             previouslySeenBlocks.addIfNotAlreadyThere (block);
 
             blocksToRemove.addIfNotAlreadyThere (block);
@@ -179,7 +179,7 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleConnectionsChanged()
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
         triggerAsyncUpdate();
     }
 
@@ -192,14 +192,8 @@ struct Detector   : public juce::ReferenceCountedObject,
             if (containsBlockWithUID (blocksToRemove, info.uid))
                 continue;
 
-            const auto blockIt = std::find_if (currentTopology.blocks.begin(), currentTopology.blocks.end(),
-                                               [uid = info.uid] (Block::Ptr block) { return uid == block->uid; });
-
-
-            if (blockIt != currentTopology.blocks.end())
+            if (const Block::Ptr block { topologyIndex.getBlockWithUID (info.uid) })
             {
-                const Block::Ptr block { *blockIt };
-
                 if (auto blockImpl = BlockImpl::getFrom (block.get()))
                     blockImpl->updateDeviceInfo (info);
 
@@ -222,21 +216,21 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleBatteryChargingChanged (Block::UID deviceID, const BlocksProtocol::BatteryCharging isCharging)
     {
-        if (auto block = currentTopology.getBlockWithUID (deviceID))
+        if (auto* block = topologyIndex.getBlockWithUID (deviceID))
             if (auto blockImpl = BlockImpl::getFrom (*block))
                 blockImpl->batteryCharging = isCharging;
     }
 
     void handleBatteryLevelChanged (Block::UID deviceID, const BlocksProtocol::BatteryLevel batteryLevel)
     {
-        if (auto block = currentTopology.getBlockWithUID (deviceID))
+        if (auto* block = topologyIndex.getBlockWithUID (deviceID))
             if (auto blockImpl = BlockImpl::getFrom (*block))
                 blockImpl->batteryLevel = batteryLevel;
     }
 
     void handleIndexChanged (Block::UID deviceID, const BlocksProtocol::TopologyIndex index)
     {
-        if (auto block = currentTopology.getBlockWithUID (deviceID))
+        if (auto* block = topologyIndex.getBlockWithUID (deviceID))
             if (auto blockImpl = BlockImpl::getFrom (*block))
                 blockImpl->topologyIndex = index;
     }
@@ -249,7 +243,7 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     juce::Array<Block::UID> getDnaDependentDeviceUIDs (Block::UID uid)
     {
-        JUCE_ASSERT_MESSAGE_THREAD
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
         juce::Array<Block::UID> dependentDeviceUIDs;
 
@@ -276,7 +270,7 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleSharedDataACK (Block::UID deviceID, juce::uint32 packetCounter) const
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
         if (auto* bi = getBlockImplementationWithUID (deviceID))
             bi->handleSharedDataACK (packetCounter);
@@ -325,15 +319,16 @@ struct Detector   : public juce::ReferenceCountedObject,
 
     void handleLogMessage (Block::UID deviceID, const juce::String& message) const
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
         if (auto* bi = getBlockImplementationWithUID (deviceID))
             bi->handleLogMessage (message);
     }
 
-    void handleButtonChange (Block::UID deviceID, Block::Timestamp timestamp, juce::uint32 buttonIndex, bool isDown) const
+    void handleButtonChange (Block::UID deviceID, Block::Timestamp timestamp, Block::EventTiming timing,
+                             juce::uint32 buttonIndex, bool isDown) const
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
         if (auto* bi = getBlockImplementationWithUID (deviceID))
         {
@@ -341,15 +336,15 @@ struct Detector   : public juce::ReferenceCountedObject,
 
             if (juce::isPositiveAndBelow (buttonIndex, bi->getButtons().size()))
                 if (auto* cbi = dynamic_cast<BlockImpl::ControlButtonImplementation*> (bi->getButtons().getUnchecked (int (buttonIndex))))
-                    cbi->broadcastButtonChange (timestamp, bi->modelData.buttons[(int) buttonIndex].type, isDown);
+                    cbi->broadcastButtonChange (timestamp, timing, bi->modelData.buttons[(int) buttonIndex].type, isDown);
         }
     }
 
     void handleTouchChange (Block::UID deviceID, const TouchSurface::Touch& touchEvent)
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
-        auto block = currentTopology.getBlockWithUID (deviceID);
+        auto* block = topologyIndex.getBlockWithUID (deviceID);
         if (block != nullptr)
         {
             if (auto* surface = dynamic_cast<BlockImpl::TouchSurfaceImplementation*> (block->getTouchSurface()))
@@ -385,11 +380,96 @@ struct Detector   : public juce::ReferenceCountedObject,
     {
         for (auto* c : connectedDeviceGroups)
             if (c->contains (deviceID))
-                return c->sendMessageToDevice (builder);
+                return c->sendMessageToDevice (builder, deviceID);
+
+        return false;
+    }
+
+    void handlePingSent (Block::UID deviceID, juce::uint32 expectedPacketCounter) const
+    {
+        for (auto* c : connectedDeviceGroups)
+            if (c->contains (deviceID))
+                c->handlePingSent (deviceID, expectedPacketCounter);
+    }
+
+    bool isReadyToSendHeapData (Block::UID deviceID, int weight) const
+    {
+        for (auto* c : connectedDeviceGroups)
+            if (c->contains (deviceID))
+                return c->canControlDevice() && c->getBandwidthScheduler().isReadyToSend (deviceID, weight);
 
         return false;
     }
 
+    /** Sets the bandwidth budgets of the connections, which apply to any that are opened
+        later too. A limit of 0 means that connections of that kind aren't limited.
+    */
+    void setBandwidthLimits (int usbBytesPerSecond, int bluetoothBytesPerSecond)
+    {
+        usbBandwidthLimit = usbBytesPerSecond;
+        bluetoothBandwidthLimit = bluetoothBytesPerSecond;
+
+        for (auto* group : connectedDeviceGroups)
+            group->setBandwidthLimit (usbBandwidthLimit, bluetoothBandwidthLimit);
+    }
+
+    /** Gives any blocks that were held back by their connection's bandwidth budget
+        a chance to send their heap data, in the order that the scheduler picks.
+    */
+    void serviceBandwidthSchedulers()
+    {
+        for (auto* group : connectedDeviceGroups)
+        {
+            auto& scheduler = group->getBandwidthScheduler();
+
+            // Each block is taken off the queue when it's serviced, and only goes back on
+            // after sending something, so this stops once the budget has been used up.
+            while (auto uid = scheduler.getNextBlockToService())
+            {
+                if (auto* block = topologyIndex.getBlockWithUID (uid))
+                {
+                    if (auto* bi = BlockImpl::getFrom (*block))
+                    {
+                        bi->remoteHeap.sendChanges (*bi, false);
+                        continue;
+                    }
+                }
+
+                scheduler.removeBlock (uid);
+            }
+        }
+    }
+
+    /** Lets the blocks on each connection share their heap changes, if they're able to.
+        A broadcast reaches every device on a connection, so this only happens when all of
+        them are connected to the API.
+    */
+    void sendSharedHeapChanges()
+    {
+        for (auto* group : connectedDeviceGroups)
+        {
+            juce::Array<BlockImpl*> blocks;
+
+            for (auto& b : currentTopology.blocks)
+                if (group->contains (b->uid))
+                    if (auto* bi = BlockImpl::getFrom (*b))
+                        blocks.add (bi);
+
+            if (blocks.isEmpty())
+                continue;
+
+            if (blocks.size() < group->getNumDevices())
+            {
+                for (auto* bi : blocks)
+                    bi->remoteHeap.setSharingChangesWithGroup (false);
+
+                continue;
+            }
+
+            BlockImpl::sendSharedHeapChanges (blocks);
+        }
+    }
+
     static Detector* getFrom (Block& b) noexcept
     {
         if (auto* bi = BlockImpl::getFrom (b))
@@ -427,13 +507,27 @@ struct Detector   : public juce::ReferenceCountedObject,
     juce::Array<PhysicalTopologySource*> activeTopologySources;
 
     BlockTopology currentTopology;
+    BlockTopologyIndex topologyIndex; // kept in step with currentTopology, for looking up blocks by UID
+
+    RealtimeTouchDispatcher realtimeTouches;
 
 private:
     Block::Array previouslySeenBlocks, blocksToAdd, blocksToRemove, blocksToUpdate;
 
+    static constexpr int deviceScanIntervalMs = 1500;
+
+    // Hotplug notifications tend to come in bursts, e.g. one for each port of a
+    // device, so the scan is delayed a little to catch them all at once.
+    static constexpr int devicesChangedScanDelayMs = 50;
+
+    void listenForDeviceChanges()
+    {
+        deviceDetector.setDevicesChangedCallback ([this] { startTimer (devicesChangedScanDelayMs); });
+    }
+
     void timerCallback() override
     {
-        startTimer (1500);
+        startTimer (deviceScanIntervalMs);
 
         auto detectedDevices = deviceDetector.scanForDevices();
 
@@ -465,7 +559,8 @@ private:
             {
                 if (auto d = deviceDetector.openDevice (detectedDevices.indexOf (devName)))
                 {
-                    connectedDeviceGroups.add (new ConnectedDeviceGroup<Detector> (*this, devName, d));
+                    auto* group = connectedDeviceGroups.add (new ConnectedDeviceGroup<Detector> (*this, devName, d));
+                    group->setBandwidthLimit (usbBandwidthLimit, bluetoothBandwidthLimit);
                 }
             }
         }
@@ -482,13 +577,14 @@ private:
 
     BlockImpl* getBlockImplementationWithUID (Block::UID deviceID) const noexcept
     {
-        if (auto block = currentTopology.getBlockWithUID (deviceID))
+        if (auto* block = topologyIndex.getBlockWithUID (deviceID))
             return BlockImpl::getFrom (*block);
 
         return nullptr;
     }
 
     juce::OwnedArray<ConnectedDeviceGroup<Detector>> connectedDeviceGroups;
+    int usbBandwidthLimit = 0, bluetoothBandwidthLimit = 0;
 
     //==============================================================================
     /** This is a friend of the BlocksImplementation that will scan and set the
@@ -498,7 +594,7 @@ private:
     */
     struct BlocksLayoutTraverser
     {
-        static Block::Array updateBlocks (const BlockTopology& topology)
+        static Block::Array updateBlocks (const BlockTopology& topology, const BlockTopologyIndex& index)
         {
             Block::Array updated;
             juce::Array<Block::UID> visited;
@@ -517,7 +613,7 @@ private:
                         }
                     }
 
-                    layoutNeighbours (*block, topology, visited, updated);
+                    layoutNeighbours (*block, index, visited, updated);
                 }
             }
 
@@ -596,19 +692,19 @@ private:
         }
 
         static void layoutNeighbours (const Block::Ptr block,
-                                      const BlockTopology& topology,
+                                      const BlockTopologyIndex& index,
                                       juce::Array<Block::UID>& visited,
                                       Block::Array& updated)
         {
             visited.add (block->uid);
 
-            for (auto& connection : topology.connections)
+            for (auto& connection : index.getConnectionsToBlock (block->uid))
             {
                 if ((connection.device1 == block->uid && ! visited.contains (connection.device2))
                     || (connection.device2 == block->uid && ! visited.contains (connection.device1)))
                 {
                     const auto theirUid = connection.device1 == block->uid ? connection.device2 : connection.device1;
-                    const auto neighbourPtr = topology.getBlockWithUID (theirUid);
+                    const Block::Ptr neighbourPtr { index.getBlockWithUID (theirUid) };
 
                     if (auto* neighbour = dynamic_cast<BlockImpl*> (neighbourPtr.get()))
                     {
@@ -662,7 +758,7 @@ private:
                             }
                         }
 
-                        layoutNeighbours (neighbourPtr, topology, visited, updated);
+                        layoutNeighbours (neighbourPtr, index, visited, updated);
                     }
                 }
             }
@@ -745,7 +841,7 @@ private:
     //==============================================================================
     void updateBlockPositions()
     {
-        const auto updated = BlocksLayoutTraverser::updateBlocks (currentTopology);
+        const auto updated = BlocksLayoutTraverser::updateBlocks (currentTopology, topologyIndex);
 
         for (const auto block : updated)
         {
@@ -762,6 +858,8 @@ private:
 
         for (auto d : connectedDeviceGroups)
             currentTopology.connections.addArray (d->getCurrentDeviceConnections());
+
+        topologyIndex.setConnections (currentTopology.connections);
     }
 
     void handleAsyncUpdate() override
@@ -21,20 +21,40 @@
 namespace roli
 {
 
-struct PhysicalTopologySource::DetectorHolder  : private juce::Timer
+struct PhysicalTopologySource::DetectorHolder  : private EventLoopTimer
 {
     DetectorHolder (PhysicalTopologySource& pts)
         : topologySource (pts),
           detector (Detector::getDefaultDetector())
     {
-        startTimerHz (30);
+        setTickRate (BlockTickScheduler::defaultTicksPerSecond, false);
     }
 
     DetectorHolder (PhysicalTopologySource& pts, DeviceDetector& dd)
         : topologySource (pts),
           detector (new Detector (dd))
     {
-        startTimerHz (30);
+        setTickRate (BlockTickScheduler::defaultTicksPerSecond, false);
+    }
+
+    ~DetectorHolder() override
+    {
+        stopTimer();
+        renderPool.reset();
+    }
+
+    void setTickRate (double ticksPerSecond, bool ratePerBlock)
+    {
+        scheduler.setTargetRate (ticksPerSecond, ratePerBlock);
+        startTimer (juce::jmax (1, juce::roundToInt (1000.0 / scheduler.getTargetRate())));
+    }
+
+    void setNumRenderThreads (int numThreads)
+    {
+        renderPool.reset();
+
+        if (numThreads > 0)
+            renderPool = std::make_unique<juce::ThreadPool> (numThreads);
     }
 
     void timerCallback() override
@@ -43,6 +63,11 @@ struct PhysicalTopologySource::DetectorHolder  : private juce::Timer
             handleTimerTick();
     }
 
+    /** Ticks the blocks that are due, most overdue first. If that takes longer than
+        a whole period, the rest are left for the next call, so that a slow renderer
+        can't hold up the message thread indefinitely. Blocks rendered in parallel
+        are all sent, as their rendering has already been paid for.
+    */
     void handleTimerTick()
     {
         auto blocks = detector->currentTopology.blocks;
@@ -50,19 +75,85 @@ struct PhysicalTopologySource::DetectorHolder  : private juce::Timer
         if (blocks.size() == 0)
             return;
 
-        if (nextIndexToTick >= blocks.size())
-            nextIndexToTick = 0;
+        detector->sendSharedHeapChanges();
+        detector->serviceBandwidthSchedulers();
 
-        if (auto* bi = BlockImplementation<Detector>::getFrom (*blocks [nextIndexToTick]))
-            bi->handleTimerTick();
+        blockUIDs.clearQuick();
+
+        for (auto& b : blocks)
+            blockUIDs.add (b->uid);
+
+        const auto startTime = juce::Time::getHighResolutionTicks();
+        scheduler.getBlocksDue (blockUIDs, startTime, dueBlockUIDs);
 
-        nextIndexToTick = (nextIndexToTick + 1) % blocks.size();
+        dueBlocks.clearQuick();
+
+        for (auto uid : dueBlockUIDs)
+            for (auto& b : blocks)
+                if (b->uid == uid)
+                    if (auto* bi = BlockImplementation<Detector>::getFrom (*b))
+                        dueBlocks.add (bi);
+
+        if (renderPool != nullptr && dueBlocks.size() > 1)
+        {
+            renderInParallel();
+
+            for (auto* bi : dueBlocks)
+            {
+                bi->sendPendingChanges();
+                scheduler.blockWasTicked (bi->uid, juce::Time::getHighResolutionTicks());
+            }
+
+            return;
+        }
+
+        for (auto* bi : dueBlocks)
+        {
+            auto now = juce::Time::getHighResolutionTicks();
+
+            if (now - startTime > scheduler.getPeriod())
+                break;
+
+            bi->handleTimerTick();
+            scheduler.blockWasTicked (bi->uid, now);
+        }
     }
 
     PhysicalTopologySource& topologySource;
     Detector::Ptr detector;
 
-    int nextIndexToTick {0};
+private:
+    BlockTickScheduler scheduler;
+    std::unique_ptr<juce::ThreadPool> renderPool;
+    juce::Array<Block::UID> blockUIDs, dueBlockUIDs;
+    juce::Array<BlockImplementation<Detector>*> dueBlocks;
+
+    static constexpr int renderStallTimeoutMs = 2000;
+
+    // Renders the due blocks' LED grids on the pool and waits for them all to finish.
+    // The messages they produce are sent afterwards, on this thread.
+    void renderInParallel()
+    {
+        std::atomic<int> numRendersRemaining { dueBlocks.size() };
+        juce::WaitableEvent rendersFinished;
+
+        for (auto* bi : dueBlocks)
+        {
+            renderPool->addJob ([bi, &numRendersRemaining, &rendersFinished]
+            {
+                bi->renderLEDGrid();
+
+                if (--numRendersRemaining == 0)
+                    rendersFinished.signal();
+            });
+        }
+
+        // The message thread is blocked here, so a renderer that waits for it, e.g. by
+        // taking a MessageManagerLock, will never finish. Renderers used with a render
+        // pool must not touch the message thread at all.
+        while (! rendersFinished.wait (renderStallTimeoutMs))
+            jassertfalse;
+    }
 };
 
 } // namespace roli
@@ -0,0 +1,249 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Estimates how a block's clock relates to the host's high resolution clock,
+    so that the device timestamps of its events can be converted into host time.
+
+    Every timestamped event gives a sample of the device time along with the host
+    time when its packet arrived. The arrival is always later than the event by
+    some transport delay, so for each bucketLengthMs of device time, only the
+    sample with the smallest delay is kept. A line is fitted through those by
+    least squares, and then lowered until it touches the earliest of them, which
+    maps device time to the host time of the fastest possible delivery. Half the
+    median ping round trip is taken off that to estimate when the event happened.
+
+    Until the samples span minimumDriftSpanMs, the line's slope is fixed at 1, as
+    the drift between the clocks can't be measured reliably over a short time.
+
+    @tags{Blocks}
+*/
+struct DeviceClockEstimator
+{
+    static constexpr int bucketLengthMs = 500;
+    static constexpr int maxBuckets = 64;
+    static constexpr int minimumBuckets = 4;
+    static constexpr double minimumDriftSpanMs = 10000.0;
+    static constexpr int maxRoundTrips = 15;
+
+    /** Adds the device timestamp of an event and the high resolution tick count when its packet arrived. */
+    void addEvent (juce::uint32 deviceTimestamp, juce::int64 hostArrivalTime) noexcept
+    {
+        if (hostArrivalTime == 0)
+            return;
+
+        auto deviceMs = unwrapDeviceTime (deviceTimestamp);
+        auto hostMs = ticksToMs (hostArrivalTime);
+
+        if (isValid() && std::abs (hostMs - deviceToHostMs ((double) deviceMs)) > resetThresholdMs)
+        {
+            // The device has probably restarted, or was stalled for a long time
+            reset();
+            deviceMs = unwrapDeviceTime (deviceTimestamp);
+        }
+
+        auto bucketIndex = deviceMs / bucketLengthMs;
+        auto delay = hostMs - (double) deviceMs;
+
+        if (numBuckets > 0)
+        {
+            auto& newest = getBucket (numBuckets - 1);
+
+            if (bucketIndex < newest.index)
+                return;
+
+            if (bucketIndex == newest.index)
+            {
+                if (delay < newest.hostMs - newest.deviceMs)
+                {
+                    newest = { bucketIndex, (double) deviceMs, hostMs };
+                    updateFit();
+                }
+
+                return;
+            }
+        }
+
+        if (numBuckets == maxBuckets)
+        {
+            firstBucket = (firstBucket + 1) % maxBuckets;
+            --numBuckets;
+        }
+
+        getBucket (numBuckets++) = { bucketIndex, (double) deviceMs, hostMs };
+        updateFit();
+    }
+
+    /** Records that a ping was sent in the message with the given connection message ID,
+        and that the device will reply with an ACK carrying the given packet counter.
+    */
+    void pingSent (juce::int64 messageID, juce::uint32 expectedPacketCounter) noexcept
+    {
+        pingMessageID = messageID;
+        pingPacketCounter = expectedPacketCounter;
+    }
+
+    /** If an ACK with this packet counter is the reply to the outstanding ping, this returns
+        the ID of the message that carried the ping, and forgets it. Otherwise it returns 0.
+    */
+    juce::int64 takePingForACK (juce::uint32 packetCounter) noexcept
+    {
+        if (pingMessageID == 0 || packetCounter != pingPacketCounter)
+            return 0;
+
+        auto messageID = pingMessageID;
+        pingMessageID = 0;
+        return messageID;
+    }
+
+    /** Adds the time taken for the device to reply to a ping. */
+    void addRoundTrip (juce::int64 roundTripTicks) noexcept
+    {
+        roundTripsMs[nextRoundTrip] = ticksToMs (roundTripTicks);
+        nextRoundTrip = (nextRoundTrip + 1) % maxRoundTrips;
+        numRoundTrips = juce::jmin (numRoundTrips + 1, maxRoundTrips);
+
+        double sorted[maxRoundTrips];
+        std::copy (roundTripsMs, roundTripsMs + numRoundTrips, sorted);
+        std::nth_element (sorted, sorted + numRoundTrips / 2, sorted + numRoundTrips);
+        oneWayLatencyMs = sorted[numRoundTrips / 2] / 2.0;
+    }
+
+    bool isValid() const noexcept     { return numBuckets >= minimumBuckets; }
+
+    /** Returns the high resolution tick count when the device generated an event with
+        the given timestamp, or 0 if there isn't enough data to estimate it yet.
+    */
+    juce::int64 getHostTimeForEvent (juce::uint32 deviceTimestamp) const noexcept
+    {
+        if (! isValid())
+            return 0;
+
+        auto deviceMs = (double) (lastDeviceMs + (juce::int32) (deviceTimestamp - lastDeviceTimestamp));
+        return juce::Time::secondsToHighResolutionTicks ((deviceToHostMs (deviceMs) - oneWayLatencyMs) / 1000.0);
+    }
+
+    /** Returns how much faster the host's clock runs than the device's, in parts per million. */
+    double getDriftPPM() const noexcept     { return (slope - 1.0) * 1.0e6; }
+
+    void reset() noexcept
+    {
+        numBuckets = 0;
+        firstBucket = 0;
+        hasDeviceTime = false;
+        slope = 1.0;
+    }
+
+private:
+    struct Bucket
+    {
+        juce::int64 index;
+        double deviceMs, hostMs;
+    };
+
+    static constexpr double resetThresholdMs = 5000.0;
+
+    Bucket buckets[maxBuckets] {};
+    int firstBucket = 0, numBuckets = 0;
+
+    juce::uint32 lastDeviceTimestamp = 0;
+    juce::int64 lastDeviceMs = 0;
+    bool hasDeviceTime = false;
+
+    double slope = 1.0, intercept = 0.0;
+
+    double roundTripsMs[maxRoundTrips] {};
+    int nextRoundTrip = 0, numRoundTrips = 0;
+    double oneWayLatencyMs = 0.0;
+    juce::int64 pingMessageID = 0;
+    juce::uint32 pingPacketCounter = 0;
+
+    Bucket& getBucket (int i) noexcept      { return buckets[(firstBucket + i) % maxBuckets]; }
+
+    static double ticksToMs (juce::int64 ticks) noexcept
+    {
+        return juce::Time::highResolutionTicksToSeconds (ticks) * 1000.0;
+    }
+
+    double deviceToHostMs (double deviceMs) const noexcept
+    {
+        return intercept + slope * deviceMs;
+    }
+
+    // Device timestamps are 32-bit milliseconds, so they wrap after about 49 days
+    juce::int64 unwrapDeviceTime (juce::uint32 deviceTimestamp) noexcept
+    {
+        if (hasDeviceTime)
+            lastDeviceMs += (juce::int32) (deviceTimestamp - lastDeviceTimestamp);
+        else
+            lastDeviceMs = deviceTimestamp;
+
+        lastDeviceTimestamp = deviceTimestamp;
+        hasDeviceTime = true;
+        return lastDeviceMs;
+    }
+
+    void updateFit() noexcept
+    {
+        double meanDevice = 0, meanHost = 0;
+
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            meanDevice += getBucket (i).deviceMs;
+            meanHost += getBucket (i).hostMs;
+        }
+
+        meanDevice /= numBuckets;
+        meanHost /= numBuckets;
+
+        slope = 1.0;
+
+        if (getBucket (numBuckets - 1).deviceMs - getBucket (0).deviceMs >= minimumDriftSpanMs)
+        {
+            double covariance = 0, variance = 0;
+
+            for (int i = 0; i < numBuckets; ++i)
+            {
+                auto dx = getBucket (i).deviceMs - meanDevice;
+                covariance += dx * (getBucket (i).hostMs - meanHost);
+                variance += dx * dx;
+            }
+
+            if (variance > 0)
+                slope = covariance / variance;
+        }
+
+        intercept = meanHost - slope * meanDevice;
+
+        // Lower the line onto the least delayed sample
+        auto lowestResidual = std::numeric_limits<double>::max();
+
+        for (int i = 0; i < numBuckets; ++i)
+            lowestResidual = juce::jmin (lowestResidual, getBucket (i).hostMs - deviceToHostMs (getBucket (i).deviceMs));
+
+        intercept += lowestResidual;
+    }
+};
+
+} // namespace roli
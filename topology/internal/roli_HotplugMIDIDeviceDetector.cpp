@@ -0,0 +1,203 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+#if JUCE_LINUX && JUCE_ALSA
+ #include <alsa/asoundlib.h>
+#endif
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    A MIDIDeviceDetector that finds out when MIDI devices are plugged in or removed,
+    instead of relying on the Detector's polling to notice.
+
+    On Linux, it listens to the ALSA sequencer's announce port, which reports every
+    port and client that comes or goes, and calls notifyDevicesChanged() when it
+    does. Between notifications, the devices found by the last scan are reused, and
+    they're only enumerated again when something has changed, or every
+    fullRescanIntervalMs in case a notification was missed.
+
+    Where there's no way to be notified, or the sequencer can't be opened, it falls
+    back to enumerating the devices on every scan, just like a MIDIDeviceDetector.
+
+    @tags{Blocks}
+*/
+struct HotplugMIDIDeviceDetector  : public MIDIDeviceDetector
+{
+    static constexpr int fullRescanIntervalMs = 10000;
+
+    HotplugMIDIDeviceDetector()
+    {
+       #if JUCE_LINUX && JUCE_ALSA
+        announceMonitor = std::make_unique<AlsaAnnounceMonitor> ([this]
+        {
+            devicesHaveChanged = true;
+            notifyDevicesChanged();
+        });
+
+        if (! announceMonitor->isMonitoring())
+            announceMonitor.reset();
+       #endif
+    }
+
+    ~HotplugMIDIDeviceDetector() override
+    {
+       #if JUCE_LINUX && JUCE_ALSA
+        announceMonitor.reset();
+       #endif
+    }
+
+    juce::StringArray scanForDevices() override
+    {
+        const auto now = juce::Time::getMillisecondCounter();
+
+        if (isMonitoring() && ! devicesHaveChanged.exchange (false)
+             && now - lastFullScanTime < (juce::uint32) fullRescanIntervalMs)
+            return getScannedDeviceNames();
+
+        lastFullScanTime = now;
+        return MIDIDeviceDetector::scanForDevices();
+    }
+
+    /** Returns true if device changes are being notified, rather than polled for. */
+    bool isMonitoring() const noexcept
+    {
+       #if JUCE_LINUX && JUCE_ALSA
+        return announceMonitor != nullptr;
+       #else
+        return false;
+       #endif
+    }
+
+private:
+    std::atomic<bool> devicesHaveChanged { true };
+    juce::uint32 lastFullScanTime = 0;
+
+   #if JUCE_LINUX && JUCE_ALSA
+    struct AlsaAnnounceMonitor  : private juce::Thread
+    {
+        AlsaAnnounceMonitor (std::function<void()> callback)
+            : juce::Thread ("Blocks MIDI hotplug"), devicesChanged (std::move (callback))
+        {
+            if (snd_seq_open (&sequencer, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0)
+            {
+                sequencer = nullptr;
+                return;
+            }
+
+            snd_seq_set_client_name (sequencer, "BLOCKS hotplug monitor");
+            ownClientID = snd_seq_client_id (sequencer);
+
+            auto port = snd_seq_create_simple_port (sequencer, "announce",
+                                                    SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+                                                    SND_SEQ_PORT_TYPE_APPLICATION);
+
+            if (port < 0 || snd_seq_connect_from (sequencer, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE) < 0)
+            {
+                LOG_CONNECTIVITY ("Couldn't subscribe to ALSA sequencer announcements, polling for devices instead");
+                snd_seq_close (sequencer);
+                sequencer = nullptr;
+                return;
+            }
+
+            startThread();
+        }
+
+        ~AlsaAnnounceMonitor() override
+        {
+            stopThread (2000);
+
+            if (sequencer != nullptr)
+                snd_seq_close (sequencer);
+        }
+
+        bool isMonitoring() const noexcept      { return sequencer != nullptr; }
+
+    private:
+        snd_seq_t* sequencer = nullptr;
+        int ownClientID = -1;
+        std::function<void()> devicesChanged;
+
+        void run() override
+        {
+            auto numDescriptors = snd_seq_poll_descriptors_count (sequencer, POLLIN);
+            juce::HeapBlock<pollfd> descriptors (numDescriptors);
+            snd_seq_poll_descriptors (sequencer, descriptors, (unsigned int) numDescriptors, POLLIN);
+
+            while (! threadShouldExit())
+            {
+                // The timeout lets the thread check whether it should exit
+                if (::poll (descriptors, (nfds_t) numDescriptors, 100) > 0 && readAnnouncements())
+                    devicesChanged();
+            }
+        }
+
+        // Returns true if any clients or ports have come or gone
+        bool readAnnouncements()
+        {
+            bool anyChanges = false;
+
+            for (;;)
+            {
+                snd_seq_event_t* event = nullptr;
+                auto result = snd_seq_event_input (sequencer, &event);
+
+                // If the input buffer overran, some announcements have been lost
+                if (result == -ENOSPC)
+                {
+                    anyChanges = true;
+                    continue;
+                }
+
+                if (result < 0 || event == nullptr)
+                    return anyChanges;
+
+                switch (event->type)
+                {
+                    case SND_SEQ_EVENT_CLIENT_START:
+                    case SND_SEQ_EVENT_CLIENT_EXIT:
+                    case SND_SEQ_EVENT_CLIENT_CHANGE:
+                    case SND_SEQ_EVENT_PORT_START:
+                    case SND_SEQ_EVENT_PORT_EXIT:
+                    case SND_SEQ_EVENT_PORT_CHANGE:
+                        // Our own client and port appearing aren't device changes
+                        if (event->data.addr.client != ownClientID)
+                            anyChanges = true;
+
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (AlsaAnnounceMonitor)
+    };
+
+    std::unique_ptr<AlsaAnnounceMonitor> announceMonitor;
+   #endif
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HotplugMIDIDeviceDetector)
+};
+
+} // namespace roli
@@ -27,21 +27,16 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
 
     juce::StringArray scanForDevices() override
     {
-        juce::StringArray result;
-
-        for (auto& pair : findDevices())
-            result.add (pair.input.identifier + " & " + pair.output.identifier);
-
-        return result;
+        scannedDevices = findDevices();
+        return getScannedDeviceNames();
     }
 
+    /** Opens one of the devices found by the last scan. */
     PhysicalTopologySource::DeviceConnection* openDevice (int index) override
     {
-        const auto allDevices = findDevices();
-
-        if (allDevices.size() > index)
+        if (juce::isPositiveAndBelow (index, scannedDevices.size()))
         {
-            const auto pair = allDevices[index];
+            const auto pair = scannedDevices.getReference (index);
             auto dev = std::make_unique<MIDIDeviceConnection>();
 
             if (auto lock = createMidiPortLock (pair.input.name, pair.output.name))
@@ -50,7 +45,7 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
 
                 dev->setLockAgainstOtherProcesses (lock);
                 dev->midiInput  = juce::MidiInput::openDevice  (pair.input.identifier, dev.get());
-                dev->midiOutput = juce::MidiOutput::openDevice (pair.output.identifier);
+                dev->setMidiOutput (juce::MidiOutput::openDevice (pair.output.identifier));
 
                 if (dev->midiInput != nullptr)
                 {
@@ -69,7 +64,7 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
 
     bool isLockedFromOutside() const override
     {
-        return lockedFromOutside && ! findDevices().isEmpty();
+        return lockedFromOutside && ! scannedDevices.isEmpty();
     }
 
     static bool isBlocksMidiDeviceName (const juce::String& name)
@@ -99,6 +94,10 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
         juce::MidiDeviceInfo input, output;
     };
 
+    /** Pairs up the inputs and outputs of the BLOCKS devices that are connected.
+        Blocks of the same type can share a port name, so the nth input with a given
+        name is paired with the nth output with the same name.
+    */
     static juce::Array<MidiInputOutputPair> findDevices()
     {
         juce::Array<MidiInputOutputPair> result;
@@ -106,6 +105,17 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
         auto midiInputs  = juce::MidiInput::getAvailableDevices();
         auto midiOutputs = juce::MidiOutput::getAvailableDevices();
 
+        struct OutputsWithName
+        {
+            juce::Array<juce::MidiDeviceInfo> outputs;
+            int numInputsPaired = 0;
+        };
+
+        std::map<juce::String, OutputsWithName> outputsByName;
+
+        for (const auto& output : midiOutputs)
+            outputsByName[cleanBlocksDeviceName (output.name)].outputs.add (output);
+
         for (const auto& input : midiInputs)
         {
             if (isBlocksMidiDeviceName (input.name))
@@ -113,28 +123,11 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
                 MidiInputOutputPair pair;
                 pair.input = input;
 
-                juce::String cleanedInputName = cleanBlocksDeviceName (input.name);
-
-                int inputOccurences = 0;
-                int outputOccurences = 0;
+                auto& outputsWithName = outputsByName[cleanBlocksDeviceName (input.name)];
+                auto outputIndex = outputsWithName.numInputsPaired++;
 
-                for (const auto& p : result)
-                    if (cleanBlocksDeviceName (p.input.name) == cleanedInputName)
-                        ++inputOccurences;
-
-                for (const auto& output : midiOutputs)
-                {
-                    if (cleanBlocksDeviceName (output.name) == cleanedInputName)
-                    {
-                        if (outputOccurences == inputOccurences)
-                        {
-                            pair.output = output;
-                            break;
-                        }
-
-                        ++outputOccurences;
-                    }
-                }
+                if (outputIndex < outputsWithName.outputs.size())
+                    pair.output = outputsWithName.outputs.getReference (outputIndex);
 
                 result.add (pair);
             }
@@ -143,6 +136,19 @@ struct MIDIDeviceDetector  : public PhysicalTopologySource::DeviceDetector
         return result;
     }
 
+protected:
+    juce::Array<MidiInputOutputPair> scannedDevices;
+
+    juce::StringArray getScannedDeviceNames() const
+    {
+        juce::StringArray result;
+
+        for (auto& pair : scannedDevices)
+            result.add (pair.input.identifier + " & " + pair.output.identifier);
+
+        return result;
+    }
+
 private:
     bool lockedFromOutside = true;
 
@@ -28,12 +28,18 @@ struct MIDIDeviceConnection  : public PhysicalTopologySource::DeviceConnection,
 
     ~MIDIDeviceConnection() override
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+        ROLI_ASSERT_EVENT_LOOP_THREAD
 
-        listeners.call ([this] (Listener& l) { l.connectionBeingDeleted (*this); });
+        auto listenersToNotify = callbacks.getCopy().listeners;
+
+        for (auto* l : listenersToNotify)
+            if (callbacks.getCopy().listeners.contains (l))
+                l->connectionBeingDeleted (*this);
 
         if (midiInput != nullptr)
             midiInput->stop();
+
+        outputWriter.stop();
     }
 
     void setLockAgainstOtherProcesses (std::shared_ptr<juce::InterProcessLock> newLock)
@@ -41,6 +47,9 @@ struct MIDIDeviceConnection  : public PhysicalTopologySource::DeviceConnection,
         midiPortLock = newLock;
     }
 
+    /** handleIncomingMidiMessage is called on the MIDI thread, and must not wait
+        for the message thread.
+    */
     struct Listener
     {
         virtual ~Listener() {}
@@ -49,60 +58,123 @@ struct MIDIDeviceConnection  : public PhysicalTopologySource::DeviceConnection,
         virtual void connectionBeingDeleted (const MIDIDeviceConnection&) = 0;
     };
 
+    /** Adding and removing listeners never blocks the MIDI thread. Once
+        removeListener returns, the listener won't be called again.
+    */
     void addListener (Listener* l)
     {
-        juce::ScopedLock scopedLock (criticalSecton);
-        listeners.add (l);
+        callbacks.update ([l] (Callbacks& c) { c.listeners.addIfNotAlreadyThere (l); });
     }
 
     void removeListener (Listener* l)
     {
-        juce::ScopedLock scopedLock (criticalSecton);
-        listeners.remove (l);
+        callbacks.update ([l] (Callbacks& c) { c.listeners.removeFirstMatchingValue (l); });
     }
 
+    /** This must be called after changing handleMessageFromDevice or monitorMessage,
+        so that the MIDI thread starts using the new functions. Once it returns, the
+        old ones won't be called again.
+    */
+    void callbacksChanged() override
+    {
+        callbacks.update ([this] (Callbacks& c)
+        {
+            c.handleMessageFromDevice = handleMessageFromDevice;
+            c.monitorMessage = monitorMessage;
+        });
+    }
+
+    /** Returns the number of Blocks messages that arrived when there was nothing
+        to pass them to, e.g. before handleMessageFromDevice was set.
+    */
+    int getNumMessagesDropped() const noexcept      { return numMessagesDropped.load(); }
+
     bool sendMessageToDevice (const void* data, size_t dataSize) override
     {
-        JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED // This method must only be called from the message thread!
+        ROLI_ASSERT_EVENT_LOOP_THREAD // This method must only be called from the message thread!
 
         jassert (dataSize > sizeof (BlocksProtocol::roliSysexHeader) + 1);
         jassert (memcmp (data, BlocksProtocol::roliSysexHeader, sizeof (BlocksProtocol::roliSysexHeader) - 1) == 0);
         jassert (static_cast<const juce::uint8*> (data)[dataSize - 1] == 0xf7);
 
-        if (midiOutput != nullptr)
-        {
-            midiOutput->sendMessageNow (juce::MidiMessage (data, (int) dataSize));
-            return true;
-        }
+        if (monitorMessage != nullptr)
+            monitorMessage (data, dataSize, false);
 
-        return false;
+        return sendMidiMessage (data, dataSize);
     }
 
-    void handleIncomingMidiMessage (juce::MidiInput*, const juce::MidiMessage& message) override
+    /** Queues any kind of MIDI message to be written to the device. The messages
+        are written on the output's own thread, so this never waits for the driver.
+    */
+    bool sendMidiMessage (const void* data, size_t dataSize)
+    {
+        return outputWriter.write (data, dataSize);
+    }
+
+    juce::int64 getLastMessageID() override                              { return outputWriter.getLastMessageNumber(); }
+    juce::int64 getMessageWriteTime (juce::int64 messageID) override     { return outputWriter.getWriteTime (messageID); }
+
+    void setMidiOutput (std::unique_ptr<juce::MidiOutput> newOutput)
     {
-        juce::ScopedTryLock lock (criticalSecton);
+        outputWriter.stop();
+        midiOutput = std::move (newOutput);
 
-        if (lock.isLocked())
+        if (midiOutput != nullptr)
+            outputWriter.start (*midiOutput);
+    }
+
+    /** Returns the queue depth and write latency of the messages sent to the device. */
+    MidiOutputWriter::Stats getOutputStats() const noexcept     { return outputWriter.getStats(); }
+
+    void handleIncomingMidiMessage (juce::MidiInput*, const juce::MidiMessage& message) override
+    {
+        callbacks.read ([&] (const Callbacks& c)
         {
             const auto data = message.getRawData();
             const int dataSize = message.getRawDataSize();
             const int bodySize = dataSize - (int) (sizeof (BlocksProtocol::roliSysexHeader) + 1);
 
             if (bodySize > 0 && memcmp (data, BlocksProtocol::roliSysexHeader, sizeof (BlocksProtocol::roliSysexHeader)) == 0)
-                if (handleMessageFromDevice != nullptr)
-                    handleMessageFromDevice (data + sizeof (BlocksProtocol::roliSysexHeader), (size_t) bodySize);
-
-            listeners.call ([&] (Listener& l) { l.handleIncomingMidiMessage (message); });
-        }
+            {
+                if (c.monitorMessage != nullptr)
+                    c.monitorMessage (data + sizeof (BlocksProtocol::roliSysexHeader), (size_t) bodySize, true);
+
+                if (c.handleMessageFromDevice != nullptr)
+                    c.handleMessageFromDevice (data + sizeof (BlocksProtocol::roliSysexHeader), (size_t) bodySize);
+                else
+                    ++numMessagesDropped;
+            }
+
+            for (auto* l : c.listeners)
+                l->handleIncomingMidiMessage (message);
+        });
     }
 
     std::unique_ptr<juce::MidiInput> midiInput;
-    std::unique_ptr<juce::MidiOutput> midiOutput;
 
-    juce::CriticalSection criticalSecton;
+    /** If set, this is called with every Blocks message that's sent to or received from
+        the device, in the same form as sendMessageToDevice and handleMessageFromDevice use.
+        It's called on the MIDI thread for incoming messages.
+        @see callbacksChanged
+    */
+    std::function<void (const void* data, size_t dataSize, bool isFromDevice)> monitorMessage;
 
 private:
-    juce::ListenerList<Listener> listeners;
+    /*  Everything the MIDI thread uses is read from a copy, which is replaced
+        whenever it changes, so that the MIDI thread never has to take a lock.
+    */
+    struct Callbacks
+    {
+        juce::Array<Listener*> listeners;
+        std::function<void (const void* data, size_t dataSize)> handleMessageFromDevice;
+        std::function<void (const void* data, size_t dataSize, bool isFromDevice)> monitorMessage;
+    };
+
+    CopyOnWriteValue<Callbacks> callbacks;
+    std::atomic<int> numMessagesDropped { 0 };
+
+    std::unique_ptr<juce::MidiOutput> midiOutput;
+    MidiOutputWriter outputWriter;
     std::shared_ptr<juce::InterProcessLock> midiPortLock;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MIDIDeviceConnection)
@@ -0,0 +1,215 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Writes messages to a MIDI output on a thread of its own, so that the threads
+    sending them never wait for the device driver.
+
+    Messages are copied into a preallocated PacketFifo. Each time the writer
+    thread wakes up, it takes everything that has been queued and sends it to the
+    output as one block. If the driver can't keep up and the queue fills up, new
+    messages are dropped and counted.
+
+    Each message that's queued is numbered, and the times of the most recent
+    writes are kept, so that the time a particular message actually reached the
+    driver can be looked up afterwards.
+
+    @tags{Blocks}
+*/
+struct MidiOutputWriter  : private juce::Thread
+{
+    MidiOutputWriter()  : juce::Thread ("Blocks MIDI output") {}
+
+    ~MidiOutputWriter() override
+    {
+        stop();
+    }
+
+    /** Starts writing to the given output. */
+    void start (juce::MidiOutput& outputToUse)
+    {
+        stop();
+        output = &outputToUse;
+        startThread();
+    }
+
+    /** Writes any messages that are still queued, and then stops the thread. */
+    void stop()
+    {
+        if (isThreadRunning())
+        {
+            signalThreadShouldExit();
+            notify();
+            stopThread (2000);
+        }
+
+        output = nullptr;
+    }
+
+    /** Queues a message to be written. Returns false if it was dropped. */
+    bool write (const void* data, size_t dataSize)
+    {
+        if (output == nullptr)
+            return false;
+
+        {
+            // This only ever waits for another thread that's queuing a message
+            const juce::SpinLock::ScopedLockType sl (queueLock);
+
+            if (! messages.push (data, dataSize, juce::Time::getHighResolutionTicks()))
+                return false;
+
+            ++numMessagesQueued;
+        }
+
+        auto numBytesQueued = messages.getNumBytesQueued();
+
+        if (numBytesQueued > maxBytesQueued.load())
+            maxBytesQueued = numBytesQueued;
+
+        notify();
+        return true;
+    }
+
+    /** Returns the number of the last message that was queued. Messages are numbered from 1. */
+    juce::int64 getLastMessageNumber() const noexcept       { return numMessagesQueued.load(); }
+
+    /** Returns the high resolution tick count when the given message was written to the
+        output, or 0 if it hasn't been written yet or was written too long ago to remember.
+    */
+    juce::int64 getWriteTime (juce::int64 messageNumber) const noexcept
+    {
+        const juce::SpinLock::ScopedLockType sl (recentWritesLock);
+
+        for (auto& w : recentWrites)
+            if (w.firstMessage <= messageNumber && messageNumber <= w.lastMessage)
+                return w.time;
+
+        return 0;
+    }
+
+    //==============================================================================
+    struct Stats
+    {
+        int numBytesQueued = 0, maxBytesQueued = 0;
+        int numMessagesWritten = 0, numMessagesDropped = 0;
+
+        /** The time from a message being queued to the driver accepting it. */
+        double averageWriteLatencyMs = 0, maxWriteLatencyMs = 0;
+    };
+
+    Stats getStats() const noexcept
+    {
+        Stats stats;
+
+        stats.numBytesQueued = messages.getNumBytesQueued();
+        stats.maxBytesQueued = maxBytesQueued.load();
+        stats.numMessagesWritten = numMessagesWritten.load();
+        stats.numMessagesDropped = messages.getNumPacketsDropped();
+
+        if (stats.numMessagesWritten > 0)
+            stats.averageWriteLatencyMs = juce::Time::highResolutionTicksToSeconds (totalLatencyTicks.load()) * 1000.0
+                                            / stats.numMessagesWritten;
+
+        stats.maxWriteLatencyMs = juce::Time::highResolutionTicksToSeconds (maxLatencyTicks.load()) * 1000.0;
+        return stats;
+    }
+
+private:
+    juce::MidiOutput* output = nullptr;
+    PacketFifo messages;
+    juce::SpinLock queueLock;
+
+    // Only used by the writer thread. They keep their storage between blocks.
+    juce::MidiBuffer block;
+    juce::Array<juce::int64> queueTimes;
+
+    std::atomic<int> maxBytesQueued { 0 }, numMessagesWritten { 0 };
+    std::atomic<juce::int64> totalLatencyTicks { 0 }, maxLatencyTicks { 0 };
+    std::atomic<juce::int64> numMessagesQueued { 0 };
+
+    struct BlockWrite
+    {
+        juce::int64 firstMessage = 0, lastMessage = 0, time = 0;
+    };
+
+    static constexpr int numRecentWrites = 32;
+    BlockWrite recentWrites[numRecentWrites];
+    int nextRecentWrite = 0;
+    juce::int64 numMessagesPopped = 0;
+    juce::SpinLock recentWritesLock;
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            wait (-1);
+            writeQueuedMessages();
+        }
+
+        writeQueuedMessages();
+    }
+
+    void writeQueuedMessages()
+    {
+        block.clear();
+        queueTimes.clearQuick();
+
+        messages.popAll ([this] (const juce::uint8* data, int size, juce::int64 queueTime)
+        {
+            block.addEvent (data, size, 0);
+            queueTimes.add (queueTime);
+        });
+
+        if (queueTimes.isEmpty())
+            return;
+
+        output->sendBlockOfMessagesNow (block);
+
+        auto now = juce::Time::getHighResolutionTicks();
+
+        {
+            const juce::SpinLock::ScopedLockType sl (recentWritesLock);
+            recentWrites[nextRecentWrite] = { numMessagesPopped + 1, numMessagesPopped + queueTimes.size(), now };
+            nextRecentWrite = (nextRecentWrite + 1) % numRecentWrites;
+        }
+
+        numMessagesPopped += queueTimes.size();
+
+        for (auto queueTime : queueTimes)
+        {
+            auto latency = now - queueTime;
+            totalLatencyTicks += latency;
+
+            if (latency > maxLatencyTicks.load())
+                maxLatencyTicks = latency;
+        }
+
+        numMessagesWritten += queueTimes.size();
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (MidiOutputWriter)
+};
+
+} // namespace roli
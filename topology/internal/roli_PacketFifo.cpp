@@ -0,0 +1,175 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    A lock-free queue for handing packets from one thread to another, e.g. the
+    packets received from a device over to the message thread.
+
+    Packets of any size up to maxPacketSize are stored back to back in a ring of
+    bytes, each one preceded by its size and a timestamp. One thread may
+    push packets while another pops them, and nothing is allocated after
+    construction. If the consumer falls behind and the ring fills up, new packets
+    are dropped and counted.
+
+    @tags{Blocks}
+*/
+struct PacketFifo
+{
+    static constexpr int defaultCapacity = 65536;
+    static constexpr int maxPacketSize = 4096;
+
+    PacketFifo (int capacityBytes = defaultCapacity)
+        : fifo (capacityBytes),
+          buffer ((size_t) capacityBytes),
+          scratch ((size_t) maxPacketSize),
+          mask (capacityBytes - 1)
+    {
+        jassert (juce::isPowerOfTwo (capacityBytes) && capacityBytes > maxPacketSize + headerSize);
+    }
+
+    /** Adds a packet to the queue, along with a timestamp, which is usually the
+        high resolution tick count when it arrived or was sent.
+        Returns false if it was dropped because there wasn't room.
+    */
+    bool push (const void* data, size_t dataSize, juce::int64 timestamp = 0) noexcept
+    {
+        auto totalSize = (int) dataSize + headerSize;
+        int start1 = 0, size1 = 0, start2, size2;
+
+        if (dataSize > 0 && dataSize <= (size_t) maxPacketSize)
+            fifo.prepareToWrite (totalSize, start1, size1, start2, size2);
+
+        if (size1 + size2 < totalSize)
+        {
+            ++numPacketsDropped;
+            return false;
+        }
+
+        auto size16 = (juce::uint16) dataSize;
+        juce::uint8 header[headerSize];
+        memcpy (header, &size16, sizeof (size16));
+        memcpy (header + sizeof (size16), &timestamp, sizeof (timestamp));
+
+        copyIn (start1, header, headerSize);
+        copyIn ((start1 + headerSize) & mask, data, dataSize);
+
+        fifo.finishedWrite (totalSize);
+        return true;
+    }
+
+    /** Calls a function with each of the waiting packets, oldest first, and then
+        removes them from the queue. The function is passed the data, its size and its
+        timestamp, and the data is only valid until it returns.
+    */
+    template <typename PacketHandler>
+    void popAll (PacketHandler&& handlePacket)
+    {
+        auto numReady = fifo.getNumReady();
+
+        if (numReady == 0)
+            return;
+
+        int start1, size1, start2, size2;
+        fifo.prepareToRead (numReady, start1, size1, start2, size2);
+
+        auto capacity = mask + 1;
+        int offset = 0;
+
+        while (numReady - offset > headerSize)
+        {
+            auto headerPos = (start1 + offset) & mask;
+
+            juce::uint8 header[headerSize];
+            copyOut (headerPos, header, headerSize);
+
+            juce::uint16 dataSize;
+            juce::int64 timestamp;
+            memcpy (&dataSize, header, sizeof (dataSize));
+            memcpy (&timestamp, header + sizeof (dataSize), sizeof (timestamp));
+            auto dataPos = (headerPos + headerSize) & mask;
+
+            if (dataPos + dataSize <= capacity)
+            {
+                handlePacket (buffer.getData() + dataPos, (int) dataSize, timestamp);
+            }
+            else
+            {
+                copyOut (dataPos, scratch.getData(), (size_t) dataSize);
+                handlePacket (scratch.getData(), (int) dataSize, timestamp);
+            }
+
+            offset += headerSize + dataSize;
+        }
+
+        fifo.finishedRead (offset);
+    }
+
+    /** Returns the number of packets that have been dropped because the queue was full. */
+    int getNumPacketsDropped() const noexcept     { return numPacketsDropped; }
+
+    /** Returns the number of bytes used by the packets in the queue, including their headers. */
+    int getNumBytesQueued() const noexcept        { return fifo.getNumReady(); }
+
+private:
+    static constexpr int headerSize = (int) (sizeof (juce::uint16) + sizeof (juce::int64));
+
+    juce::AbstractFifo fifo;
+    juce::HeapBlock<juce::uint8> buffer, scratch;
+    const int mask;
+    std::atomic<int> numPacketsDropped { 0 };
+
+    void copyIn (int pos, const void* data, size_t numBytes) noexcept
+    {
+        auto firstPart = (size_t) (mask + 1 - pos);
+
+        if (numBytes <= firstPart)
+        {
+            memcpy (buffer.getData() + pos, data, numBytes);
+        }
+        else
+        {
+            memcpy (buffer.getData() + pos, data, firstPart);
+            memcpy (buffer.getData(), static_cast<const juce::uint8*> (data) + firstPart, numBytes - firstPart);
+        }
+    }
+
+    void copyOut (int pos, void* dest, size_t numBytes) const noexcept
+    {
+        auto firstPart = (size_t) (mask + 1 - pos);
+
+        if (numBytes <= firstPart)
+        {
+            memcpy (dest, buffer.getData() + pos, numBytes);
+        }
+        else
+        {
+            memcpy (dest, buffer.getData() + pos, firstPart);
+            memcpy (static_cast<juce::uint8*> (dest) + firstPart, buffer.getData(), numBytes - firstPart);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (PacketFifo)
+};
+
+} // namespace roli
@@ -0,0 +1,143 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Passes touches straight from the threads that receive them to the registered
+    PhysicalTopologySource::RealtimeTouchListeners.
+
+    The listeners are kept in a fixed set of atomic slots, so dispatching never
+    locks or allocates. Removing a listener waits for any dispatch that is still
+    in progress, so once it returns the listener can safely be deleted.
+
+    It also keeps a latency histogram for each delivery path, measured from the
+    time a packet arrived to the time its touches were handed on.
+
+    @tags{Blocks}
+*/
+struct RealtimeTouchDispatcher
+{
+    using Listener = PhysicalTopologySource::RealtimeTouchListener;
+    using DeliveryPath = PhysicalTopologySource::TouchDeliveryPath;
+
+    bool addListener (Listener* listener)
+    {
+        jassert (listener != nullptr);
+
+        for (auto& slot : listeners)
+        {
+            Listener* empty = nullptr;
+
+            if (slot.compare_exchange_strong (empty, listener))
+            {
+                ++numListeners;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void removeListener (Listener* listener)
+    {
+        for (auto& slot : listeners)
+        {
+            auto* expected = listener;
+
+            if (slot.compare_exchange_strong (expected, nullptr))
+                --numListeners;
+        }
+
+        while (numCallsInProgress.load() != 0)
+            juce::Thread::yield();
+    }
+
+    bool hasListeners() const noexcept
+    {
+        return numListeners.load (std::memory_order_relaxed) > 0;
+    }
+
+    /** Called on the thread that decoded the touch. */
+    void dispatch (const TouchSurface::Touch& touch, juce::int64 arrivalTime)
+    {
+        ++numCallsInProgress;
+
+        getLatencyRecorder (DeliveryPath::realtime).record (arrivalTime);
+
+        for (auto& slot : listeners)
+            if (auto* listener = slot.load())
+                listener->touchChanged (touch);
+
+        --numCallsInProgress;
+    }
+
+    //==============================================================================
+    struct LatencyRecorder
+    {
+        LatencyRecorder() noexcept    { reset(); }
+
+        void record (juce::int64 arrivalTime) noexcept
+        {
+            if (arrivalTime == 0)
+                return;
+
+            auto elapsed = juce::Time::getHighResolutionTicks() - arrivalTime;
+            auto micros = (juce::uint32) juce::jlimit (0.0, (double) 0xffffffff,
+                                                       juce::Time::highResolutionTicksToSeconds (elapsed) * 1.0e6);
+
+            auto bucket = micros == 0 ? 0 : juce::jmin (numBuckets - 1, juce::findHighestSetBit (micros) + 1);
+            counts[bucket].fetch_add (1, std::memory_order_relaxed);
+        }
+
+        PhysicalTopologySource::TouchLatencyHistogram get() const noexcept
+        {
+            PhysicalTopologySource::TouchLatencyHistogram h;
+
+            for (int i = 0; i < numBuckets; ++i)
+                h.counts[i] = counts[i].load (std::memory_order_relaxed);
+
+            return h;
+        }
+
+        void reset() noexcept
+        {
+            for (auto& c : counts)
+                c.store (0, std::memory_order_relaxed);
+        }
+
+        static constexpr int numBuckets = PhysicalTopologySource::TouchLatencyHistogram::numBuckets;
+        std::atomic<juce::uint32> counts[numBuckets];
+    };
+
+    LatencyRecorder& getLatencyRecorder (DeliveryPath path) noexcept
+    {
+        return latencies[path == DeliveryPath::realtime ? 0 : 1];
+    }
+
+private:
+    std::atomic<Listener*> listeners[PhysicalTopologySource::maxRealtimeTouchListeners] = {};
+    std::atomic<int> numListeners { 0 }, numCallsInProgress { 0 };
+    LatencyRecorder latencies[2];
+};
+
+} // namespace roli
@@ -0,0 +1,112 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    Picks the Blocks messages out of a stream of raw MIDI bytes, for transports
+    that don't split the stream into messages themselves.
+
+    The bytes of each sysex message are collected in a buffer that's allocated
+    once, and those that start with the ROLI sysex header are passed on in the
+    form that DeviceConnection::handleMessageFromDevice uses, i.e. without the
+    header or the end byte. Real-time bytes inside a sysex message are skipped,
+    any other status byte, including the start of another sysex message,
+    abandons it, and messages that are too long for the buffer are dropped.
+
+    @tags{Blocks}
+*/
+struct SysexStreamParser
+{
+    static constexpr int maxMessageSize = 4096;
+
+    SysexStreamParser()  : buffer ((size_t) maxMessageSize) {}
+
+    /** Parses some more of the stream, calling handleMessage with the data and size
+        of each Blocks message that's completed. The data is only valid until it returns.
+    */
+    template <typename MessageHandler>
+    void parse (const juce::uint8* data, int numBytes, MessageHandler&& handleMessage)
+    {
+        for (int i = 0; i < numBytes; ++i)
+        {
+            auto byte = data[i];
+
+            if (byte >= 0xf8)
+                continue;
+
+            if (byte == 0xf0)
+            {
+                if (isInSysex)
+                    ++numMessagesDropped;
+
+                isInSysex = true;
+                size = 0;
+            }
+            else if (! isInSysex)
+            {
+                continue;
+            }
+            else if (byte == 0xf7)
+            {
+                isInSysex = false;
+                handleCompleteMessage (handleMessage);
+                continue;
+            }
+            else if (byte >= 0x80)
+            {
+                isInSysex = false;
+                ++numMessagesDropped;
+                continue;
+            }
+
+            if (size < maxMessageSize)
+                buffer[size] = byte;
+
+            ++size;
+        }
+    }
+
+    /** Returns the number of sysex messages that were abandoned or too long. */
+    int getNumMessagesDropped() const noexcept      { return numMessagesDropped; }
+
+private:
+    juce::HeapBlock<juce::uint8> buffer;
+    int size = 0;
+    bool isInSysex = false;
+    int numMessagesDropped = 0;
+
+    template <typename MessageHandler>
+    void handleCompleteMessage (MessageHandler& handleMessage)
+    {
+        constexpr auto headerSize = (int) sizeof (BlocksProtocol::roliSysexHeader);
+
+        if (size > maxMessageSize)
+            ++numMessagesDropped;
+        else if (size > headerSize && memcmp (buffer.getData(), BlocksProtocol::roliSysexHeader, (size_t) headerSize) == 0)
+            handleMessage (buffer.getData() + headerSize, (size_t) (size - headerSize));
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SysexStreamParser)
+};
+
+} // namespace roli
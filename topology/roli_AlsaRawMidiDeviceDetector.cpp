@@ -0,0 +1,402 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+#if JUCE_LINUX && JUCE_ALSA
+
+#include <alsa/asoundlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    A connection to a BLOCKS device through an ALSA raw MIDI device.
+
+    The I/O thread is started by callbacksChanged(), once whoever opened the
+    connection has set handleMessageFromDevice. Packets sent before then are queued.
+    The thread reads the callback through a CopyOnWriteValue, so it can be changed
+    later without locking the thread out. Once the device has failed, nothing more
+    can be sent to it.
+
+    @tags{Blocks}
+*/
+struct AlsaRawMidiDeviceConnection  : public PhysicalTopologySource::DeviceConnection,
+                                      private juce::Thread
+{
+    AlsaRawMidiDeviceConnection (snd_rawmidi_t* in, snd_rawmidi_t* out)
+        : juce::Thread ("Blocks raw MIDI"),
+          input (in), output (out),
+          readBuffer ((size_t) readBufferSize),
+          writeBuffer ((size_t) PacketFifo::defaultCapacity)
+    {
+        queuedMessageEnds.ensureStorageAllocated (256);
+
+        if (pipe (wakePipe) == 0)
+        {
+            fcntl (wakePipe[0], F_SETFL, O_NONBLOCK);
+            fcntl (wakePipe[1], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    ~AlsaRawMidiDeviceConnection() override
+    {
+        signalThreadShouldExit();
+        wake();
+        stopThread (2000);
+
+        snd_rawmidi_close (input);
+        snd_rawmidi_close (output);
+        close (wakePipe[0]);
+        close (wakePipe[1]);
+    }
+
+    /** Opens a raw MIDI device, e.g. "hw:1,0,0". Returns nullptr and sets errorCode if it fails. */
+    static AlsaRawMidiDeviceConnection* open (const juce::String& deviceID, int& errorCode)
+    {
+        snd_rawmidi_t* in = nullptr;
+        snd_rawmidi_t* out = nullptr;
+
+        errorCode = snd_rawmidi_open (&in, &out, deviceID.toRawUTF8(), SND_RAWMIDI_NONBLOCK);
+
+        if (errorCode < 0)
+            return nullptr;
+
+        return new AlsaRawMidiDeviceConnection (in, out);
+    }
+
+    bool sendMessageToDevice (const void* data, size_t dataSize) override
+    {
+        if (deviceFailed)
+            return false;
+
+        bool wasQueued;
+
+        {
+            const juce::SpinLock::ScopedLockType sl (queueLock);
+            wasQueued = outgoingPackets.push (data, dataSize);
+        }
+
+        if (! wasQueued)
+        {
+            const juce::SpinLock::ScopedLockType sl (statsLock);
+            ++stats.numMessagesDropped;
+            return false;
+        }
+
+        wake();
+        return true;
+    }
+
+    void callbacksChanged() override
+    {
+        messageCallback.update ([this] (MessageCallback& c) { c = handleMessageFromDevice; });
+
+        if (! isThreadRunning() && ! deviceFailed)
+            startThread();
+    }
+
+    AlsaRawMidiDeviceDetector::ConnectionStats getStats() const
+    {
+        const juce::SpinLock::ScopedLockType sl (statsLock);
+        return stats;
+    }
+
+private:
+    static constexpr int readBufferSize = 1024;
+
+    snd_rawmidi_t* const input;
+    snd_rawmidi_t* const output;
+    int wakePipe[2] = { -1, -1 };
+
+    juce::SpinLock queueLock;
+    PacketFifo outgoingPackets;
+    juce::HeapBlock<juce::uint8> readBuffer, writeBuffer;
+    int writeStart = 0, writeEnd = 0;
+
+    // The end of each message in the write buffer, so that messages are only counted
+    // as sent once all of their bytes have been written
+    juce::Array<int> queuedMessageEnds;
+    int numQueuedMessagesWritten = 0;
+
+    SysexStreamParser parser;
+    std::atomic<bool> deviceFailed { false };
+
+    using MessageCallback = std::function<void (const void* data, size_t dataSize)>;
+    CopyOnWriteValue<MessageCallback> messageCallback;
+
+    juce::SpinLock statsLock;
+    AlsaRawMidiDeviceDetector::ConnectionStats stats;
+
+    void wake() noexcept
+    {
+        const char c = 0;
+        auto result = write (wakePipe[1], &c, 1);
+        juce::ignoreUnused (result);
+    }
+
+    void run() override
+    {
+        auto numInputDescriptors  = snd_rawmidi_poll_descriptors_count (input);
+        auto numOutputDescriptors = snd_rawmidi_poll_descriptors_count (output);
+        auto numDescriptors = 1 + numInputDescriptors + numOutputDescriptors;
+
+        juce::HeapBlock<pollfd> descriptors ((size_t) numDescriptors, true);
+        auto* inputDescriptors  = descriptors + 1;
+        auto* outputDescriptors = inputDescriptors + numInputDescriptors;
+
+        descriptors[0].fd = wakePipe[0];
+        descriptors[0].events = POLLIN;
+        snd_rawmidi_poll_descriptors (input,  inputDescriptors,  (unsigned int) numInputDescriptors);
+        snd_rawmidi_poll_descriptors (output, outputDescriptors, (unsigned int) numOutputDescriptors);
+
+        while (! threadShouldExit() && ! deviceFailed)
+        {
+            writeQueuedPackets();
+
+            // Only wait for the output to have room if there's something waiting for it
+            for (int i = 0; i < numOutputDescriptors; ++i)
+                outputDescriptors[i].events = writeEnd > writeStart ? POLLOUT : 0;
+
+            if (::poll (descriptors, (nfds_t) numDescriptors, 100) < 0 && errno != EINTR)
+                break;
+
+            if (descriptors[0].revents & POLLIN)
+            {
+                char drain[64];
+                while (read (wakePipe[0], drain, sizeof (drain)) > 0) {}
+            }
+
+            readFromDevice();
+        }
+
+        // Give whatever's still queued a chance to reach the device
+        if (! deviceFailed)
+        {
+            writeQueuedPackets();
+            snd_rawmidi_drain (output);
+        }
+    }
+
+    void readFromDevice()
+    {
+        for (;;)
+        {
+            auto numRead = snd_rawmidi_read (input, readBuffer, (size_t) readBufferSize);
+
+            if (numRead == -EAGAIN)
+                return;
+
+            if (numRead < 0)
+            {
+                LOG_CONNECTIVITY ("Raw MIDI read failed: " << snd_strerror ((int) numRead));
+                deviceFailed = true;
+                return;
+            }
+
+            if (numRead == 0)
+                return;
+
+            int numMessages = 0;
+
+            messageCallback.read ([this, numRead, &numMessages] (const MessageCallback& callback)
+            {
+                parser.parse (readBuffer, (int) numRead, [&callback, &numMessages] (const void* data, size_t dataSize)
+                {
+                    ++numMessages;
+
+                    if (callback != nullptr)
+                        callback (data, dataSize);
+                });
+            });
+
+            const juce::SpinLock::ScopedLockType sl (statsLock);
+            stats.numBytesRead += numRead;
+            stats.numMessagesReceived += numMessages;
+        }
+    }
+
+    // Copies everything that has been queued into the write buffer, and writes as
+    // much of it as the device will take without blocking.
+    void writeQueuedPackets()
+    {
+        if (writeStart == writeEnd)
+        {
+            writeStart = writeEnd = 0;
+            queuedMessageEnds.clearQuick();
+            numQueuedMessagesWritten = 0;
+
+            const juce::SpinLock::ScopedLockType sl (queueLock);
+
+            outgoingPackets.popAll ([this] (const juce::uint8* data, int size, juce::int64)
+            {
+                memcpy (writeBuffer + writeEnd, data, (size_t) size);
+                writeEnd += size;
+                queuedMessageEnds.add (writeEnd);
+            });
+        }
+
+        if (writeStart == writeEnd)
+            return;
+
+        auto numWritten = snd_rawmidi_write (output, writeBuffer + writeStart, (size_t) (writeEnd - writeStart));
+
+        if (numWritten < 0 && numWritten != -EAGAIN)
+        {
+            LOG_CONNECTIVITY ("Raw MIDI write failed: " << snd_strerror ((int) numWritten));
+            deviceFailed = true;
+            return;
+        }
+
+        if (numWritten <= 0)
+            return;
+
+        writeStart += (int) numWritten;
+        int numMessages = 0;
+
+        while (numQueuedMessagesWritten < queuedMessageEnds.size()
+                && queuedMessageEnds.getUnchecked (numQueuedMessagesWritten) <= writeStart)
+        {
+            ++numQueuedMessagesWritten;
+            ++numMessages;
+        }
+
+        const juce::SpinLock::ScopedLockType sl (statsLock);
+        stats.numMessagesSent += numMessages;
+        stats.numBytesWritten += numWritten;
+        ++stats.numWrites;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (AlsaRawMidiDeviceConnection)
+};
+
+//==============================================================================
+struct AlsaRawMidiDeviceDetector::Internal
+{
+    struct RawMidiDevice
+    {
+        juce::String deviceID, name;
+    };
+
+    // Lists every raw MIDI subdevice that has both an input and an output and a BLOCKS name
+    static juce::Array<RawMidiDevice> findDevices()
+    {
+        juce::Array<RawMidiDevice> result;
+
+        snd_rawmidi_info_t* info;
+        snd_rawmidi_info_alloca (&info);
+
+        for (int card = -1; snd_card_next (&card) >= 0 && card >= 0;)
+        {
+            snd_ctl_t* control = nullptr;
+
+            if (snd_ctl_open (&control, ("hw:" + juce::String (card)).toRawUTF8(), 0) < 0)
+                continue;
+
+            for (int device = -1; snd_ctl_rawmidi_next_device (control, &device) >= 0 && device >= 0;)
+            {
+                snd_rawmidi_info_set_device (info, (unsigned int) device);
+                snd_rawmidi_info_set_subdevice (info, 0);
+                snd_rawmidi_info_set_stream (info, SND_RAWMIDI_STREAM_INPUT);
+
+                if (snd_ctl_rawmidi_info (control, info) < 0)
+                    continue;
+
+                auto numSubdevices = (int) snd_rawmidi_info_get_subdevices_count (info);
+                juce::String deviceName (snd_rawmidi_info_get_name (info));
+
+                for (int subdevice = 0; subdevice < numSubdevices; ++subdevice)
+                {
+                    snd_rawmidi_info_set_subdevice (info, (unsigned int) subdevice);
+                    snd_rawmidi_info_set_stream (info, SND_RAWMIDI_STREAM_INPUT);
+
+                    if (snd_ctl_rawmidi_info (control, info) < 0)
+                        continue;
+
+                    juce::String name (snd_rawmidi_info_get_subname (info));
+
+                    snd_rawmidi_info_set_stream (info, SND_RAWMIDI_STREAM_OUTPUT);
+
+                    if (snd_ctl_rawmidi_info (control, info) < 0)
+                        continue;
+
+                    if (! MIDIDeviceDetector::isBlocksMidiDeviceName (name))
+                        name = deviceName;
+
+                    if (MIDIDeviceDetector::isBlocksMidiDeviceName (name))
+                        result.add ({ "hw:" + juce::String (card) + "," + juce::String (device) + "," + juce::String (subdevice), name });
+                }
+            }
+
+            snd_ctl_close (control);
+        }
+
+        return result;
+    }
+
+    juce::Array<RawMidiDevice> scannedDevices;
+    bool lockedFromOutside = false;
+};
+
+//==============================================================================
+AlsaRawMidiDeviceDetector::AlsaRawMidiDeviceDetector()  : internal (std::make_unique<Internal>()) {}
+AlsaRawMidiDeviceDetector::~AlsaRawMidiDeviceDetector() = default;
+
+juce::StringArray AlsaRawMidiDeviceDetector::scanForDevices()
+{
+    internal->scannedDevices = Internal::findDevices();
+
+    juce::StringArray result;
+
+    for (auto& device : internal->scannedDevices)
+        result.add (device.deviceID + " " + device.name);
+
+    return result;
+}
+
+PhysicalTopologySource::DeviceConnection* AlsaRawMidiDeviceDetector::openDevice (int index)
+{
+    if (! juce::isPositiveAndBelow (index, internal->scannedDevices.size()))
+        return nullptr;
+
+    int errorCode = 0;
+    auto* connection = AlsaRawMidiDeviceConnection::open (internal->scannedDevices.getReference (index).deviceID, errorCode);
+    internal->lockedFromOutside = (errorCode == -EBUSY);
+
+    return connection;
+}
+
+bool AlsaRawMidiDeviceDetector::isLockedFromOutside() const
+{
+    return internal->lockedFromOutside && ! internal->scannedDevices.isEmpty();
+}
+
+AlsaRawMidiDeviceDetector::ConnectionStats AlsaRawMidiDeviceDetector::getConnectionStats (const PhysicalTopologySource::DeviceConnection& connection)
+{
+    if (auto* c = dynamic_cast<const AlsaRawMidiDeviceConnection*> (&connection))
+        return c->getStats();
+
+    return {};
+}
+
+} // namespace roli
+
+#endif
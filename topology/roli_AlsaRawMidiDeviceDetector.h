@@ -0,0 +1,87 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+#if JUCE_LINUX && JUCE_ALSA
+
+namespace roli
+{
+
+/**
+    A DeviceDetector that talks to BLOCKS devices through ALSA's raw MIDI devices,
+    rather than through juce::MidiInput and juce::MidiOutput.
+
+    Each connection has a single thread which reads the device and writes to it.
+    Incoming bytes are split into sysex messages in a buffer that's reused, so no
+    MidiMessage objects are created or allocated, and the packets sent to a device
+    are queued and written to it together whenever the thread wakes up.
+
+    Use it in place of the default detector, e.g.
+    @code
+    AlsaRawMidiDeviceDetector rawMidiDetector;
+    PhysicalTopologySource source (rawMidiDetector);
+    @endcode
+
+    Only Blocks messages are passed through, so blocks opened this way don't
+    support Block::addDataInputPortListener(). A raw MIDI device can only be opened
+    by one client at a time, so this won't be able to open a device that's in use
+    through the ALSA sequencer, and vice versa. The detector must outlive any
+    PhysicalTopologySource that uses it.
+
+    @tags{Blocks}
+*/
+class AlsaRawMidiDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    /** Constructor. */
+    AlsaRawMidiDeviceDetector();
+
+    /** Destructor. */
+    ~AlsaRawMidiDeviceDetector() override;
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+    bool isLockedFromOutside() const override;
+
+    /** Counters for the traffic through one of the connections. */
+    struct ConnectionStats
+    {
+        juce::int64 numBytesRead = 0;
+        juce::int64 numBytesWritten = 0;
+        int numMessagesReceived = 0;
+        int numMessagesSent = 0;
+        int numWrites = 0;
+        int numMessagesDropped = 0;
+    };
+
+    /** Returns the traffic counters of a connection opened by this detector, or
+        nothing if the connection didn't come from one.
+    */
+    static ConnectionStats getConnectionStats (const PhysicalTopologySource::DeviceConnection&);
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (AlsaRawMidiDeviceDetector)
+};
+
+} // namespace roli
+
+#endif
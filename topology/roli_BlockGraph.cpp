@@ -22,7 +22,7 @@ namespace roli
 {
 
 BlockGraph::BlockGraph (const BlockTopology t, std::function<bool (Block::Ptr)> filterIn)
-    : topology (t), filter (std::move (filterIn))
+    : topology (t), topologyIndex (topology), filter (std::move (filterIn))
 {
     buildGraph();
 }
@@ -31,6 +31,7 @@ BlockGraph::BlockGraph (BlockGraph&& other)
 {
     traversalPaths = std::move (other.traversalPaths);
     topology = std::move (other.topology);
+    topologyIndex = std::move (other.topologyIndex);
     filter = std::move (other.filter);
 }
 
@@ -100,7 +101,7 @@ void BlockGraph::addAllConnectedToArray (Block::Ptr startBlock, Block::Array& st
 {
     store.addIfNotAlreadyThere (startBlock);
 
-    for (const auto block : topology.getDirectlyConnectedBlocks (startBlock->uid))
+    for (const auto block : topologyIndex.getDirectlyConnectedBlocks (startBlock->uid))
     {
         if (shouldIncludeBlock (block) && store.addIfNotAlreadyThere (block))
             addAllConnectedToArray (block, store);
@@ -54,6 +54,7 @@ private:
 
     BlockTraversalPaths traversalPaths; // one path for each master block
     BlockTopology topology;
+    BlockTopologyIndex topologyIndex;
     std::function<bool (Block::Ptr)> filter;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BlockGraph)
@@ -0,0 +1,974 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    The layout of the shared memory between a BlocksBroker and its clients.
+
+    The memory is a file that every process maps, and it's only ever accessed
+    through lock-free atomics and the rings of packets. The broker starts a new
+    session number each time it starts, and clears its heartbeat when it stops,
+    so that clients can tell when they need to attach again.
+
+    @tags{Blocks}
+*/
+struct BlocksBrokerSharedMemory
+{
+    static constexpr juce::uint32 magic = 0x4b524242; // "BBRK"
+    static constexpr juce::uint32 version = 2;
+
+    static constexpr int maxNameBytes = 256;
+    static constexpr juce::uint32 deviceRingSize = 1 << 18;
+    static constexpr juce::uint32 clientRingSize = 1 << 16;
+    static constexpr juce::uint32 maxPacketSize = PacketFifo::maxPacketSize;
+
+    static constexpr juce::int64 heartbeatIntervalMs = 100;
+    static constexpr juce::int64 timeoutMs = 2000;
+
+    //==============================================================================
+    /**
+        A ring of packets with a single writer.
+
+        Each packet is stored whole, after an 8-byte header holding its size and a tag.
+        A packet that won't fit before the end of the ring is preceded by a marker that
+        sends readers back to the start.
+
+        A ring with one reader can be written without overwriting anything that the
+        reader hasn't reached, so that reader uses each packet in place. A ring with many
+        readers, which can't all be waited for, just overwrites the oldest packets. Its
+        readers copy each packet out and then check, like a seqlock, that the writer
+        didn't get close enough to be changing it meanwhile. A reader that is overtaken
+        skips ahead and counts what it missed.
+    */
+    template <juce::uint32 capacity>
+    struct PacketRing
+    {
+        static_assert ((capacity & (capacity - 1)) == 0, "The capacity must be a power of two");
+
+        static constexpr juce::uint32 headerSize = 8;
+        static constexpr juce::uint32 wrapMarker = 0xffffffff;
+
+        static constexpr juce::uint32 getRecordSize (juce::uint32 packetSize) noexcept
+        {
+            return (headerSize + packetSize + 7) & ~7u;
+        }
+
+        /** Reading a packet is only safe while the writer is at least this far from overtaking it. */
+        static constexpr juce::uint32 maxLag = capacity - getRecordSize (maxPacketSize) * 2;
+
+        bool write (const void* packet, juce::uint32 size, juce::uint32 tag, bool waitForReader) noexcept
+        {
+            jassert (size <= maxPacketSize);
+
+            auto recordSize = getRecordSize (size);
+            auto position = writePosition.load (std::memory_order_relaxed);
+            auto offset = (juce::uint32) (position & (capacity - 1));
+            auto padding = offset + recordSize > capacity ? capacity - offset : 0;
+
+            if (waitForReader && position + padding + recordSize - readPosition.load (std::memory_order_acquire) > capacity)
+                return false;
+
+            if (padding > 0)
+            {
+                writeHeader (offset, wrapMarker, 0);
+                position += padding;
+                offset = 0;
+            }
+
+            memcpy (data + offset + headerSize, packet, size);
+            writeHeader (offset, size, tag);
+            writePosition.store (position + recordSize, std::memory_order_release);
+            return true;
+        }
+
+        /** Calls a function for each packet from a position up to the last one written,
+            and returns the position after them. For a ring that is overwritten, the reader
+            gives up and skips to the end if the writer gets too close to overtaking it.
+        */
+        template <typename Callback>
+        juce::uint64 read (juce::uint64 position, bool canBeOvertaken, juce::int64& numMissed, Callback&& callback) const
+        {
+            auto end = writePosition.load (std::memory_order_acquire);
+
+            while (position != end)
+            {
+                if (canBeOvertaken && writePosition.load (std::memory_order_acquire) - position > maxLag)
+                {
+                    ++numMissed;
+                    return writePosition.load (std::memory_order_acquire);
+                }
+
+                auto offset = (juce::uint32) (position & (capacity - 1));
+                juce::uint32 size, tag;
+                memcpy (&size, data + offset, sizeof (size));
+                memcpy (&tag, data + offset + 4, sizeof (tag));
+
+                if (size == wrapMarker)
+                {
+                    position += capacity - offset;
+                    continue;
+                }
+
+                if (size > maxPacketSize || offset + headerSize + size > capacity)
+                {
+                    jassert (canBeOvertaken);
+                    ++numMissed;
+                    return end;
+                }
+
+                if (! canBeOvertaken)
+                {
+                    callback (data + offset + headerSize, size, tag);
+                    position += getRecordSize (size);
+                    continue;
+                }
+
+                juce::uint8 packet[maxPacketSize];
+                memcpy (packet, data + offset + headerSize, size);
+
+                // If the writer came close enough to start on this record while it was
+                // being copied, the copy may be torn, so it's thrown away
+                std::atomic_thread_fence (std::memory_order_acquire);
+
+                if (writePosition.load (std::memory_order_relaxed) - position > maxLag)
+                {
+                    ++numMissed;
+                    return writePosition.load (std::memory_order_acquire);
+                }
+
+                callback (packet, size, tag);
+                position += getRecordSize (size);
+            }
+
+            return position;
+        }
+
+        /** Skips anything that hasn't been read, for a ring with a single reader. */
+        void discardUnread() noexcept
+        {
+            readPosition.store (writePosition.load (std::memory_order_acquire), std::memory_order_release);
+        }
+
+        std::atomic<juce::uint64> writePosition;
+        std::atomic<juce::uint64> readPosition;
+        juce::uint8 data[capacity];
+
+    private:
+        void writeHeader (juce::uint32 offset, juce::uint32 size, juce::uint32 tag) noexcept
+        {
+            memcpy (data + offset, &size, sizeof (size));
+            memcpy (data + offset + 4, &tag, sizeof (tag));
+        }
+    };
+
+    //==============================================================================
+    struct DeviceSlot
+    {
+        /** Odd while a device is open in the slot, and incremented whenever it's opened or closed. */
+        std::atomic<juce::uint32> generation;
+        /** The clientID of the client that controls the device, or 0 if none does yet. */
+        std::atomic<juce::uint32> controllingClientID;
+        char name[maxNameBytes];
+        PacketRing<deviceRingSize> packetsFromDevice;
+    };
+
+    struct ClientSlot
+    {
+        /** The session of the broker that the client attached to, or 0 if the slot is free. */
+        std::atomic<juce::uint32> session;
+        /** A random number chosen by each client that uses the slot, so that the broker can tell them apart. */
+        std::atomic<juce::uint32> clientID;
+        std::atomic<juce::uint32> isReadOnly;
+        std::atomic<juce::int64> heartbeat;
+
+        /** The tag of each packet is the index of the device slot in the top 8 bits,
+            and the low 24 bits of the slot's generation.
+        */
+        PacketRing<clientRingSize> packetsToDevices;
+    };
+
+    static juce::uint32 createTag (int deviceSlot, juce::uint32 generation) noexcept
+    {
+        return ((juce::uint32) deviceSlot << 24) | (generation & 0xffffff);
+    }
+
+    //==============================================================================
+    juce::uint32 fileMagic;
+    juce::uint32 fileVersion;
+    std::atomic<juce::uint32> session;
+    std::atomic<juce::int64> heartbeat;
+
+    DeviceSlot devices[BlocksBroker::maxDevices];
+    ClientSlot clients[BlocksBroker::maxClients];
+
+    bool isValid (juce::uint32 expectedSession) const noexcept
+    {
+        return fileMagic == magic
+                && fileVersion == version
+                && session.load() == expectedSession
+                && juce::Time::currentTimeMillis() - heartbeat.load() < timeoutMs;
+    }
+
+    static BlocksBrokerSharedMemory* getFrom (juce::MemoryMappedFile* file) noexcept
+    {
+        if (file != nullptr && file->getData() != nullptr && file->getSize() >= sizeof (BlocksBrokerSharedMemory))
+            return static_cast<BlocksBrokerSharedMemory*> (file->getData());
+
+        return nullptr;
+    }
+};
+
+//==============================================================================
+struct BlocksBroker::Internal  : private EventLoopTimer
+{
+    Internal (PhysicalTopologySource::DeviceDetector& d, const juce::String& brokerName)
+        : detector (d), file (getSharedMemoryFile (brokerName))
+    {
+        static_assert (std::is_standard_layout<BlocksBrokerSharedMemory>::value, "The shared memory must have a fixed layout");
+
+        if (! createSharedMemory (brokerName))
+        {
+            LOG_CONNECTIVITY ("Couldn't start the Blocks broker " << brokerName);
+            return;
+        }
+
+        detector.setDevicesChangedCallback ([this] { devicesChanged = true; });
+        scanForDevices();
+        startTimer (pollIntervalMs);
+    }
+
+    ~Internal() override
+    {
+        stopTimer();
+        detector.setDevicesChangedCallback (nullptr);
+
+        if (shared != nullptr)
+        {
+            shared->heartbeat = 0;
+            shared->session = 0;
+        }
+
+        for (int i = 0; i < maxDevices; ++i)
+            closeDevice (i);
+    }
+
+    bool createSharedMemory (const juce::String& brokerName)
+    {
+        // Without this, two brokers starting at once could both find the file unused
+        juce::InterProcessLock creationLock ("roli_blocks_broker_" + brokerName);
+        const juce::InterProcessLock::ScopedLockType sl (creationLock);
+
+        if (! sl.isLocked())
+            return false;
+
+        {
+            // Another broker with the same name may already be using the file
+            juce::MemoryMappedFile existing (file, juce::MemoryMappedFile::readOnly);
+
+            if (auto* current = BlocksBrokerSharedMemory::getFrom (&existing))
+                if (current->session.load() != 0 && current->isValid (current->session.load()))
+                    return false;
+        }
+
+        if (file.getSize() != (juce::int64) sizeof (BlocksBrokerSharedMemory))
+        {
+            file.deleteFile();
+            juce::FileOutputStream stream (file);
+
+            if (! stream.openedOk() || ! stream.writeRepeatedByte (0, sizeof (BlocksBrokerSharedMemory)))
+                return false;
+        }
+
+        mappedFile = std::make_unique<juce::MemoryMappedFile> (file, juce::MemoryMappedFile::readWrite);
+        shared = BlocksBrokerSharedMemory::getFrom (mappedFile.get());
+
+        if (shared == nullptr)
+            return false;
+
+        jassert (shared->heartbeat.is_lock_free() && shared->devices[0].packetsFromDevice.writePosition.is_lock_free());
+
+        // Any clients of an earlier broker see the session change and attach again
+        shared->session = 0;
+        auto oldGenerations = getGenerations();
+        memset (static_cast<void*> (shared), 0, sizeof (BlocksBrokerSharedMemory));
+
+        for (int i = 0; i < maxDevices; ++i)
+            shared->devices[i].generation = (oldGenerations[i] + 1) & ~1u;
+
+        shared->fileMagic = BlocksBrokerSharedMemory::magic;
+        shared->fileVersion = BlocksBrokerSharedMemory::version;
+        shared->heartbeat = juce::Time::currentTimeMillis();
+        shared->session = (juce::uint32) juce::jmax (1, juce::Random::getSystemRandom().nextInt());
+        session = shared->session;
+        return true;
+    }
+
+    std::array<juce::uint32, maxDevices> getGenerations() const noexcept
+    {
+        std::array<juce::uint32, maxDevices> generations;
+
+        for (int i = 0; i < maxDevices; ++i)
+            generations[(size_t) i] = shared->devices[i].generation.load();
+
+        return generations;
+    }
+
+    //==============================================================================
+    struct Device
+    {
+        std::unique_ptr<PhysicalTopologySource::DeviceConnection> connection;
+        juce::String name;
+        int controllingClient = -1;
+    };
+
+    void timerCallback() override
+    {
+        auto now = juce::Time::getMillisecondCounter();
+
+        if (devicesChanged.exchange (false) || now - lastScanTime >= deviceScanIntervalMs)
+            scanForDevices();
+
+        if (now - lastHeartbeatTime >= BlocksBrokerSharedMemory::heartbeatIntervalMs)
+        {
+            lastHeartbeatTime = now;
+            shared->heartbeat = juce::Time::currentTimeMillis();
+            updateClients();
+        }
+
+        for (int i = 0; i < maxClients; ++i)
+            if (activeClientIDs[i] != 0)
+                sendPacketsFromClient (i);
+    }
+
+    void scanForDevices()
+    {
+        lastScanTime = juce::Time::getMillisecondCounter();
+        auto names = detector.scanForDevices();
+
+        for (int i = 0; i < maxDevices; ++i)
+            if (devices[i].connection != nullptr && ! names.contains (devices[i].name))
+                closeDevice (i);
+
+        for (int i = 0; i < names.size(); ++i)
+            if (findDevice (names[i]) < 0)
+                openDevice (i, names[i]);
+    }
+
+    int findDevice (const juce::String& name) const noexcept
+    {
+        for (int i = 0; i < maxDevices; ++i)
+            if (devices[i].connection != nullptr && devices[i].name == name)
+                return i;
+
+        return -1;
+    }
+
+    void openDevice (int index, const juce::String& name)
+    {
+        int slotIndex = 0;
+
+        while (devices[slotIndex].connection != nullptr)
+            if (++slotIndex == maxDevices)
+                return;
+
+        auto* connection = detector.openDevice (index);
+
+        if (connection == nullptr)
+            return;
+
+        auto& device = devices[slotIndex];
+        auto& slot = shared->devices[slotIndex];
+
+        device.connection.reset (connection);
+        device.name = name;
+        setControllingClient (slotIndex, -1);
+
+        juce::zeromem (slot.name, sizeof (slot.name));
+        name.copyToUTF8 (slot.name, sizeof (slot.name));
+        slot.generation.store (slot.generation.load() | 1, std::memory_order_release);
+
+        // Each device's MIDI input thread is the only writer to its ring
+        connection->handleMessageFromDevice = [this, &slot] (const void* data, size_t dataSize)
+        {
+            if (dataSize <= BlocksBrokerSharedMemory::maxPacketSize)
+            {
+                slot.packetsFromDevice.write (data, (juce::uint32) dataSize, 0, false);
+                ++numPacketsFromDevices;
+            }
+        };
+
+        connection->callbacksChanged();
+
+        ++numDevicesOpen;
+        LOG_CONNECTIVITY ("Blocks broker opened " << name);
+    }
+
+    void closeDevice (int slotIndex)
+    {
+        auto& device = devices[slotIndex];
+
+        if (device.connection == nullptr)
+            return;
+
+        device.connection.reset();
+        setControllingClient (slotIndex, -1);
+
+        auto& slot = shared->devices[slotIndex];
+        slot.generation.store (slot.generation.load() + 1, std::memory_order_release);
+
+        --numDevicesOpen;
+        LOG_CONNECTIVITY ("Blocks broker closed " << device.name);
+    }
+
+    //==============================================================================
+    void updateClients()
+    {
+        auto now = juce::Time::currentTimeMillis();
+
+        for (int i = 0; i < maxClients; ++i)
+        {
+            auto& client = shared->clients[i];
+            auto clientID = client.session.load() == session ? client.clientID.load() : 0;
+
+            if (clientID != 0 && now - client.heartbeat.load() >= BlocksBrokerSharedMemory::timeoutMs)
+            {
+                LOG_CONNECTIVITY ("Blocks broker client " << i << " timed out");
+                auto expected = session;
+                client.session.compare_exchange_strong (expected, 0);
+                clientID = 0;
+            }
+
+            if (clientID == activeClientIDs[i])
+                continue;
+
+            // Control of a device doesn't pass to a new client that takes over the same slot
+            if (activeClientIDs[i] != 0)
+            {
+                for (int j = 0; j < maxDevices; ++j)
+                    if (devices[j].controllingClient == i)
+                        setControllingClient (j, -1);
+
+                --numClients;
+            }
+
+            if (clientID != 0)
+                ++numClients;
+
+            activeClientIDs[i] = clientID;
+        }
+    }
+
+    void sendPacketsFromClient (int clientIndex)
+    {
+        auto& client = shared->clients[clientIndex];
+
+        // The client may have gone since the last check, and its slot may even have been taken
+        if (client.session.load() != session || client.clientID.load() != activeClientIDs[clientIndex])
+            return;
+
+        auto& ring = client.packetsToDevices;
+        auto isReadOnly = client.isReadOnly.load() != 0;
+        juce::int64 numMissed = 0;
+
+        auto position = ring.read (ring.readPosition.load (std::memory_order_relaxed), false, numMissed,
+                                   [this, clientIndex, isReadOnly] (const juce::uint8* data, juce::uint32 size, juce::uint32 tag)
+        {
+            auto slotIndex = (int) (tag >> 24);
+
+            if (! juce::isPositiveAndBelow (slotIndex, maxDevices))
+                return;
+
+            auto& device = devices[slotIndex];
+
+            if (device.connection == nullptr
+                 || BlocksBrokerSharedMemory::createTag (slotIndex, shared->devices[slotIndex].generation.load()) != tag)
+                return;
+
+            if (needsControl (data, size))
+            {
+                if (device.controllingClient < 0 && ! isReadOnly)
+                    setControllingClient (slotIndex, clientIndex);
+
+                if (device.controllingClient != clientIndex)
+                {
+                    ++numPacketsRefused;
+                    return;
+                }
+            }
+
+            if (device.connection->sendMessageToDevice (data, size))
+                ++numPacketsToDevices;
+        });
+
+        ring.readPosition.store (position, std::memory_order_release);
+    }
+
+    /** Clients read the controlling client's ID, so that the others can hold back the
+        heap changes that would be refused.
+    */
+    void setControllingClient (int slotIndex, int clientIndex) noexcept
+    {
+        devices[slotIndex].controllingClient = clientIndex;
+        shared->devices[slotIndex].controllingClientID = clientIndex < 0 ? 0 : activeClientIDs[clientIndex];
+    }
+
+    /** Returns false for the packets that any client can send, which only ask a device
+        for things that every client is sent anyway.
+    */
+    static bool needsControl (const juce::uint8* data, juce::uint32 size) noexcept
+    {
+        constexpr auto headerSize = (juce::uint32) sizeof (BlocksProtocol::roliSysexHeader) + 1;
+
+        if (size < headerSize + 4)
+            return true;
+
+        BlocksProtocol::Packed7BitArrayReader reader (data + headerSize, (int) (size - headerSize - 2));
+
+        if (reader.getRemainingBits() < BlocksProtocol::MessageType::bits + BlocksProtocol::DeviceCommand::bits
+             || reader.read<BlocksProtocol::MessageType>().get() != (juce::uint32) BlocksProtocol::MessageFromHost::deviceCommandMessage)
+            return true;
+
+        auto command = reader.read<BlocksProtocol::DeviceCommand>().get();
+
+        return command != BlocksProtocol::ping
+                && command != BlocksProtocol::requestTopologyMessage
+                && command != BlocksProtocol::beginAPIMode;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.numClients = numClients;
+        stats.numDevicesOpen = numDevicesOpen;
+        stats.numPacketsFromDevices = numPacketsFromDevices;
+        stats.numPacketsToDevices = numPacketsToDevices;
+        stats.numPacketsRefused = numPacketsRefused;
+        return stats;
+    }
+
+    //==============================================================================
+    static constexpr int pollIntervalMs = 1;
+    static constexpr juce::uint32 deviceScanIntervalMs = 1500;
+
+    std::unique_ptr<PhysicalTopologySource::DeviceDetector> ownedDetector;
+    PhysicalTopologySource::DeviceDetector& detector;
+    const juce::File file;
+    std::unique_ptr<juce::MemoryMappedFile> mappedFile;
+    BlocksBrokerSharedMemory* shared = nullptr;
+    juce::uint32 session = 0;
+
+    Device devices[maxDevices];
+    juce::uint32 activeClientIDs[maxClients] = {};
+    std::atomic<bool> devicesChanged { false };
+    juce::uint32 lastScanTime = 0, lastHeartbeatTime = 0;
+
+    std::atomic<int> numClients { 0 }, numDevicesOpen { 0 };
+    std::atomic<juce::int64> numPacketsFromDevices { 0 }, numPacketsToDevices { 0 }, numPacketsRefused { 0 };
+};
+
+BlocksBroker::BlocksBroker (const juce::String& brokerName)
+{
+    auto midiDetector = std::make_unique<MIDIDeviceDetector>();
+    internal = std::make_unique<Internal> (*midiDetector, brokerName);
+    internal->ownedDetector = std::move (midiDetector);
+}
+
+BlocksBroker::BlocksBroker (PhysicalTopologySource::DeviceDetector& detectorToShare, const juce::String& brokerName)
+    : internal (std::make_unique<Internal> (detectorToShare, brokerName))
+{
+}
+
+BlocksBroker::~BlocksBroker()
+{
+    // The devices must be closed before the detector that opened them is deleted
+    auto ownedDetector = std::move (internal->ownedDetector);
+    internal.reset();
+}
+
+bool BlocksBroker::isRunning() const
+{
+    return internal->shared != nullptr;
+}
+
+BlocksBroker::Stats BlocksBroker::getStats() const
+{
+    return internal->getStats();
+}
+
+juce::File BlocksBroker::getSharedMemoryFile (const juce::String& brokerName)
+{
+    return juce::File::getSpecialLocation (juce::File::tempDirectory)
+             .getChildFile ("roli_blocks_broker_" + juce::File::createLegalFileName (brokerName));
+}
+
+//==============================================================================
+struct BlocksBrokerDeviceDetector::Internal  : private juce::Thread
+{
+    Internal (const juce::String& name, bool readOnly)
+        : juce::Thread ("Blocks broker client"), brokerName (name), isReadOnly (readOnly)
+    {
+        startThread();
+    }
+
+    ~Internal() override
+    {
+        stopThread (2000);
+
+        const juce::ScopedLock sl (lock);
+
+        for (auto* connection : connections)
+            connection->owner = nullptr;
+
+        detach();
+    }
+
+    //==============================================================================
+    /** The client thread only reads a connection's packets once callbacksChanged() has
+        been called, and then calls a copy of the callback that's taken under the lock
+        that the thread holds while reading.
+    */
+    struct BrokerConnection  : public PhysicalTopologySource::DeviceConnection
+    {
+        BrokerConnection (Internal& o, int slot, juce::uint32 gen, juce::uint64 position)
+            : owner (&o), slotIndex (slot), generation (gen), readPosition (position)
+        {
+        }
+
+        ~BrokerConnection() override
+        {
+            if (owner != nullptr)
+                owner->connectionDeleted (this);
+        }
+
+        bool sendMessageToDevice (const void* data, size_t dataSize) override
+        {
+            return owner != nullptr && owner->sendMessageToDevice (*this, data, dataSize);
+        }
+
+        void callbacksChanged() override
+        {
+            if (owner != nullptr)
+                owner->callbacksChanged (*this);
+        }
+
+        bool canControlDevice() override
+        {
+            return owner != nullptr && owner->canControlDevice (*this);
+        }
+
+        Internal* owner;
+        const int slotIndex;
+        const juce::uint32 generation;
+        juce::uint64 readPosition;
+
+        // Used while holding the owner's lock
+        std::function<void (const void* data, size_t dataSize)> messageCallback;
+        bool isReading = false;
+    };
+
+    //==============================================================================
+    juce::StringArray scanForDevices()
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (shared == nullptr || ! shared->isValid (session))
+            attach();
+
+        lastScannedDevices.clear();
+        lastScannedSlots.clear();
+
+        if (shared == nullptr)
+            return {};
+
+        for (int i = 0; i < BlocksBroker::maxDevices; ++i)
+        {
+            auto& slot = shared->devices[i];
+            auto generation = slot.generation.load (std::memory_order_acquire);
+
+            if ((generation & 1) == 0)
+                continue;
+
+            auto name = juce::String::fromUTF8 (slot.name, (int) strnlen (slot.name, sizeof (slot.name)));
+
+            if (slot.generation.load (std::memory_order_acquire) == generation)
+            {
+                lastScannedDevices.add (name);
+                lastScannedSlots.add ({ i, generation });
+            }
+        }
+
+        return lastScannedDevices;
+    }
+
+    PhysicalTopologySource::DeviceConnection* openDevice (int index)
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (shared == nullptr || ! juce::isPositiveAndBelow (index, lastScannedSlots.size()))
+            return nullptr;
+
+        auto scanned = lastScannedSlots[index];
+        auto& slot = shared->devices[scanned.slotIndex];
+
+        if (slot.generation.load (std::memory_order_acquire) != scanned.generation)
+            return nullptr;
+
+        // A new connection starts with the next packet that the device sends
+        auto* connection = new BrokerConnection (*this, scanned.slotIndex, scanned.generation,
+                                                 slot.packetsFromDevice.writePosition.load (std::memory_order_acquire));
+        connections.add (connection);
+        return connection;
+    }
+
+    void connectionDeleted (BrokerConnection* connection)
+    {
+        const juce::ScopedLock sl (lock);
+        connections.removeFirstMatchingValue (connection);
+    }
+
+    /** A client can send heap and program changes to a device that no other client
+        controls yet. Once the broker has given control to another one, they'd only be
+        refused, and the ACKs from the device would be for the other client's packets.
+    */
+    bool canControlDevice (const BrokerConnection& connection) const
+    {
+        if (isReadOnly)
+            return false;
+
+        const juce::SpinLock::ScopedLockType sl (sendLock);
+
+        if (client == nullptr || ! shared->isValid (session))
+            return false;
+
+        auto& slot = shared->devices[connection.slotIndex];
+
+        if (slot.generation.load (std::memory_order_acquire) != connection.generation)
+            return false;
+
+        auto controllingClientID = slot.controllingClientID.load();
+        return controllingClientID == 0 || controllingClientID == client->clientID.load();
+    }
+
+    void callbacksChanged (BrokerConnection& connection)
+    {
+        const juce::ScopedLock sl (lock);
+        connection.messageCallback = connection.handleMessageFromDevice;
+        connection.isReading = true;
+    }
+
+    bool sendMessageToDevice (BrokerConnection& connection, const void* data, size_t dataSize)
+    {
+        const juce::SpinLock::ScopedLockType sl (sendLock);
+
+        if (client != nullptr
+             && dataSize <= BlocksBrokerSharedMemory::maxPacketSize
+             && shared->isValid (session)
+             && client->packetsToDevices.write (data, (juce::uint32) dataSize,
+                                                BlocksBrokerSharedMemory::createTag (connection.slotIndex, connection.generation), true))
+        {
+            ++numPacketsSent;
+            return true;
+        }
+
+        ++numPacketsDropped;
+        return false;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.numPacketsReceived = numPacketsReceived;
+        stats.numPacketsMissed = numPacketsMissed;
+        stats.numPacketsSent = numPacketsSent;
+        stats.numPacketsDropped = numPacketsDropped;
+        return stats;
+    }
+
+    bool isAttached() const
+    {
+        const juce::ScopedLock sl (lock);
+        return shared != nullptr && shared->isValid (session);
+    }
+
+private:
+    //==============================================================================
+    void attach()
+    {
+        detach();
+
+        auto file = BlocksBroker::getSharedMemoryFile (brokerName);
+
+        if (! file.existsAsFile())
+            return;
+
+        auto newMappedFile = std::make_unique<juce::MemoryMappedFile> (file, juce::MemoryMappedFile::readWrite);
+        auto* newShared = BlocksBrokerSharedMemory::getFrom (newMappedFile.get());
+
+        if (newShared == nullptr)
+            return;
+
+        auto newSession = newShared->session.load();
+
+        if (newSession == 0 || ! newShared->isValid (newSession))
+            return;
+
+        for (auto& slot : newShared->clients)
+        {
+            juce::uint32 expected = 0;
+
+            if (slot.session.compare_exchange_strong (expected, newSession))
+            {
+                // Anything left in the ring by the slot's last client is thrown away
+                slot.packetsToDevices.discardUnread();
+                slot.isReadOnly = isReadOnly ? 1 : 0;
+                slot.heartbeat = juce::Time::currentTimeMillis();
+                slot.clientID = (juce::uint32) juce::jmax (1, juce::Random::getSystemRandom().nextInt());
+
+                const juce::SpinLock::ScopedLockType sl (sendLock);
+                mappedFile = std::move (newMappedFile);
+                shared = newShared;
+                session = newSession;
+                client = &slot;
+
+                LOG_CONNECTIVITY ("Attached to Blocks broker " << brokerName);
+                return;
+            }
+        }
+
+        LOG_CONNECTIVITY ("Blocks broker " << brokerName << " has no room for another client");
+    }
+
+    void detach()
+    {
+        const juce::SpinLock::ScopedLockType sl (sendLock);
+
+        if (client != nullptr)
+        {
+            auto expected = session;
+            client->session.compare_exchange_strong (expected, 0);
+        }
+
+        client = nullptr;
+        shared = nullptr;
+        session = 0;
+        mappedFile.reset();
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            {
+                const juce::ScopedLock sl (lock);
+
+                if (shared != nullptr && shared->isValid (session))
+                {
+                    auto now = juce::Time::currentTimeMillis();
+
+                    if (now - lastHeartbeat >= BlocksBrokerSharedMemory::heartbeatIntervalMs)
+                    {
+                        lastHeartbeat = now;
+                        client->heartbeat = now;
+                    }
+
+                    for (auto* connection : connections)
+                        if (connection->isReading)
+                            readPackets (*connection);
+                }
+            }
+
+            wait (pollIntervalMs);
+        }
+    }
+
+    void readPackets (BrokerConnection& connection)
+    {
+        auto& slot = shared->devices[connection.slotIndex];
+
+        // Once the device has gone, nothing more is read until the next scan removes it
+        if (slot.generation.load (std::memory_order_acquire) != connection.generation)
+            return;
+
+        juce::int64 numMissed = 0, numReceived = 0;
+
+        connection.readPosition = slot.packetsFromDevice.read (connection.readPosition, true, numMissed,
+                                                               [&] (const juce::uint8* data, juce::uint32 size, juce::uint32)
+        {
+            ++numReceived;
+
+            if (connection.messageCallback != nullptr)
+                connection.messageCallback (data, size);
+        });
+
+        numPacketsReceived += numReceived;
+        numPacketsMissed += numMissed;
+    }
+
+    //==============================================================================
+    static constexpr int pollIntervalMs = 1;
+
+    struct ScannedSlot
+    {
+        int slotIndex;
+        juce::uint32 generation;
+    };
+
+    const juce::String brokerName;
+    const bool isReadOnly;
+
+    juce::CriticalSection lock;
+    mutable juce::SpinLock sendLock;
+    std::unique_ptr<juce::MemoryMappedFile> mappedFile;
+    BlocksBrokerSharedMemory* shared = nullptr;
+    BlocksBrokerSharedMemory::ClientSlot* client = nullptr;
+    juce::uint32 session = 0;
+    juce::int64 lastHeartbeat = 0;
+
+    juce::Array<BrokerConnection*> connections;
+    juce::StringArray lastScannedDevices;
+    juce::Array<ScannedSlot> lastScannedSlots;
+
+    std::atomic<juce::int64> numPacketsReceived { 0 }, numPacketsMissed { 0 }, numPacketsSent { 0 }, numPacketsDropped { 0 };
+};
+
+BlocksBrokerDeviceDetector::BlocksBrokerDeviceDetector (const juce::String& brokerName, bool isReadOnly)
+    : internal (std::make_unique<Internal> (brokerName, isReadOnly))
+{
+}
+
+BlocksBrokerDeviceDetector::~BlocksBrokerDeviceDetector() = default;
+
+bool BlocksBrokerDeviceDetector::isAttachedToBroker() const                 { return internal->isAttached(); }
+BlocksBrokerDeviceDetector::Stats BlocksBrokerDeviceDetector::getStats() const     { return internal->getStats(); }
+
+juce::StringArray BlocksBrokerDeviceDetector::scanForDevices()
+{
+    return internal->scanForDevices();
+}
+
+PhysicalTopologySource::DeviceConnection* BlocksBrokerDeviceDetector::openDevice (int index)
+{
+    return internal->openDevice (index);
+}
+
+} // namespace roli
@@ -0,0 +1,163 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    Lets several processes share the same BLOCKS devices.
+
+    Normally a device can only be opened by one process, because its MIDI ports are
+    locked against other processes. A broker runs in a single process and opens the
+    devices on behalf of the others, which use a BlocksBrokerDeviceDetector to reach
+    them. Everything that the devices send is written once into a ring in shared
+    memory, and every client reads the packets from there and passes them straight
+    to its own PhysicalTopologySource without copying them. Packets that the clients
+    send are queued in a ring for each client, and the broker passes them on to the
+    devices.
+
+    Each client has the whole topology stack, so it sees the same blocks, touches and
+    buttons as it would with the devices to itself. Only one client at a time can
+    control a device, though: the first one that sends it anything other than a ping,
+    a topology request or a request to begin API mode. The heap and program changes,
+    config messages and resets of the other clients are dropped until the controlling
+    client goes away, and clients that only read from the devices can be created as
+    read-only so that they never take control. The blocks of a client that doesn't
+    have control hold back their heap and program changes, rather than sending them
+    to be dropped, so their programs only load once the client gets control.
+
+    The broker's work is done on the message thread, or a HeadlessEngine's event
+    loop. It must be created after any HeadlessEngine, and only one broker with a
+    given name can run on a machine at a time.
+
+    @code
+    // In the process that owns the devices:
+    BlocksBroker broker ("studio");
+
+    // In each of the others:
+    BlocksBrokerDeviceDetector detector ("studio");
+    PhysicalTopologySource source (detector);
+    @endcode
+
+    @see BlocksBrokerDeviceDetector
+
+    @tags{Blocks}
+*/
+class BlocksBroker
+{
+public:
+    /** Starts a broker for the standard MIDI Blocks devices. */
+    BlocksBroker (const juce::String& brokerName);
+
+    /** Starts a broker for the devices of another detector, which must outlive it. */
+    BlocksBroker (PhysicalTopologySource::DeviceDetector& detectorToShare, const juce::String& brokerName);
+
+    /** Destructor. Any clients lose their devices. */
+    ~BlocksBroker();
+
+    /** Returns false if the shared memory couldn't be set up, e.g. because another
+        broker with the same name is already running.
+    */
+    bool isRunning() const;
+
+    /** Statistics for the broker. */
+    struct Stats
+    {
+        int numClients = 0;
+        int numDevicesOpen = 0;
+        juce::int64 numPacketsFromDevices = 0;
+        juce::int64 numPacketsToDevices = 0;
+        juce::int64 numPacketsRefused = 0;
+    };
+
+    /** Returns the statistics since the broker started. */
+    Stats getStats() const;
+
+    /** Returns the file that holds the shared memory of a broker. */
+    static juce::File getSharedMemoryFile (const juce::String& brokerName);
+
+    /** The number of devices and clients that a broker can handle at once. */
+    static constexpr int maxDevices = 16;
+    static constexpr int maxClients = 8;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BlocksBroker)
+};
+
+//==============================================================================
+/**
+    A DeviceDetector whose devices are the ones shared by a BlocksBroker in another
+    process.
+
+    The detector attaches to the broker when it scans for devices, so it can be
+    created before the broker is started, and it attaches again if the broker is
+    restarted. Packets from the devices are read from shared memory by a background
+    thread, which checks for new ones every millisecond. The detector must outlive
+    any PhysicalTopologySource that uses it.
+
+    @see BlocksBroker
+
+    @tags{Blocks}
+*/
+class BlocksBrokerDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    /** Creates a client of the broker with the given name. A read-only client never
+        takes control of the devices, so its heap, program and config changes are
+        always dropped.
+    */
+    BlocksBrokerDeviceDetector (const juce::String& brokerName, bool isReadOnly = false);
+
+    /** Destructor. */
+    ~BlocksBrokerDeviceDetector() override;
+
+    /** Returns true if the detector is attached to a running broker. */
+    bool isAttachedToBroker() const;
+
+    /** Statistics for the client. */
+    struct Stats
+    {
+        juce::int64 numPacketsReceived = 0;
+        juce::int64 numPacketsMissed = 0;
+        juce::int64 numPacketsSent = 0;
+        juce::int64 numPacketsDropped = 0;
+    };
+
+    /** Returns the statistics since the detector was created. numPacketsMissed counts
+        the times that this client fell so far behind that packets were overwritten
+        before it read them, and numPacketsDropped counts the packets it couldn't send
+        because its queue was full or the broker had gone.
+    */
+    Stats getStats() const;
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BlocksBrokerDeviceDetector)
+};
+
+} // namespace roli
@@ -0,0 +1,594 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+struct EventLoopTimer;
+struct EventLoopAsyncUpdater;
+
+//==============================================================================
+/**
+    The event loop behind a HeadlessEngine.
+
+    Timers are kept on a hashed timing wheel with a slot for each millisecond, in
+    which each slot holds a linked list of the timers that expire at a matching
+    time, in this or a later turn of the wheel. Starting, stopping and firing a
+    timer doesn't depend on how many others are running.
+
+    @tags{Blocks}
+*/
+struct HeadlessEngine::EventLoop  : private juce::Thread
+{
+    EventLoop (HeadlessEngine&);
+    ~EventLoop() override;
+
+    static EventLoop* getCurrent() noexcept     { return current; }
+
+    static constexpr int numSlots = 512;
+
+    static juce::int64 getTimeMs() noexcept
+    {
+        return (juce::int64) juce::Time::getMillisecondCounterHiRes();
+    }
+
+    //==============================================================================
+    void startTimer (EventLoopTimer&, int intervalMs);
+    void stopTimer (EventLoopTimer&);
+    bool isTimerRunning (const EventLoopTimer&) const;
+    void callAfterDelay (int delayMs, std::function<void()>);
+    void deleteDelayedCall (EventLoopTimer*);
+
+    void postUpdate (EventLoopAsyncUpdater& updater)
+    {
+        {
+            const juce::ScopedLock sl (lock);
+            pendingUpdaters.add (&updater);
+        }
+
+        wakeEvent.signal();
+    }
+
+    void removeUpdater (EventLoopAsyncUpdater& updater)
+    {
+        const juce::ScopedLock sl (lock);
+        pendingUpdaters.removeAllInstancesOf (&updater);
+    }
+
+    void callAsync (std::function<void()> fn)
+    {
+        {
+            const juce::ScopedLock sl (lock);
+            pendingCalls.push_back (std::move (fn));
+        }
+
+        wakeEvent.signal();
+    }
+
+    //==============================================================================
+    int poll (double deadlineMs)
+    {
+        jassert (! isThreadRunning() || isEventLoopThread());
+        loopThreadID = juce::Thread::getCurrentThreadId();
+
+        int numCallbacks = 0;
+
+        for (;;)
+        {
+            numCallbacks += runAsyncCallbacks();
+            numCallbacks += runDueTimers();
+
+            auto now = juce::Time::getMillisecondCounterHiRes();
+
+            if (now >= deadlineMs || (isThreadRunning() && threadShouldExit()))
+                break;
+
+            auto timeToWait = deadlineMs - now;
+            auto timeUntilNextTimer = getTimeUntilNextTimer();
+
+            if (timeUntilNextTimer >= 0)
+                timeToWait = juce::jmin (timeToWait, timeUntilNextTimer);
+
+            wakeEvent.wait (juce::jmax (1, (int) std::ceil (timeToWait)));
+        }
+
+        return numCallbacks;
+    }
+
+    double getTimeUntilNextTimer() const;
+
+    bool isEventLoopThread() const noexcept
+    {
+        return juce::Thread::getCurrentThreadId() == loopThreadID.load();
+    }
+
+    void start()
+    {
+        startThread();
+    }
+
+    void stop()
+    {
+        if (isThreadRunning())
+        {
+            signalThreadShouldExit();
+            wakeEvent.signal();
+            stopThread (2000);
+        }
+    }
+
+    HeadlessEngine& engine;
+
+private:
+    juce::CriticalSection lock;
+    juce::WaitableEvent wakeEvent;
+    std::atomic<juce::Thread::ThreadID> loopThreadID;
+
+    EventLoopTimer* slots[numSlots] = {};
+    juce::int64 currentSlotTime;
+    int numTimersRunning = 0;
+
+    juce::Array<EventLoopAsyncUpdater*> pendingUpdaters;
+    std::vector<std::function<void()>> pendingCalls;
+    juce::OwnedArray<EventLoopTimer> delayedCalls;
+
+    static EventLoop* current;
+
+    void run() override
+    {
+        loopThreadID = juce::Thread::getCurrentThreadId();
+
+        while (! threadShouldExit())
+            poll (juce::Time::getMillisecondCounterHiRes() + 100.0);
+    }
+
+    EventLoopTimer*& getSlot (juce::int64 time) noexcept     { return slots[time & (numSlots - 1)]; }
+
+    void link (EventLoopTimer&);
+    void unlink (EventLoopTimer&);
+    EventLoopTimer* popDueTimer (juce::int64 now);
+    int runDueTimers();
+    int runAsyncCallbacks();
+
+    JUCE_DECLARE_NON_COPYABLE (EventLoop)
+};
+
+HeadlessEngine::EventLoop* HeadlessEngine::EventLoop::current = nullptr;
+
+//==============================================================================
+/**
+    Stands in for a juce::Timer in the topology stack. If a HeadlessEngine existed
+    when it was created, it runs on the engine's event loop, and otherwise it's an
+    ordinary juce::Timer.
+
+    @tags{Blocks}
+*/
+struct EventLoopTimer
+{
+    EventLoopTimer()  : eventLoop (HeadlessEngine::EventLoop::getCurrent()), juceTimer (*this) {}
+
+    virtual ~EventLoopTimer()
+    {
+        stopTimer();
+    }
+
+    virtual void timerCallback() = 0;
+
+    void startTimer (int newIntervalMs)
+    {
+        if (eventLoop != nullptr)
+            eventLoop->startTimer (*this, newIntervalMs);
+        else
+            juceTimer.startTimer (newIntervalMs);
+    }
+
+    void startTimerHz (int timerFrequencyHz)
+    {
+        if (timerFrequencyHz > 0)
+            startTimer (1000 / timerFrequencyHz);
+        else
+            stopTimer();
+    }
+
+    void stopTimer()
+    {
+        if (eventLoop != nullptr)
+            eventLoop->stopTimer (*this);
+        else
+            juceTimer.stopTimer();
+    }
+
+    bool isTimerRunning() const
+    {
+        if (eventLoop != nullptr)
+            return eventLoop->isTimerRunning (*this);
+
+        return juceTimer.isTimerRunning();
+    }
+
+    /** Calls a function once, after the given delay. */
+    static void callAfterDelay (int delayMs, std::function<void()> fn)
+    {
+        if (auto* loop = HeadlessEngine::EventLoop::getCurrent())
+            loop->callAfterDelay (delayMs, std::move (fn));
+        else
+            juce::Timer::callAfterDelay (delayMs, std::move (fn));
+    }
+
+private:
+    friend struct HeadlessEngine::EventLoop;
+
+    struct JuceTimer  : public juce::Timer
+    {
+        JuceTimer (EventLoopTimer& t)  : owner (t) {}
+        void timerCallback() override   { owner.timerCallback(); }
+
+        EventLoopTimer& owner;
+    };
+
+    HeadlessEngine::EventLoop* const eventLoop;
+    JuceTimer juceTimer;
+
+    // These are used by the event loop, while holding its lock
+    EventLoopTimer* previousInSlot = nullptr;
+    EventLoopTimer* nextInSlot = nullptr;
+    juce::int64 expiryTime = 0;
+    int intervalMs = 0;
+    bool isRunning = false;
+
+    JUCE_DECLARE_NON_COPYABLE (EventLoopTimer)
+};
+
+//==============================================================================
+/**
+    Stands in for a juce::AsyncUpdater in the topology stack. If a HeadlessEngine
+    existed when it was created, its updates are delivered by the engine's event
+    loop, and otherwise by the message thread.
+
+    @tags{Blocks}
+*/
+struct EventLoopAsyncUpdater
+{
+    EventLoopAsyncUpdater()  : eventLoop (HeadlessEngine::EventLoop::getCurrent()), juceUpdater (*this) {}
+
+    virtual ~EventLoopAsyncUpdater()
+    {
+        if (eventLoop != nullptr)
+            eventLoop->removeUpdater (*this);
+    }
+
+    virtual void handleAsyncUpdate() = 0;
+
+    /** Can be called from any thread. */
+    void triggerAsyncUpdate()
+    {
+        if (eventLoop == nullptr)
+            juceUpdater.triggerAsyncUpdate();
+        else if (! isUpdatePending.exchange (true))
+            eventLoop->postUpdate (*this);
+    }
+
+    void cancelPendingUpdate() noexcept
+    {
+        if (eventLoop == nullptr)
+            juceUpdater.cancelPendingUpdate();
+        else
+            isUpdatePending = false;
+    }
+
+private:
+    friend struct HeadlessEngine::EventLoop;
+
+    struct JuceUpdater  : public juce::AsyncUpdater
+    {
+        JuceUpdater (EventLoopAsyncUpdater& u)  : owner (u) {}
+        void handleAsyncUpdate() override   { owner.handleAsyncUpdate(); }
+
+        EventLoopAsyncUpdater& owner;
+    };
+
+    HeadlessEngine::EventLoop* const eventLoop;
+    JuceUpdater juceUpdater;
+    std::atomic<bool> isUpdatePending { false };
+
+    JUCE_DECLARE_NON_COPYABLE (EventLoopAsyncUpdater)
+};
+
+//==============================================================================
+/** Calls a function asynchronously on the thread that runs the topology stack. */
+static void callOnEventLoop (std::function<void()> fn)
+{
+    if (auto* loop = HeadlessEngine::EventLoop::getCurrent())
+        loop->callAsync (std::move (fn));
+    else
+        juce::MessageManager::callAsync (std::move (fn));
+}
+
+/** Returns true if this is the thread that the topology stack runs on. */
+static bool isThisTheEventLoopThread() noexcept
+{
+    if (auto* loop = HeadlessEngine::EventLoop::getCurrent())
+        return loop->isEventLoopThread();
+
+    return juce::MessageManager::existsAndIsLockedByCurrentThread();
+}
+
+//==============================================================================
+HeadlessEngine::EventLoop::EventLoop (HeadlessEngine& e)
+    : juce::Thread ("Blocks event loop"),
+      engine (e),
+      loopThreadID (juce::Thread::getCurrentThreadId()),
+      currentSlotTime (getTimeMs())
+{
+    jassert (current == nullptr); // Only one HeadlessEngine can exist at a time!
+    current = this;
+}
+
+HeadlessEngine::EventLoop::~EventLoop()
+{
+    stop();
+    delayedCalls.clear();
+
+    // All topology objects should have been deleted before the engine
+    jassert (numTimersRunning == 0);
+    current = nullptr;
+}
+
+void HeadlessEngine::EventLoop::startTimer (EventLoopTimer& timer, int intervalMs)
+{
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (timer.isRunning)
+            unlink (timer);
+
+        timer.intervalMs = juce::jmax (1, intervalMs);
+        timer.expiryTime = juce::jmax (currentSlotTime, getTimeMs() + timer.intervalMs);
+        link (timer);
+    }
+
+    wakeEvent.signal();
+}
+
+void HeadlessEngine::EventLoop::stopTimer (EventLoopTimer& timer)
+{
+    const juce::ScopedLock sl (lock);
+
+    if (timer.isRunning)
+        unlink (timer);
+}
+
+bool HeadlessEngine::EventLoop::isTimerRunning (const EventLoopTimer& timer) const
+{
+    const juce::ScopedLock sl (lock);
+    return timer.isRunning;
+}
+
+void HeadlessEngine::EventLoop::link (EventLoopTimer& timer)
+{
+    auto& head = getSlot (timer.expiryTime);
+
+    timer.previousInSlot = nullptr;
+    timer.nextInSlot = head;
+
+    if (head != nullptr)
+        head->previousInSlot = &timer;
+
+    head = &timer;
+    timer.isRunning = true;
+    ++numTimersRunning;
+}
+
+void HeadlessEngine::EventLoop::unlink (EventLoopTimer& timer)
+{
+    if (timer.previousInSlot != nullptr)
+        timer.previousInSlot->nextInSlot = timer.nextInSlot;
+    else
+        getSlot (timer.expiryTime) = timer.nextInSlot;
+
+    if (timer.nextInSlot != nullptr)
+        timer.nextInSlot->previousInSlot = timer.previousInSlot;
+
+    timer.previousInSlot = timer.nextInSlot = nullptr;
+    timer.isRunning = false;
+    --numTimersRunning;
+}
+
+// Turns the wheel up to the given time, returning the first timer that has expired.
+// The wheel stays on the current time's slot, so that timers which are started for
+// the current time are found by the next call.
+EventLoopTimer* HeadlessEngine::EventLoop::popDueTimer (juce::int64 now)
+{
+    // Every slot is visited in a single turn, so there's no need to visit any twice
+    currentSlotTime = juce::jmax (currentSlotTime, now - numSlots + 1);
+
+    for (;;)
+    {
+        for (auto* t = getSlot (currentSlotTime); t != nullptr; t = t->nextInSlot)
+        {
+            if (t->expiryTime <= now)
+            {
+                unlink (*t);
+                return t;
+            }
+        }
+
+        if (currentSlotTime >= now)
+            return nullptr;
+
+        ++currentSlotTime;
+    }
+}
+
+int HeadlessEngine::EventLoop::runDueTimers()
+{
+    auto now = getTimeMs();
+    int numCallbacks = 0;
+
+    for (;;)
+    {
+        EventLoopTimer* timer;
+
+        {
+            const juce::ScopedLock sl (lock);
+            timer = popDueTimer (now);
+
+            if (timer == nullptr)
+                break;
+
+            // Like a juce::Timer, this is restarted before the callback, which can stop it
+            timer->expiryTime = now + timer->intervalMs;
+            link (*timer);
+        }
+
+        timer->timerCallback();
+        ++numCallbacks;
+    }
+
+    return numCallbacks;
+}
+
+int HeadlessEngine::EventLoop::runAsyncCallbacks()
+{
+    std::vector<std::function<void()>> calls;
+    int numUpdaters;
+
+    {
+        const juce::ScopedLock sl (lock);
+        calls.swap (pendingCalls);
+        numUpdaters = pendingUpdaters.size();
+    }
+
+    int numCallbacks = 0;
+
+    // Updaters which are triggered again by their own callbacks wait until the next time
+    for (int i = 0; i < numUpdaters; ++i)
+    {
+        EventLoopAsyncUpdater* updater;
+
+        {
+            const juce::ScopedLock sl (lock);
+
+            if (pendingUpdaters.isEmpty())
+                break;
+
+            updater = pendingUpdaters.removeAndReturn (0);
+        }
+
+        if (updater->isUpdatePending.exchange (false))
+        {
+            updater->handleAsyncUpdate();
+            ++numCallbacks;
+        }
+    }
+
+    for (auto& call : calls)
+    {
+        call();
+        ++numCallbacks;
+    }
+
+    return numCallbacks;
+}
+
+// Walks the wheel forward from the current slot and stops at the first timer that
+// expires in this turn. No timer expires before currentSlotTime, so if there's none
+// in the whole turn, it's safe to wait until the turn is over and look again.
+double HeadlessEngine::EventLoop::getTimeUntilNextTimer() const
+{
+    const juce::ScopedLock sl (lock);
+
+    if (numTimersRunning == 0)
+        return -1.0;
+
+    auto nextExpiryTime = currentSlotTime + numSlots;
+
+    for (auto time = currentSlotTime; time < nextExpiryTime; ++time)
+    {
+        for (auto* t = slots[time & (numSlots - 1)]; t != nullptr; t = t->nextInSlot)
+        {
+            if (t->expiryTime <= time)
+            {
+                nextExpiryTime = time;
+                break;
+            }
+        }
+    }
+
+    return juce::jmax (0.0, (double) nextExpiryTime - juce::Time::getMillisecondCounterHiRes());
+}
+
+void HeadlessEngine::EventLoop::callAfterDelay (int delayMs, std::function<void()> fn)
+{
+    struct DelayedCall  : public EventLoopTimer
+    {
+        DelayedCall (std::function<void()> f)  : function (std::move (f)) {}
+
+        void timerCallback() override
+        {
+            auto f = std::move (function);
+            HeadlessEngine::EventLoop::getCurrent()->deleteDelayedCall (this);
+            f();
+        }
+
+        std::function<void()> function;
+    };
+
+    auto* call = new DelayedCall (std::move (fn));
+
+    {
+        const juce::ScopedLock sl (lock);
+        delayedCalls.add (call);
+    }
+
+    call->startTimer (delayMs);
+}
+
+void HeadlessEngine::EventLoop::deleteDelayedCall (EventLoopTimer* call)
+{
+    const juce::ScopedLock sl (lock);
+    delayedCalls.removeObject (call);
+}
+
+//==============================================================================
+HeadlessEngine::HeadlessEngine()  : eventLoop (std::make_unique<EventLoop> (*this)) {}
+HeadlessEngine::~HeadlessEngine() = default;
+
+int HeadlessEngine::poll (double deadlineMs)            { return eventLoop->poll (deadlineMs); }
+double HeadlessEngine::getTimeUntilNextTimer() const    { return eventLoop->getTimeUntilNextTimer(); }
+void HeadlessEngine::startThread()                      { eventLoop->start(); }
+void HeadlessEngine::stopThread()                       { eventLoop->stop(); }
+void HeadlessEngine::callAsync (std::function<void()> fn)   { eventLoop->callAsync (std::move (fn)); }
+bool HeadlessEngine::isEventLoopThread() const noexcept { return eventLoop->isEventLoopThread(); }
+
+HeadlessEngine* HeadlessEngine::getInstance() noexcept
+{
+    if (auto* loop = EventLoop::getCurrent())
+        return &loop->engine;
+
+    return nullptr;
+}
+
+} // namespace roli
+
+/** Asserts that this is the thread that the topology stack runs on: the message
+    thread, or a HeadlessEngine's event loop thread.
+*/
+#define ROLI_ASSERT_EVENT_LOOP_THREAD   jassert (roli::isThisTheEventLoopThread());
@@ -0,0 +1,104 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    Runs the topology stack without the JUCE message loop.
+
+    Normally, PhysicalTopologySource and everything behind it use juce::Timers and
+    AsyncUpdaters, so they need a running message thread. While a HeadlessEngine
+    exists, any topology objects created use its event loop instead, which keeps
+    all of their timers on a single timing wheel.
+
+    The event loop can be stepped explicitly by calling poll() from your own loop,
+    e.g.
+    @code
+    HeadlessEngine engine;
+    PhysicalTopologySource source;
+
+    while (! shouldQuit)
+    {
+        engine.poll (juce::Time::getMillisecondCounterHiRes() + 10.0);
+        doOtherWork();
+    }
+    @endcode
+
+    Or it can be given its own thread with startThread(). In that case, all calls
+    into the topology stack must be made on that thread, using callAsync().
+
+    Either way, listener callbacks are made on the thread that runs the event loop,
+    and the engine must be created before any topology sources and deleted after
+    them. Only one HeadlessEngine can exist at a time.
+
+    @tags{Blocks}
+*/
+class HeadlessEngine
+{
+public:
+    /** Creates the engine. The thread that creates it runs the event loop until
+        startThread() is called.
+    */
+    HeadlessEngine();
+
+    /** Destructor. */
+    ~HeadlessEngine();
+
+    /** Runs any timers and asynchronous callbacks as they become due, and returns
+        once the deadline has passed. The deadline is a value of
+        juce::Time::getMillisecondCounterHiRes(), and if it has already passed,
+        only the work that's due now is done. Returns the number of callbacks made.
+    */
+    int poll (double deadlineMs);
+
+    /** Returns the time, in milliseconds from now, until the next timer is due,
+        or a negative value if no timers are running.
+    */
+    double getTimeUntilNextTimer() const;
+
+    /** Starts a thread that runs the event loop until stopThread() is called. */
+    void startThread();
+
+    /** Stops the event loop's thread, if it's running. */
+    void stopThread();
+
+    /** Calls a function on the thread that runs the event loop. This can be called
+        from any thread.
+    */
+    void callAsync (std::function<void()>);
+
+    /** Returns true if this is being called on the thread that runs the event loop. */
+    bool isEventLoopThread() const noexcept;
+
+    /** Returns the engine that currently exists, or nullptr. */
+    static HeadlessEngine* getInstance() noexcept;
+
+    //==============================================================================
+    /** @internal */
+    struct EventLoop;
+
+private:
+    std::unique_ptr<EventLoop> eventLoop;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HeadlessEngine)
+};
+
+} // namespace roli
@@ -0,0 +1,999 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/** Reads and writes the datagrams described by NetworkBridgeProtocol. */
+struct NetworkBridgeDatagram
+{
+    using DatagramType = NetworkBridgeProtocol::DatagramType;
+
+    static constexpr int headerSize = NetworkBridgeProtocol::headerSize;
+    static constexpr int frameHeaderSize = NetworkBridgeProtocol::frameHeaderSize;
+    static constexpr int authTagSize = NetworkBridgeProtocol::authTagSize;
+    static constexpr int maxSize = NetworkBridgeProtocol::maxDatagramSize;
+    static constexpr int maxFrameSize = maxSize - headerSize - authTagSize - frameHeaderSize;
+
+    /** The sender's clock, in microseconds, which wraps every hour or so. */
+    static juce::uint32 getTimestamp() noexcept
+    {
+        return (juce::uint32) (juce::uint64) (juce::Time::getMillisecondCounterHiRes() * 1000.0);
+    }
+
+    static double getMillisecondsSince (juce::uint32 timestamp) noexcept
+    {
+        return (getTimestamp() - timestamp) / 1000.0;
+    }
+
+    static void writeUint16 (juce::uint8* dest, juce::uint16 value) noexcept
+    {
+        value = juce::ByteOrder::swapIfBigEndian (value);
+        memcpy (dest, &value, sizeof (value));
+    }
+
+    static void writeUint32 (juce::uint8* dest, juce::uint32 value) noexcept
+    {
+        value = juce::ByteOrder::swapIfBigEndian (value);
+        memcpy (dest, &value, sizeof (value));
+    }
+
+    //==============================================================================
+    /** The SipHash-2-4 key that the datagrams' tags are made with. */
+    struct Key
+    {
+        juce::uint64 k0 = 0, k1 = 0;
+
+        /** Derives a key from a shared secret, which may be empty. */
+        static Key fromSecret (const juce::String& secret) noexcept
+        {
+            auto* data = reinterpret_cast<const juce::uint8*> (secret.toRawUTF8());
+            auto size = (int) secret.getNumBytesAsUTF8();
+
+            Key key;
+            key.k0 = sipHash ({ NetworkBridgeProtocol::magic, 0 }, data, size);
+            key.k1 = sipHash ({ NetworkBridgeProtocol::magic, 1 }, data, size);
+            return key;
+        }
+    };
+
+    static juce::uint64 sipHash (const Key& key, const juce::uint8* data, int size) noexcept
+    {
+        juce::uint64 v0 = key.k0 ^ 0x736f6d6570736575ull;
+        juce::uint64 v1 = key.k1 ^ 0x646f72616e646f6dull;
+        juce::uint64 v2 = key.k0 ^ 0x6c7967656e657261ull;
+        juce::uint64 v3 = key.k1 ^ 0x7465646279746573ull;
+
+        auto rotate = [] (juce::uint64 x, int n) noexcept { return (x << n) | (x >> (64 - n)); };
+
+        auto rounds = [&] (int numRounds) noexcept
+        {
+            for (int i = 0; i < numRounds; ++i)
+            {
+                v0 += v1; v1 = rotate (v1, 13); v1 ^= v0; v0 = rotate (v0, 32);
+                v2 += v3; v3 = rotate (v3, 16); v3 ^= v2;
+                v0 += v3; v3 = rotate (v3, 21); v3 ^= v0;
+                v2 += v1; v1 = rotate (v1, 17); v1 ^= v2; v2 = rotate (v2, 32);
+            }
+        };
+
+        auto compress = [&] (juce::uint64 m) noexcept
+        {
+            v3 ^= m;
+            rounds (2);
+            v0 ^= m;
+        };
+
+        auto end = size - size % 8;
+
+        for (int i = 0; i < end; i += 8)
+            compress ((juce::uint64) juce::ByteOrder::littleEndianInt64 (data + i));
+
+        auto last = (juce::uint64) (juce::uint8) size << 56;
+
+        for (int i = end; i < size; ++i)
+            last |= (juce::uint64) data[i] << (8 * (i - end));
+
+        compress (last);
+        v2 ^= 0xff;
+        rounds (4);
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    //==============================================================================
+    /** A datagram that's being built up to send. */
+    struct Builder
+    {
+        void start (DatagramType type, juce::uint32 timestamp) noexcept
+        {
+            writeUint32 (data, NetworkBridgeProtocol::magic);
+            data[4] = NetworkBridgeProtocol::version;
+            data[5] = (juce::uint8) type;
+            writeUint16 (data + 6, 0);
+            writeUint32 (data + 12, timestamp);
+            size = headerSize;
+        }
+
+        bool hasFrames() const noexcept                     { return size > headerSize; }
+        bool hasSpaceFor (size_t dataSize) const noexcept   { return size + frameHeaderSize + (int) dataSize <= maxSize - authTagSize; }
+
+        void addFrame (juce::uint16 deviceID, const void* frameData, size_t dataSize) noexcept
+        {
+            jassert (hasSpaceFor (dataSize));
+            writeUint16 (data + size, deviceID);
+            writeUint16 (data + size + 2, (juce::uint16) dataSize);
+            memcpy (data + size + frameHeaderSize, frameData, dataSize);
+            size += frameHeaderSize + (int) dataSize;
+        }
+
+        void addDeviceList (const juce::Array<std::pair<juce::uint16, juce::String>>& devices) noexcept
+        {
+            auto* countPos = data + size;
+            juce::uint16 count = 0;
+            size += 2;
+
+            for (auto& device : devices)
+            {
+                auto nameSize = juce::jmin ((int) device.second.getNumBytesAsUTF8(), 255);
+
+                if (size + 3 + nameSize > maxSize - authTagSize)
+                    break;
+
+                writeUint16 (data + size, device.first);
+                data[size + 2] = (juce::uint8) nameSize;
+                memcpy (data + size + 3, device.second.toRawUTF8(), (size_t) nameSize);
+                size += 3 + nameSize;
+                ++count;
+            }
+
+            writeUint16 (countPos, count);
+        }
+
+        /** Sends the datagram, setting its sequence number and tag just before it goes. */
+        bool send (juce::DatagramSocket& socket, const juce::String& host, int port, juce::uint32& sequenceNumber) noexcept
+        {
+            writeUint32 (data + 8, sequenceNumber++);
+            writeUint64 (data + size, sipHash (key, data, size));
+            auto ok = socket.write (host, port, data, size + authTagSize) == size + authTagSize;
+            size = headerSize;
+            return ok;
+        }
+
+        Key key;
+        juce::uint8 data[maxSize];
+        int size = 0;
+    };
+
+    static void writeUint64 (juce::uint8* dest, juce::uint64 value) noexcept
+    {
+        value = juce::ByteOrder::swapIfBigEndian (value);
+        memcpy (dest, &value, sizeof (value));
+    }
+
+    //==============================================================================
+    /** Checks a received datagram's header and tag, returning false if it isn't one of
+        ours. Otherwise the size is reduced to leave out the tag.
+    */
+    static bool parseHeader (const juce::uint8* data, int& size, const Key& key, DatagramType& type,
+                             juce::uint32& sequenceNumber, juce::uint32& timestamp) noexcept
+    {
+        if (size < headerSize + authTagSize
+             || juce::ByteOrder::littleEndianInt (data) != NetworkBridgeProtocol::magic
+             || data[4] != NetworkBridgeProtocol::version
+             || data[5] > (juce::uint8) DatagramType::goodbye)
+            return false;
+
+        auto contentSize = size - authTagSize;
+
+        if (sipHash (key, data, contentSize) != (juce::uint64) juce::ByteOrder::littleEndianInt64 (data + contentSize))
+            return false;
+
+        size = contentSize;
+
+        type = (DatagramType) data[5];
+        sequenceNumber = juce::ByteOrder::littleEndianInt (data + 8);
+        timestamp = juce::ByteOrder::littleEndianInt (data + 12);
+        return true;
+    }
+
+    /** Calls a function with the device ID, data and size of each of a run of frames. */
+    template <typename FrameHandler>
+    static void forEachFrame (const juce::uint8* frames, int size, FrameHandler&& handleFrame)
+    {
+        for (int pos = 0; pos + frameHeaderSize <= size;)
+        {
+            auto deviceID = juce::ByteOrder::littleEndianShort (frames + pos);
+            auto frameSize = (int) juce::ByteOrder::littleEndianShort (frames + pos + 2);
+            pos += frameHeaderSize;
+
+            if (pos + frameSize > size)
+                return;
+
+            handleFrame (deviceID, frames + pos, (size_t) frameSize);
+            pos += frameSize;
+        }
+    }
+
+    /** Calls a function with the device ID and name of each entry in a device list. */
+    template <typename DeviceHandler>
+    static void forEachDevice (const juce::uint8* data, int size, DeviceHandler&& handleDevice)
+    {
+        if (size < headerSize + 2)
+            return;
+
+        auto count = (int) juce::ByteOrder::littleEndianShort (data + headerSize);
+
+        for (int i = 0, pos = headerSize + 2; i < count && pos + 3 <= size; ++i)
+        {
+            auto deviceID = juce::ByteOrder::littleEndianShort (data + pos);
+            auto nameSize = (int) data[pos + 2];
+            pos += 3;
+
+            if (pos + nameSize > size)
+                return;
+
+            handleDevice (deviceID, juce::String::fromUTF8 (reinterpret_cast<const char*> (data + pos), nameSize));
+            pos += nameSize;
+        }
+    }
+
+    /** Adds the gap, if any, between the last sequence number that was received and a
+        new one to a count of lost datagrams. Late and duplicated ones aren't counted, but
+        a number that's a long way behind means that the sender has started again.
+    */
+    static void checkSequence (juce::uint32 sequenceNumber, juce::uint32& nextExpected,
+                               std::atomic<juce::int64>& numLost) noexcept
+    {
+        auto gap = (juce::int32) (sequenceNumber - nextExpected);
+
+        if (gap < 0)
+        {
+            if (gap < -maxReorderDistance)
+                nextExpected = sequenceNumber + 1;
+
+            return;
+        }
+
+        numLost += gap;
+        nextExpected = sequenceNumber + 1;
+    }
+
+    /** Packs the frames that have been queued by other threads into as few datagrams as
+        possible, and sends them. The queue is swapped out, so the other threads only wait
+        for the time it takes to append a frame.
+    */
+    static void sendQueuedFrames (juce::SpinLock& queueLock, std::vector<juce::uint8>& queue,
+                                  std::vector<juce::uint8>& scratch, Builder& builder,
+                                  juce::DatagramSocket& socket, const juce::String& host, int port,
+                                  juce::uint32& sequenceNumber, std::atomic<juce::int64>& numDatagramsSent)
+    {
+        scratch.clear();
+
+        {
+            const juce::SpinLock::ScopedLockType sl (queueLock);
+            std::swap (queue, scratch);
+        }
+
+        if (scratch.empty())
+            return;
+
+        builder.start (DatagramType::frames, getTimestamp());
+
+        forEachFrame (scratch.data(), (int) scratch.size(), [&] (juce::uint16 deviceID, const juce::uint8* frameData, size_t frameSize)
+        {
+            if (! builder.hasSpaceFor (frameSize))
+            {
+                builder.send (socket, host, port, sequenceNumber);
+                ++numDatagramsSent;
+                builder.start (DatagramType::frames, getTimestamp());
+            }
+
+            builder.addFrame (deviceID, frameData, frameSize);
+        });
+
+        if (builder.hasFrames())
+        {
+            builder.send (socket, host, port, sequenceNumber);
+            ++numDatagramsSent;
+        }
+    }
+
+    /** Appends a frame to a queue that's waiting to be sent, unless the queue is full. */
+    static bool queueFrame (juce::SpinLock& queueLock, std::vector<juce::uint8>& queue,
+                            juce::uint16 deviceID, const void* frameData, size_t dataSize)
+    {
+        if (dataSize > (size_t) maxFrameSize)
+            return false;
+
+        const juce::SpinLock::ScopedLockType sl (queueLock);
+
+        if (queue.size() + frameHeaderSize + dataSize > maxQueuedBytes)
+            return false;
+
+        auto pos = queue.size();
+        queue.resize (pos + frameHeaderSize + dataSize);
+        writeUint16 (queue.data() + pos, deviceID);
+        writeUint16 (queue.data() + pos + 2, (juce::uint16) dataSize);
+        memcpy (queue.data() + pos + frameHeaderSize, frameData, dataSize);
+        return true;
+    }
+
+    static constexpr size_t maxQueuedBytes = 65536;
+    static constexpr int maxReorderDistance = 1024;
+    static constexpr juce::uint32 timeoutMs = 2000;
+    static constexpr juce::uint32 helloIntervalMs = 250;
+    static constexpr int pollIntervalMs = 1;
+};
+
+//==============================================================================
+struct NetworkBridgeServer::Internal  : private EventLoopTimer,
+                                        private juce::Thread
+{
+    Internal (PhysicalTopologySource::DeviceDetector& d, int port, const juce::String& bindAddress, const juce::String& sharedSecret)
+        : juce::Thread ("Blocks network bridge server"), detector (d),
+          key (NetworkBridgeDatagram::Key::fromSecret (sharedSecret))
+    {
+        pendingFrames.reserve (NetworkBridgeDatagram::maxQueuedBytes);
+        framesToSend.reserve (NetworkBridgeDatagram::maxQueuedBytes);
+        builder.key = key;
+
+        if (sharedSecret.isEmpty() && ! isLoopbackAddress (bindAddress))
+        {
+            // Anyone who can reach the port could use the devices, so a secret is needed
+            jassertfalse;
+            LOG_CONNECTIVITY ("The Blocks network bridge needs a shared secret to listen on '" << bindAddress << "'");
+            return;
+        }
+
+        if (! socket.bindToPort (port, bindAddress))
+        {
+            LOG_CONNECTIVITY ("Couldn't open the Blocks network bridge on " << bindAddress << ":" << port);
+            return;
+        }
+
+        LOG_CONNECTIVITY ("Blocks network bridge listening on " << bindAddress << ":" << socket.getBoundPort());
+        isListening = true;
+
+        detector.setDevicesChangedCallback ([this] { devicesChanged = true; });
+        scanForDevices();
+        startTimer (NetworkBridgeDatagram::pollIntervalMs);
+        startThread();
+    }
+
+    ~Internal() override
+    {
+        stopTimer();
+        signalThreadShouldExit();
+        socket.shutdown();
+        stopThread (2000);
+
+        if (isListening)
+            detector.setDevicesChangedCallback (nullptr);
+
+        devices.clear();
+    }
+
+    static bool isLoopbackAddress (const juce::String& address)
+    {
+        return address.startsWith ("127.") || address == "::1" || address == "localhost";
+    }
+
+    //==============================================================================
+    struct Device
+    {
+        std::unique_ptr<PhysicalTopologySource::DeviceConnection> connection;
+        juce::String name;
+        juce::uint16 deviceID;
+    };
+
+    // Called on the event loop
+    void timerCallback() override
+    {
+        if (devicesChanged.exchange (false)
+             || juce::Time::getMillisecondCounter() - lastScanTime >= deviceScanIntervalMs)
+            scanForDevices();
+
+        // The device ID of each packet is kept in the place of its timestamp
+        packetsToDevices.popAll ([this] (const juce::uint8* data, int size, juce::int64 deviceID)
+        {
+            for (auto& device : devices)
+            {
+                if (device.deviceID == (juce::uint16) deviceID)
+                {
+                    if (device.connection->sendMessageToDevice (data, (size_t) size))
+                        ++numPacketsToDevices;
+
+                    break;
+                }
+            }
+        });
+    }
+
+    void scanForDevices()
+    {
+        lastScanTime = juce::Time::getMillisecondCounter();
+        auto names = detector.scanForDevices();
+        bool listChanged = false;
+
+        for (auto i = (int) devices.size(); --i >= 0;)
+        {
+            if (! names.contains (devices[(size_t) i].name))
+            {
+                LOG_CONNECTIVITY ("Blocks network bridge closed " << devices[(size_t) i].name);
+                devices.erase (devices.begin() + i);
+                listChanged = true;
+            }
+        }
+
+        for (int i = 0; i < names.size(); ++i)
+        {
+            auto isOpen = std::any_of (devices.begin(), devices.end(),
+                                       [&] (const Device& d) { return d.name == names[i]; });
+
+            if (! isOpen && openDevice (i, names[i]))
+                listChanged = true;
+        }
+
+        if (listChanged)
+        {
+            juce::Array<std::pair<juce::uint16, juce::String>> newList;
+
+            for (auto& device : devices)
+                newList.add ({ device.deviceID, device.name });
+
+            const juce::ScopedLock sl (deviceListLock);
+            deviceList = newList;
+        }
+
+        numDevicesOpen = (int) devices.size();
+    }
+
+    bool openDevice (int index, const juce::String& name)
+    {
+        auto* connection = detector.openDevice (index);
+
+        if (connection == nullptr)
+            return false;
+
+        // IDs aren't reused, so packets still in flight for a device that's gone aren't
+        // passed to a new one
+        auto deviceID = nextDeviceID++;
+
+        if (nextDeviceID == 0)
+            nextDeviceID = 1;
+
+        connection->handleMessageFromDevice = [this, deviceID] (const void* data, size_t dataSize)
+        {
+            if (! hasClient)
+                return;
+
+            if (NetworkBridgeDatagram::queueFrame (pendingFramesLock, pendingFrames, deviceID, data, dataSize))
+                ++numPacketsFromDevices;
+            else
+                ++numPacketsDropped;
+        };
+
+        connection->callbacksChanged();
+
+        devices.push_back ({ std::unique_ptr<PhysicalTopologySource::DeviceConnection> (connection), name, deviceID });
+        LOG_CONNECTIVITY ("Blocks network bridge opened " << name);
+        return true;
+    }
+
+    //==============================================================================
+    // The network thread does all of the reading from and writing to the socket
+    void run() override
+    {
+        juce::HeapBlock<juce::uint8> buffer ((size_t) NetworkBridgeDatagram::maxSize + 1);
+
+        while (! threadShouldExit())
+        {
+            if (socket.waitUntilReady (true, NetworkBridgeDatagram::pollIntervalMs) > 0)
+            {
+                juce::String senderHost;
+                int senderPort = 0;
+                auto size = socket.read (buffer, NetworkBridgeDatagram::maxSize + 1, false, senderHost, senderPort);
+
+                if (size > 0)
+                    handleDatagram (buffer, size, senderHost, senderPort);
+            }
+
+            if (hasClient)
+            {
+                if (juce::Time::getMillisecondCounter() - lastHeardFromClient >= NetworkBridgeDatagram::timeoutMs)
+                {
+                    LOG_CONNECTIVITY ("Blocks network bridge client " << clientHost << ":" << clientPort << " timed out");
+                    dropClient();
+                }
+                else
+                {
+                    NetworkBridgeDatagram::sendQueuedFrames (pendingFramesLock, pendingFrames, framesToSend, builder, socket,
+                                                             clientHost, clientPort, sequenceNumber, numDatagramsSent);
+                }
+            }
+        }
+    }
+
+    void handleDatagram (const juce::uint8* data, int size, const juce::String& senderHost, int senderPort)
+    {
+        NetworkBridgeProtocol::DatagramType type;
+        juce::uint32 senderSequenceNumber, timestamp;
+
+        if (! NetworkBridgeDatagram::parseHeader (data, size, key, type, senderSequenceNumber, timestamp))
+        {
+            ++numDatagramsRejected;
+            return;
+        }
+
+        auto isFromClient = hasClient && senderHost == clientHost && senderPort == clientPort;
+
+        if (! isFromClient)
+        {
+            // Only one client is served at a time
+            if (hasClient || type != NetworkBridgeProtocol::DatagramType::hello)
+                return;
+
+            clientHost = senderHost;
+            clientPort = senderPort;
+            nextExpectedSequenceNumber = senderSequenceNumber;
+            hasClient = true;
+            LOG_CONNECTIVITY ("Blocks network bridge client " << clientHost << ":" << clientPort << " connected");
+        }
+
+        lastHeardFromClient = juce::Time::getMillisecondCounter();
+        ++numDatagramsReceived;
+        NetworkBridgeDatagram::checkSequence (senderSequenceNumber, nextExpectedSequenceNumber, numDatagramsLost);
+
+        switch (type)
+        {
+            case NetworkBridgeProtocol::DatagramType::hello:
+                sendDeviceList (timestamp);
+                break;
+
+            case NetworkBridgeProtocol::DatagramType::frames:
+                NetworkBridgeDatagram::forEachFrame (data + NetworkBridgeProtocol::headerSize, size - NetworkBridgeProtocol::headerSize, [this] (juce::uint16 deviceID, const juce::uint8* frameData, size_t frameSize)
+                {
+                    if (! packetsToDevices.push (frameData, frameSize, deviceID))
+                        ++numPacketsDropped;
+                });
+                break;
+
+            case NetworkBridgeProtocol::DatagramType::goodbye:
+                LOG_CONNECTIVITY ("Blocks network bridge client " << clientHost << ":" << clientPort << " disconnected");
+                dropClient();
+                break;
+
+            case NetworkBridgeProtocol::DatagramType::deviceList:
+            default:
+                break;
+        }
+    }
+
+    void sendDeviceList (juce::uint32 helloTimestamp)
+    {
+        builder.start (NetworkBridgeProtocol::DatagramType::deviceList, helloTimestamp);
+
+        {
+            const juce::ScopedLock sl (deviceListLock);
+            builder.addDeviceList (deviceList);
+        }
+
+        builder.send (socket, clientHost, clientPort, sequenceNumber);
+        ++numDatagramsSent;
+    }
+
+    void dropClient()
+    {
+        hasClient = false;
+
+        const juce::SpinLock::ScopedLockType sl (pendingFramesLock);
+        pendingFrames.clear();
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.hasClient = hasClient;
+        stats.numDevicesOpen = numDevicesOpen;
+        stats.numDatagramsSent = numDatagramsSent;
+        stats.numDatagramsReceived = numDatagramsReceived;
+        stats.numDatagramsLost = numDatagramsLost;
+        stats.numDatagramsRejected = numDatagramsRejected;
+        stats.numPacketsFromDevices = numPacketsFromDevices;
+        stats.numPacketsToDevices = numPacketsToDevices;
+        stats.numPacketsDropped = numPacketsDropped;
+        return stats;
+    }
+
+    //==============================================================================
+    static constexpr juce::uint32 deviceScanIntervalMs = 1500;
+
+    std::unique_ptr<PhysicalTopologySource::DeviceDetector> ownedDetector;
+    PhysicalTopologySource::DeviceDetector& detector;
+    const NetworkBridgeDatagram::Key key;
+    juce::DatagramSocket socket { false };
+    bool isListening = false;
+
+    // Used on the event loop
+    std::vector<Device> devices;
+    juce::uint16 nextDeviceID = 1;
+    juce::uint32 lastScanTime = 0;
+    std::atomic<bool> devicesChanged { false };
+
+    juce::CriticalSection deviceListLock;
+    juce::Array<std::pair<juce::uint16, juce::String>> deviceList;
+
+    // Filled by the devices' threads and sent by the network thread
+    juce::SpinLock pendingFramesLock;
+    std::vector<juce::uint8> pendingFrames;
+
+    // Filled by the network thread and sent to the devices on the event loop
+    PacketFifo packetsToDevices;
+
+    // Used on the network thread
+    std::vector<juce::uint8> framesToSend;
+    NetworkBridgeDatagram::Builder builder;
+    juce::String clientHost;
+    int clientPort = 0;
+    juce::uint32 sequenceNumber = 0, nextExpectedSequenceNumber = 0, lastHeardFromClient = 0;
+
+    std::atomic<bool> hasClient { false };
+    std::atomic<int> numDevicesOpen { 0 };
+    std::atomic<juce::int64> numDatagramsSent { 0 }, numDatagramsReceived { 0 }, numDatagramsLost { 0 }, numDatagramsRejected { 0 },
+                             numPacketsFromDevices { 0 }, numPacketsToDevices { 0 }, numPacketsDropped { 0 };
+};
+
+NetworkBridgeServer::NetworkBridgeServer (int port, const juce::String& bindAddress, const juce::String& sharedSecret)
+{
+    auto midiDetector = std::make_unique<MIDIDeviceDetector>();
+    internal = std::make_unique<Internal> (*midiDetector, port, bindAddress, sharedSecret);
+    internal->ownedDetector = std::move (midiDetector);
+}
+
+NetworkBridgeServer::NetworkBridgeServer (PhysicalTopologySource::DeviceDetector& detectorToServe, int port,
+                                          const juce::String& bindAddress, const juce::String& sharedSecret)
+    : internal (std::make_unique<Internal> (detectorToServe, port, bindAddress, sharedSecret))
+{
+}
+
+NetworkBridgeServer::~NetworkBridgeServer()
+{
+    // The devices must be closed before the detector that opened them is deleted
+    auto ownedDetector = std::move (internal->ownedDetector);
+    internal.reset();
+}
+
+bool NetworkBridgeServer::isRunning() const                         { return internal->isListening; }
+int NetworkBridgeServer::getPort() const                            { return internal->socket.getBoundPort(); }
+NetworkBridgeServer::Stats NetworkBridgeServer::getStats() const    { return internal->getStats(); }
+
+//==============================================================================
+struct NetworkBridgeDeviceDetector::Internal  : private juce::Thread
+{
+    Internal (NetworkBridgeDeviceDetector& d, const juce::String& host, int port, const juce::String& sharedSecret)
+        : juce::Thread ("Blocks network bridge client"), owner (d), serverHost (host), serverPort (port),
+          key (NetworkBridgeDatagram::Key::fromSecret (sharedSecret))
+    {
+        outgoingFrames.reserve (NetworkBridgeDatagram::maxQueuedBytes);
+        framesToSend.reserve (NetworkBridgeDatagram::maxQueuedBytes);
+        builder.key = key;
+
+        if (socket.bindToPort (0))
+            startThread();
+        else
+            LOG_CONNECTIVITY ("Couldn't open a socket for the Blocks network bridge");
+    }
+
+    ~Internal() override
+    {
+        signalThreadShouldExit();
+        stopThread (2000);
+
+        if (socket.getBoundPort() > 0)
+        {
+            builder.start (NetworkBridgeProtocol::DatagramType::goodbye, NetworkBridgeDatagram::getTimestamp());
+            builder.send (socket, serverHost, serverPort, sequenceNumber);
+        }
+
+        socket.shutdown();
+
+        const juce::ScopedLock sl (lock);
+
+        for (auto* connection : connections)
+            connection->owner = nullptr;
+    }
+
+    //==============================================================================
+    /** The network thread only passes packets to a connection once callbacksChanged()
+        has been called, and then calls a copy of the callback that's taken under the
+        lock that the thread holds while doing so.
+    */
+    struct RemoteConnection  : public PhysicalTopologySource::DeviceConnection
+    {
+        RemoteConnection (Internal& o, juce::uint16 id)  : owner (&o), deviceID (id) {}
+
+        ~RemoteConnection() override
+        {
+            if (owner != nullptr)
+                owner->connectionDeleted (this);
+        }
+
+        bool sendMessageToDevice (const void* data, size_t dataSize) override
+        {
+            return owner != nullptr && owner->sendMessageToDevice (deviceID, data, dataSize);
+        }
+
+        void callbacksChanged() override
+        {
+            if (owner != nullptr)
+                owner->callbacksChanged (*this);
+        }
+
+        Internal* owner;
+        const juce::uint16 deviceID;
+
+        // Used while holding the owner's lock
+        std::function<void (const void* data, size_t dataSize)> messageCallback;
+    };
+
+    //==============================================================================
+    bool isConnected() const noexcept
+    {
+        auto lastReply = lastHeardFromServer.load();
+        return lastReply != 0 && juce::Time::getMillisecondCounter() - lastReply < NetworkBridgeDatagram::timeoutMs;
+    }
+
+    juce::StringArray scanForDevices()
+    {
+        const juce::ScopedLock sl (lock);
+
+        lastScannedDevices.clearQuick();
+        juce::StringArray names;
+
+        if (isConnected())
+        {
+            lastScannedDevices = serverDevices;
+
+            for (auto& device : lastScannedDevices)
+                names.add (device.second);
+        }
+
+        return names;
+    }
+
+    PhysicalTopologySource::DeviceConnection* openDevice (int index)
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (! juce::isPositiveAndBelow (index, lastScannedDevices.size()))
+            return nullptr;
+
+        auto* connection = new RemoteConnection (*this, lastScannedDevices.getReference (index).first);
+        connections.add (connection);
+        return connection;
+    }
+
+    void connectionDeleted (RemoteConnection* connection)
+    {
+        const juce::ScopedLock sl (lock);
+        connections.removeFirstMatchingValue (connection);
+    }
+
+    void callbacksChanged (RemoteConnection& connection)
+    {
+        const juce::ScopedLock sl (lock);
+        connection.messageCallback = connection.handleMessageFromDevice;
+    }
+
+    bool sendMessageToDevice (juce::uint16 deviceID, const void* data, size_t dataSize)
+    {
+        if (isConnected()
+             && NetworkBridgeDatagram::queueFrame (outgoingFramesLock, outgoingFrames, deviceID, data, dataSize))
+        {
+            ++numPacketsSent;
+            return true;
+        }
+
+        ++numPacketsDropped;
+        return false;
+    }
+
+    //==============================================================================
+    void run() override
+    {
+        juce::HeapBlock<juce::uint8> buffer ((size_t) NetworkBridgeDatagram::maxSize + 1);
+        juce::uint32 lastHelloTime = 0;
+        bool wasConnected = false;
+
+        while (! threadShouldExit())
+        {
+            auto now = juce::Time::getMillisecondCounter();
+
+            if (wasConnected != isConnected())
+            {
+                wasConnected = ! wasConnected;
+                LOG_CONNECTIVITY ("Blocks network bridge " << (wasConnected ? "connected to " : "lost ")
+                                    << serverHost << ":" << serverPort);
+                owner.notifyDevicesChanged();
+            }
+
+            if (lastHelloTime == 0 || now - lastHelloTime >= NetworkBridgeDatagram::helloIntervalMs)
+            {
+                lastHelloTime = now;
+                builder.start (NetworkBridgeProtocol::DatagramType::hello, NetworkBridgeDatagram::getTimestamp());
+                builder.send (socket, serverHost, serverPort, sequenceNumber);
+                ++numDatagramsSent;
+            }
+
+            NetworkBridgeDatagram::sendQueuedFrames (outgoingFramesLock, outgoingFrames, framesToSend, builder, socket,
+                                                     serverHost, serverPort, sequenceNumber, numDatagramsSent);
+
+            if (socket.waitUntilReady (true, NetworkBridgeDatagram::pollIntervalMs) > 0)
+            {
+                juce::String senderHost;
+                int senderPort = 0;
+                auto size = socket.read (buffer, NetworkBridgeDatagram::maxSize + 1, false, senderHost, senderPort);
+
+                if (size > 0 && senderPort == serverPort)
+                    handleDatagram (buffer, size);
+            }
+        }
+    }
+
+    void handleDatagram (const juce::uint8* data, int size)
+    {
+        NetworkBridgeProtocol::DatagramType type;
+        juce::uint32 serverSequenceNumber, timestamp;
+
+        if (! NetworkBridgeDatagram::parseHeader (data, size, key, type, serverSequenceNumber, timestamp))
+        {
+            ++numDatagramsRejected;
+            return;
+        }
+
+        if (lastHeardFromServer == 0 || ! isConnected())
+            nextExpectedSequenceNumber = serverSequenceNumber;
+
+        lastHeardFromServer = juce::jmax (1u, juce::Time::getMillisecondCounter());
+        ++numDatagramsReceived;
+        NetworkBridgeDatagram::checkSequence (serverSequenceNumber, nextExpectedSequenceNumber, numDatagramsLost);
+
+        if (type == NetworkBridgeProtocol::DatagramType::deviceList)
+        {
+            updateRoundTripTime (NetworkBridgeDatagram::getMillisecondsSince (timestamp));
+
+            juce::Array<std::pair<juce::uint16, juce::String>> devices;
+            NetworkBridgeDatagram::forEachDevice (data, size, [&] (juce::uint16 deviceID, const juce::String& name)
+            {
+                devices.add ({ deviceID, name });
+            });
+
+            {
+                const juce::ScopedLock sl (lock);
+
+                if (devices == serverDevices)
+                    return;
+
+                serverDevices = devices;
+            }
+
+            // The detector scans for devices straight away, rather than waiting for its next scan
+            owner.notifyDevicesChanged();
+        }
+        else if (type == NetworkBridgeProtocol::DatagramType::frames)
+        {
+            juce::int64 numReceived = 0;
+
+            {
+                const juce::ScopedLock sl (lock);
+
+                NetworkBridgeDatagram::forEachFrame (data + NetworkBridgeProtocol::headerSize, size - NetworkBridgeProtocol::headerSize, [&] (juce::uint16 deviceID, const juce::uint8* frameData, size_t frameSize)
+                {
+                    ++numReceived;
+
+                    for (auto* connection : connections)
+                        if (connection->deviceID == deviceID && connection->messageCallback != nullptr)
+                            connection->messageCallback (frameData, frameSize);
+                });
+            }
+
+            numPacketsReceived += numReceived;
+        }
+    }
+
+    void updateRoundTripTime (double roundTripMs)
+    {
+        const juce::SpinLock::ScopedLockType sl (statsLock);
+
+        ++numRoundTrips;
+        stats.lastRoundTripMs = roundTripMs;
+        stats.averageRoundTripMs += (roundTripMs - stats.averageRoundTripMs) / (double) numRoundTrips;
+        stats.maxRoundTripMs = juce::jmax (stats.maxRoundTripMs, roundTripMs);
+    }
+
+    Stats getStats() const
+    {
+        Stats result;
+
+        {
+            const juce::SpinLock::ScopedLockType sl (statsLock);
+            result = stats;
+        }
+
+        result.numDatagramsSent = numDatagramsSent;
+        result.numDatagramsReceived = numDatagramsReceived;
+        result.numDatagramsLost = numDatagramsLost;
+        result.numDatagramsRejected = numDatagramsRejected;
+        result.numPacketsReceived = numPacketsReceived;
+        result.numPacketsSent = numPacketsSent;
+        result.numPacketsDropped = numPacketsDropped;
+        return result;
+    }
+
+    //==============================================================================
+    NetworkBridgeDeviceDetector& owner;
+    const juce::String serverHost;
+    const int serverPort;
+    const NetworkBridgeDatagram::Key key;
+    juce::DatagramSocket socket { false };
+
+    juce::CriticalSection lock;
+    juce::Array<RemoteConnection*> connections;
+    juce::Array<std::pair<juce::uint16, juce::String>> serverDevices, lastScannedDevices;
+
+    // Filled by the connections and sent by the network thread
+    juce::SpinLock outgoingFramesLock;
+    std::vector<juce::uint8> outgoingFrames;
+
+    // Used on the network thread
+    std::vector<juce::uint8> framesToSend;
+    NetworkBridgeDatagram::Builder builder;
+    juce::uint32 sequenceNumber = 0, nextExpectedSequenceNumber = 0;
+    std::atomic<juce::uint32> lastHeardFromServer { 0 };
+
+    mutable juce::SpinLock statsLock;
+    Stats stats;
+    juce::int64 numRoundTrips = 0;
+    std::atomic<juce::int64> numDatagramsSent { 0 }, numDatagramsReceived { 0 }, numDatagramsLost { 0 }, numDatagramsRejected { 0 },
+                             numPacketsReceived { 0 }, numPacketsSent { 0 }, numPacketsDropped { 0 };
+};
+
+NetworkBridgeDeviceDetector::NetworkBridgeDeviceDetector (const juce::String& serverHost, int serverPort, const juce::String& sharedSecret)
+    : internal (std::make_unique<Internal> (*this, serverHost, serverPort, sharedSecret))
+{
+}
+
+NetworkBridgeDeviceDetector::~NetworkBridgeDeviceDetector() = default;
+
+bool NetworkBridgeDeviceDetector::isConnectedToServer() const                       { return internal->isConnected(); }
+NetworkBridgeDeviceDetector::Stats NetworkBridgeDeviceDetector::getStats() const    { return internal->getStats(); }
+
+juce::StringArray NetworkBridgeDeviceDetector::scanForDevices()
+{
+    return internal->scanForDevices();
+}
+
+PhysicalTopologySource::DeviceConnection* NetworkBridgeDeviceDetector::openDevice (int index)
+{
+    return internal->openDevice (index);
+}
+
+} // namespace roli
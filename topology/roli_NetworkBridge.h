@@ -0,0 +1,223 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    The format of the UDP datagrams exchanged by a NetworkBridgeServer and a
+    NetworkBridgeDeviceDetector.
+
+    Each datagram starts with a headerSize header and ends with an authTagSize tag,
+    and all values are little-endian.
+
+    Header:
+    - uint32: the magic number
+    - uint8:  the version
+    - uint8:  the DatagramType
+    - uint16: reserved
+    - uint32: a sequence number, counted separately by each sender, used to detect loss
+    - uint32: the sender's clock in microseconds, or for a deviceList, the time from the hello it answers
+
+    A frames datagram holds any number of frames, each of which is a uint16 device ID,
+    a uint16 size, and then a packet passed to or from DeviceConnection. A deviceList
+    holds a uint16 count, followed by a uint16 device ID, a uint8 name length and the
+    UTF-8 name of each device. hello and goodbye have nothing after the header.
+
+    The tag is a SipHash-2-4 of everything before it, keyed by the secret that the
+    server and client share, and datagrams whose tag doesn't match are ignored. The
+    tag proves that the sender knows the secret, but the contents aren't encrypted,
+    and a datagram that's captured and sent again will be accepted.
+
+    @tags{Blocks}
+*/
+struct NetworkBridgeProtocol
+{
+    enum class DatagramType : juce::uint8
+    {
+        hello,
+        deviceList,
+        frames,
+        goodbye
+    };
+
+    static constexpr juce::uint32 magic = 0x544e4b42; // "BKNT"
+    static constexpr juce::uint8 version = 2;
+    static constexpr int headerSize = 16;
+    static constexpr int frameHeaderSize = 4;
+    static constexpr int authTagSize = 8;
+
+    /** Datagrams are kept below a typical MTU, so that they aren't fragmented. */
+    static constexpr int maxDatagramSize = 1400;
+    static constexpr int defaultPort = 36600;
+};
+
+//==============================================================================
+/**
+    Makes the BLOCKS devices connected to this machine available to a
+    NetworkBridgeDeviceDetector on another one.
+
+    The server opens the devices itself, and serves a single client at a time: the
+    first one to say hello, until it says goodbye or hasn't been heard from for a
+    couple of seconds. The packets that the devices send are batched into datagrams,
+    which are sent every millisecond or as soon as one is full, and the client's
+    packets are passed on to the devices. Nothing is resent, so a lost datagram is
+    handled in the same way as a lost MIDI message, by the timeouts and
+    acknowledgements of the Blocks protocol.
+
+    By default the server only listens on the loopback interface. To serve clients
+    on other machines, give it the address of the interface to listen on, or an empty
+    string for all of them, and a shared secret that the clients must also be given.
+    The server won't listen on any other interface without a secret.
+
+    The server's work with the devices is done on the message thread, or a
+    HeadlessEngine's event loop, so it must be created after any HeadlessEngine.
+
+    @code
+    // On the machine with the blocks:
+    NetworkBridgeServer server (NetworkBridgeProtocol::defaultPort, {}, "a long random secret");
+
+    // On the other one:
+    NetworkBridgeDeviceDetector detector ("edge-box.local", NetworkBridgeProtocol::defaultPort, "a long random secret");
+    PhysicalTopologySource source (detector);
+    @endcode
+
+    @see NetworkBridgeDeviceDetector, NetworkBridgeProtocol
+
+    @tags{Blocks}
+*/
+class NetworkBridgeServer
+{
+public:
+    /** Serves the standard MIDI Blocks devices on a UDP port of the given local address.
+        If the address isn't a loopback one, the secret mustn't be empty.
+    */
+    NetworkBridgeServer (int port = NetworkBridgeProtocol::defaultPort,
+                         const juce::String& bindAddress = "127.0.0.1",
+                         const juce::String& sharedSecret = {});
+
+    /** Serves the devices of another detector, which must outlive the server. */
+    NetworkBridgeServer (PhysicalTopologySource::DeviceDetector& detectorToServe,
+                         int port = NetworkBridgeProtocol::defaultPort,
+                         const juce::String& bindAddress = "127.0.0.1",
+                         const juce::String& sharedSecret = {});
+
+    /** Destructor. */
+    ~NetworkBridgeServer();
+
+    /** Returns false if the port couldn't be opened, or a secret was needed but not given. */
+    bool isRunning() const;
+
+    /** Returns the port that the server is listening on. */
+    int getPort() const;
+
+    /** Statistics for the server. */
+    struct Stats
+    {
+        bool hasClient = false;
+        int numDevicesOpen = 0;
+        juce::int64 numDatagramsSent = 0;
+        juce::int64 numDatagramsReceived = 0;
+        juce::int64 numDatagramsLost = 0;
+        juce::int64 numDatagramsRejected = 0;
+        juce::int64 numPacketsFromDevices = 0;
+        juce::int64 numPacketsToDevices = 0;
+        juce::int64 numPacketsDropped = 0;
+    };
+
+    /** Returns the statistics since the server started. numDatagramsLost counts the
+        gaps in the client's sequence numbers, numDatagramsRejected the ones that
+        weren't ours or whose tag didn't match, and numPacketsDropped the packets from
+        the devices that were thrown away because the network couldn't keep up.
+    */
+    Stats getStats() const;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (NetworkBridgeServer)
+};
+
+//==============================================================================
+/**
+    A DeviceDetector whose devices are the ones served by a NetworkBridgeServer on
+    another machine.
+
+    A background thread says hello to the server every quarter of a second, which
+    also measures the round-trip time, and receives the list of devices and the
+    packets that they send. The packets are passed on from that thread, in the same
+    way as packets from a MIDI input thread. Packets sent to the devices are batched
+    and sent by the same thread every millisecond. The detector must outlive any
+    PhysicalTopologySource that uses it.
+
+    @see NetworkBridgeServer
+
+    @tags{Blocks}
+*/
+class NetworkBridgeDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    /** Creates a detector for the server on a given host and port, which must have
+        been given the same secret.
+    */
+    NetworkBridgeDeviceDetector (const juce::String& serverHost,
+                                 int serverPort = NetworkBridgeProtocol::defaultPort,
+                                 const juce::String& sharedSecret = {});
+
+    /** Destructor. */
+    ~NetworkBridgeDeviceDetector() override;
+
+    /** Returns true if the server has answered recently. */
+    bool isConnectedToServer() const;
+
+    /** Statistics for the client. */
+    struct Stats
+    {
+        juce::int64 numDatagramsSent = 0;
+        juce::int64 numDatagramsReceived = 0;
+        juce::int64 numDatagramsLost = 0;
+        juce::int64 numDatagramsRejected = 0;
+        juce::int64 numPacketsReceived = 0;
+        juce::int64 numPacketsSent = 0;
+        juce::int64 numPacketsDropped = 0;
+        double lastRoundTripMs = 0;
+        double averageRoundTripMs = 0;
+        double maxRoundTripMs = 0;
+    };
+
+    /** Returns the statistics since the detector was created. numDatagramsLost counts
+        the gaps in the server's sequence numbers, numDatagramsRejected the ones that
+        weren't ours or whose tag didn't match, and numPacketsDropped the packets that
+        couldn't be sent because the network couldn't keep up.
+    */
+    Stats getStats() const;
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (NetworkBridgeDeviceDetector)
+};
+
+} // namespace roli
@@ -57,11 +57,20 @@
  #include "internal/roli_BandwidthStatsLogger.cpp"
 #endif
 
+#include "internal/roli_CopyOnWriteValue.cpp"
+#include "internal/roli_PacketFifo.cpp"
+#include "internal/roli_SysexStreamParser.cpp"
+#include "internal/roli_MidiOutputWriter.cpp"
 #include "internal/roli_MidiDeviceConnection.cpp"
 #include "internal/roli_MIDIDeviceDetector.cpp"
+#include "internal/roli_HotplugMIDIDeviceDetector.cpp"
 #include "internal/roli_DeviceInfo.cpp"
 #include "internal/roli_DepreciatedVersionReader.cpp"
 #include "internal/roli_BlockSerialReader.cpp"
+#include "internal/roli_ConnectionBandwidthScheduler.cpp"
+#include "internal/roli_RealtimeTouchDispatcher.cpp"
+#include "internal/roli_DeviceClockEstimator.cpp"
+#include "internal/roli_BlockTickScheduler.cpp"
 #include "internal/roli_ConnectedDeviceGroup.cpp"
 #include "internal/roli_BlockImplementation.cpp"
 #include "internal/roli_Detector.cpp"
@@ -91,7 +100,7 @@ PhysicalTopologySource::~PhysicalTopologySource()
 
 void PhysicalTopologySource::setActive (bool shouldBeActive)
 {
-    JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED
+    ROLI_ASSERT_EVENT_LOOP_THREAD
 
     if (isActive() == shouldBeActive)
         return;
@@ -104,9 +113,21 @@ void PhysicalTopologySource::setActive (bool shouldBeActive)
             detector = std::make_unique<DetectorHolder>(*this, *customDetector);
 
         detector->detector->activeTopologySources.add (this);
+
+        for (auto* l : realtimeTouchListeners)
+            detector->detector->realtimeTouches.addListener (l);
+
+        detector->setTickRate (blockTickRate, blockTickRatePerBlock);
+        detector->setNumRenderThreads (numLEDRenderThreads);
+
+        if (usbBandwidthLimit > 0 || bluetoothBandwidthLimit > 0)
+            detector->detector->setBandwidthLimits (usbBandwidthLimit, bluetoothBandwidthLimit);
     }
     else
     {
+        for (auto* l : realtimeTouchListeners)
+            detector->detector->realtimeTouches.removeListener (l);
+
         detector->detector->detach (this);
         detector.reset();
     }
@@ -129,7 +150,7 @@ bool PhysicalTopologySource::isLockedFromOutside() const
 
 BlockTopology PhysicalTopologySource::getCurrentTopology() const
 {
-    JUCE_ASSERT_MESSAGE_MANAGER_IS_LOCKED // This method must only be called from the message thread!
+    ROLI_ASSERT_EVENT_LOOP_THREAD // This method must only be called from the message thread!
 
     if (detector != nullptr)
         return detector->detector->currentTopology;
@@ -143,6 +164,111 @@ void PhysicalTopologySource::cancelAllActiveTouches() noexcept
         detector->detector->cancelAllActiveTouches();
 }
 
+bool PhysicalTopologySource::addRealtimeTouchListener (RealtimeTouchListener* listener)
+{
+    if (listener == nullptr || realtimeTouchListeners.contains (listener)
+         || realtimeTouchListeners.size() >= maxRealtimeTouchListeners)
+        return false;
+
+    if (detector != nullptr && ! detector->detector->realtimeTouches.addListener (listener))
+        return false;
+
+    realtimeTouchListeners.add (listener);
+    return true;
+}
+
+void PhysicalTopologySource::removeRealtimeTouchListener (RealtimeTouchListener* listener)
+{
+    if (! realtimeTouchListeners.contains (listener))
+        return;
+
+    if (detector != nullptr)
+        detector->detector->realtimeTouches.removeListener (listener);
+
+    realtimeTouchListeners.removeFirstMatchingValue (listener);
+}
+
+PhysicalTopologySource::TouchLatencyHistogram PhysicalTopologySource::getTouchLatencyHistogram (TouchDeliveryPath path) const
+{
+    if (detector != nullptr)
+        return detector->detector->realtimeTouches.getLatencyRecorder (path).get();
+
+    return {};
+}
+
+void PhysicalTopologySource::resetTouchLatencyHistograms()
+{
+    if (detector != nullptr)
+    {
+        detector->detector->realtimeTouches.getLatencyRecorder (TouchDeliveryPath::realtime).reset();
+        detector->detector->realtimeTouches.getLatencyRecorder (TouchDeliveryPath::messageThread).reset();
+    }
+}
+
+void PhysicalTopologySource::setBlockTickRate (double ticksPerSecond, bool ratePerBlock)
+{
+    blockTickRate = ticksPerSecond;
+    blockTickRatePerBlock = ratePerBlock;
+
+    if (detector != nullptr)
+        detector->setTickRate (ticksPerSecond, ratePerBlock);
+}
+
+double PhysicalTopologySource::getBlockTickRate() const noexcept
+{
+    return blockTickRate;
+}
+
+bool PhysicalTopologySource::isBlockTickRatePerBlock() const noexcept
+{
+    return blockTickRatePerBlock;
+}
+
+void PhysicalTopologySource::setNumLEDRenderThreads (int numThreads)
+{
+    numLEDRenderThreads = numThreads;
+
+    if (detector != nullptr)
+        detector->setNumRenderThreads (numThreads);
+}
+
+void PhysicalTopologySource::setBandwidthLimit (int usbBytesPerSecond, int bluetoothBytesPerSecond)
+{
+    ROLI_ASSERT_EVENT_LOOP_THREAD
+
+    usbBandwidthLimit = juce::jmax (0, usbBytesPerSecond);
+    bluetoothBandwidthLimit = juce::jmax (0, bluetoothBytesPerSecond);
+
+    if (detector != nullptr)
+        detector->detector->setBandwidthLimits (usbBandwidthLimit, bluetoothBandwidthLimit);
+}
+
+juce::uint32 PhysicalTopologySource::TouchLatencyHistogram::getTotal() const noexcept
+{
+    juce::uint32 total = 0;
+
+    for (auto c : counts)
+        total += c;
+
+    return total;
+}
+
+double PhysicalTopologySource::TouchLatencyHistogram::getPercentileMicroseconds (double percentile) const noexcept
+{
+    auto target = (double) getTotal() * juce::jlimit (0.0, 100.0, percentile) / 100.0;
+    double total = 0;
+
+    for (int i = 0; i < numBuckets; ++i)
+    {
+        total += counts[i];
+
+        if (total >= target && total > 0)
+            return (double) (1u << i);
+    }
+
+    return 0;
+}
+
 bool PhysicalTopologySource::hasOwnServiceTimer() const     { return false; }
 void PhysicalTopologySource::handleTimerTick()
 {
@@ -153,9 +279,37 @@ void PhysicalTopologySource::handleTimerTick()
 PhysicalTopologySource::DeviceConnection::DeviceConnection() {}
 PhysicalTopologySource::DeviceConnection::~DeviceConnection() {}
 
+void PhysicalTopologySource::DeviceConnection::callbacksChanged() {}
+
+juce::int64 PhysicalTopologySource::DeviceConnection::getLastMessageID()                        { return juce::Time::getHighResolutionTicks(); }
+juce::int64 PhysicalTopologySource::DeviceConnection::getMessageWriteTime (juce::int64 messageID)  { return messageID; }
+bool PhysicalTopologySource::DeviceConnection::canControlDevice()                                { return true; }
+
+std::unique_ptr<PhysicalTopologySource::DeviceDetector> PhysicalTopologySource::createMIDIDeviceDetector (bool detectHotplug)
+{
+    if (detectHotplug)
+        return std::make_unique<HotplugMIDIDeviceDetector>();
+
+    return std::make_unique<MIDIDeviceDetector>();
+}
+
 PhysicalTopologySource::DeviceDetector::DeviceDetector() {}
 PhysicalTopologySource::DeviceDetector::~DeviceDetector() {}
 
+void PhysicalTopologySource::DeviceDetector::notifyDevicesChanged()
+{
+    const juce::ScopedLock sl (devicesChangedLock);
+
+    if (devicesChangedCallback != nullptr)
+        devicesChangedCallback();
+}
+
+void PhysicalTopologySource::DeviceDetector::setDevicesChangedCallback (std::function<void()> callback)
+{
+    const juce::ScopedLock sl (devicesChangedLock);
+    devicesChangedCallback = std::move (callback);
+}
+
 const char* const* PhysicalTopologySource::getStandardLittleFootFunctions() noexcept
 {
     return BlocksProtocol::ledProgramLittleFootFunctions;
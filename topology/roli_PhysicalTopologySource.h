@@ -61,6 +61,29 @@ public:
 
         virtual bool sendMessageToDevice (const void* data, size_t dataSize) = 0;
         std::function<void (const void* data, size_t dataSize)> handleMessageFromDevice;
+
+        /** This must be called after setting handleMessageFromDevice. A connection that
+            calls it from another thread may wait until then to start reading the device,
+            and once this returns, it won't call the previous function again.
+        */
+        virtual void callbacksChanged();
+
+        /** Returns a number identifying the last message that was passed to sendMessageToDevice,
+            which can be given to getMessageWriteTime later on.
+        */
+        virtual juce::int64 getLastMessageID();
+
+        /** Returns the high resolution tick count when a message was written to the device,
+            or 0 if that isn't known. The default implementation suits connections that write
+            each message before sendMessageToDevice returns, and uses the time as the ID.
+        */
+        virtual juce::int64 getMessageWriteTime (juce::int64 messageID);
+
+        /** Returns false while something else has control of the device, e.g. another
+            client of a BlocksBroker, in which case the blocks hold back their heap and
+            program changes until this returns true again.
+        */
+        virtual bool canControlDevice();
     };
 
     /** For custom transport systems, this represents a connected device */
@@ -72,13 +95,134 @@ public:
         virtual juce::StringArray scanForDevices() = 0;
         virtual DeviceConnection* openDevice (int index) = 0;
         virtual bool isLockedFromOutside() const { return false; }
+
+        /** Devices are scanned for every 1.5 seconds, but a detector that finds out
+            when they're plugged in or removed can call this to have them scanned for
+            straight away. It can be called from any thread.
+        */
+        void notifyDevicesChanged();
+
+        /** @internal */
+        void setDevicesChangedCallback (std::function<void()>);
+
+    private:
+        juce::CriticalSection devicesChangedLock;
+        std::function<void()> devicesChangedCallback;
     };
 
     /** Constructor for custom transport systems. */
     PhysicalTopologySource (DeviceDetector& detectorToUse, bool startDetached = false);
 
+    /** Creates a detector for blocks that are connected over MIDI, like the one that's
+        used by default.
+
+        If detectHotplug is true, then on Linux the detector is told by the ALSA sequencer
+        when devices are plugged in or removed. It reuses the previous scan in between,
+        rather than enumerating every MIDI port every time it scans. Elsewhere, or if the
+        sequencer can't be opened, this makes no difference.
+    */
+    static std::unique_ptr<DeviceDetector> createMIDIDeviceDetector (bool detectHotplug = false);
+
     static const char* const* getStandardLittleFootFunctions() noexcept;
 
+    //==============================================================================
+    /** Receives touches as soon as they have been decoded, without waiting for
+        the message thread.
+
+        The callback is made on the thread that received the packet (usually a
+        MIDI input thread), and may be made concurrently if blocks are connected
+        through more than one port, so it must be thread-safe and must never block.
+        The touches are scaled to the size of their block, just as they are for a
+        TouchSurface::Listener.
+
+        @see RealtimeTouchQueue
+    */
+    struct RealtimeTouchListener
+    {
+        virtual ~RealtimeTouchListener() = default;
+        virtual void touchChanged (const TouchSurface::Touch&) = 0;
+    };
+
+    static constexpr int maxRealtimeTouchListeners = 8;
+
+    /** Registers a real-time touch listener. Returns false if the maximum number
+        of listeners has already been registered.
+    */
+    bool addRealtimeTouchListener (RealtimeTouchListener*);
+
+    /** Unregisters a real-time touch listener. Once this returns, the listener
+        won't be called again.
+    */
+    void removeRealtimeTouchListener (RealtimeTouchListener*);
+
+    //==============================================================================
+    /** Counts how long touches took to be delivered, measured from the time their
+        packet arrived. counts[0] holds the touches that took less than 1 microsecond,
+        and counts[i] those that took from 2^(i - 1) up to 2^i microseconds.
+    */
+    struct TouchLatencyHistogram
+    {
+        static constexpr int numBuckets = 24;
+        juce::uint32 counts[numBuckets] = {};
+
+        /** Returns the number of touches counted. */
+        juce::uint32 getTotal() const noexcept;
+
+        /** Returns an upper bound on the latency of the given percentage (0 to 100) of touches. */
+        double getPercentileMicroseconds (double percentile) const noexcept;
+    };
+
+    enum class TouchDeliveryPath
+    {
+        realtime,       /**< Touches passed to RealtimeTouchListeners. */
+        messageThread   /**< Touches passed to TouchSurface::Listeners. */
+    };
+
+    /** Returns the latencies recorded for one of the delivery paths. Touches are
+        only delivered on the real-time path while a RealtimeTouchListener is registered.
+    */
+    TouchLatencyHistogram getTouchLatencyHistogram (TouchDeliveryPath) const;
+
+    /** Clears the latency histograms of both delivery paths. */
+    void resetTouchLatencyHistograms();
+
+    //==============================================================================
+    /** Sets how many times per second blocks are ticked. A tick renders the block's
+        LEDGrid::Renderer and sends any changes to its heap.
+
+        By default the rate is shared between all the connected blocks, which are
+        ticked in turn, so the default rate of 30 ticks each of 3 blocks 10 times a
+        second. If ratePerBlock is true, every block is ticked at this rate however
+        many are connected, so the heap traffic grows with the number of blocks.
+    */
+    void setBlockTickRate (double ticksPerSecond, bool ratePerBlock = false);
+
+    /** Returns the number of times per second that blocks are ticked. */
+    double getBlockTickRate() const noexcept;
+
+    /** Returns true if the block tick rate applies to each block separately. */
+    bool isBlockTickRatePerBlock() const noexcept;
+
+    /** Renders the LEDGrids of different blocks at the same time, using a pool of
+        background threads, while the message thread waits for them to finish. Only
+        use this if each block has its own renderer and they don't use the message
+        thread: a renderer that takes a MessageManagerLock will deadlock. Pass 0 to
+        render them all on the message thread, which is the default. This only makes
+        a difference when the tick rate is per block.
+    */
+    void setNumLEDRenderThreads (int numThreads);
+
+    /** Limits the rate at which program and heap data is sent over each device
+        connection, so that it's shared between the blocks on that connection in
+        proportion to their Block::bandwidthWeight. Commands and pings are never held
+        back, but they count towards the limit.
+
+        Bluetooth links are much slower than USB ones, so they have a separate limit.
+        A limit of 0 means no limit, which is the default for both. The limits are
+        shared by every PhysicalTopologySource that uses the same device detector.
+    */
+    void setBandwidthLimit (int usbBytesPerSecond, int bluetoothBytesPerSecond);
+
 protected:
     virtual bool hasOwnServiceTimer() const;
     virtual void handleTimerTick();
@@ -89,6 +233,11 @@ private:
     friend struct Detector;
     struct DetectorHolder;
     std::unique_ptr<DetectorHolder> detector;
+    juce::Array<RealtimeTouchListener*> realtimeTouchListeners;
+    double blockTickRate = 30.0;
+    bool blockTickRatePerBlock = false;
+    int numLEDRenderThreads = 0;
+    int usbBandwidthLimit = 0, bluetoothBandwidthLimit = 0;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PhysicalTopologySource)
 };
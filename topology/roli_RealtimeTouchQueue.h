@@ -0,0 +1,133 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    A RealtimeTouchListener that stores the touches it receives in a fixed-size
+    queue, so that another thread can collect them without locking.
+
+    This is the simplest way to get touches into an audio callback, e.g.
+    @code
+    RealtimeTouchQueue touchQueue;
+    topologySource.addRealtimeTouchListener (&touchQueue);
+
+    // then in the audio callback..
+    touchQueue.popTouches ([this] (const TouchSurface::Touch& touch) { handleTouch (touch); });
+    @endcode
+
+    Touches may be pushed from several threads at once. Each writer reserves a slot
+    with a compare-and-swap and then publishes the touch in it, so writers never wait
+    for each other to finish, and popping is wait-free. If a writer is interrupted
+    between reserving and publishing, popping stops at its slot until it's done. If
+    the queue fills up, new touches are dropped and counted.
+
+    @tags{Blocks}
+*/
+class RealtimeTouchQueue  : public PhysicalTopologySource::RealtimeTouchListener
+{
+public:
+    /** Creates a queue that can hold at least the given number of touches. */
+    RealtimeTouchQueue (int capacity = 256)
+        : numSlots ((size_t) juce::nextPowerOfTwo (juce::jmax (2, capacity))),
+          slots (new Slot[numSlots])
+    {
+        for (size_t i = 0; i < numSlots; ++i)
+            slots[i].sequence.store (i, std::memory_order_relaxed);
+    }
+
+    /** Adds a touch to the queue. */
+    void touchChanged (const TouchSurface::Touch& touch) override
+    {
+        auto position = writePosition.load (std::memory_order_relaxed);
+
+        for (;;)
+        {
+            auto& slot = slots[position & (numSlots - 1)];
+            auto sequence = slot.sequence.load (std::memory_order_acquire);
+
+            // A slot is free for position when its sequence number equals it, and it
+            // still holds the touch from one lap earlier when it's lower.
+            if (sequence == position)
+            {
+                if (writePosition.compare_exchange_weak (position, position + 1, std::memory_order_relaxed))
+                {
+                    slot.touch = touch;
+                    slot.sequence.store (position + 1, std::memory_order_release);
+                    return;
+                }
+            }
+            else if ((std::ptrdiff_t) (sequence - position) < 0)
+            {
+                ++numTouchesDropped;
+                return;
+            }
+            else
+            {
+                position = writePosition.load (std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** Calls the callback for each touch in the queue, in the order they arrived,
+        and removes them. This must only be called from one thread at a time.
+        Returns the number of touches that were removed.
+    */
+    template <typename Callback>
+    int popTouches (Callback&& callback)
+    {
+        int numPopped = 0;
+
+        for (;;)
+        {
+            auto& slot = slots[readPosition & (numSlots - 1)];
+
+            if (slot.sequence.load (std::memory_order_acquire) != readPosition + 1)
+                return numPopped;
+
+            callback (static_cast<const TouchSurface::Touch&> (slot.touch));
+
+            slot.sequence.store (readPosition + numSlots, std::memory_order_release);
+            ++readPosition;
+            ++numPopped;
+        }
+    }
+
+    /** Returns the number of touches that have been dropped because the queue was full. */
+    int getNumTouchesDropped() const noexcept      { return numTouchesDropped.load(); }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        TouchSurface::Touch touch;
+    };
+
+    const size_t numSlots;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> writePosition { 0 };
+    size_t readPosition = 0;
+    std::atomic<int> numTouchesDropped { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RealtimeTouchQueue)
+};
+
+} // namespace roli
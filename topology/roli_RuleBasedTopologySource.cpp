@@ -22,7 +22,7 @@ namespace roli
 {
 
 struct RuleBasedTopologySource::Internal  : public TopologySource::Listener,
-                                            private juce::AsyncUpdater
+                                            private EventLoopAsyncUpdater
 {
     Internal (RuleBasedTopologySource& da, TopologySource& bd)  : owner (da), detector (bd)
     {
@@ -0,0 +1,1120 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/**
+    A packet sent by a simulated block, built in the same way as the packets that
+    the host sends, but with the direction bit set in its device index.
+
+    @tags{Blocks}
+*/
+struct SimulatedDevicePacket
+{
+    void begin (BlocksProtocol::TopologyIndex deviceIndex, juce::uint32 timestamp) noexcept
+    {
+        data.reset();
+        data.writeHeaderSysexBytes ((juce::uint8) (deviceIndex | 0x40));
+        data << BlocksProtocol::PacketTimestamp (timestamp);
+    }
+
+    bool hasCapacity (int bitsNeeded) const noexcept    { return data.hasCapacity (bitsNeeded); }
+
+    template <int numBits>
+    SimulatedDevicePacket& operator<< (BlocksProtocol::IntegerWithBitSize<numBits> value) noexcept
+    {
+        data << value;
+        return *this;
+    }
+
+    SimulatedDevicePacket& operator<< (BlocksProtocol::MessageFromDevice type) noexcept
+    {
+        return *this << BlocksProtocol::MessageType ((juce::uint32) type);
+    }
+
+    /** Finishes the packet, and returns it in the form passed to DeviceConnection::handleMessageFromDevice. */
+    const juce::uint8* finish (size_t& size) noexcept
+    {
+        data.writePacketSysexFooter();
+
+        constexpr auto headerSize = sizeof (BlocksProtocol::roliSysexHeader);
+        size = (size_t) data.size() - headerSize - 1;
+        return static_cast<const juce::uint8*> (data.getData()) + headerSize;
+    }
+
+private:
+    BlocksProtocol::Packed7BitArrayBuilder<256> data;
+};
+
+//==============================================================================
+struct SimulatedDeviceDetector::Internal  : private juce::Thread
+{
+    Internal (const Settings& s)
+        : juce::Thread ("Blocks simulator"), settings (s), random (s.randomSeed)
+    {
+        jassert (settings.blockTypes.size() <= maxBlocksPerConnection);
+
+        settings.eventsPerTouch = juce::jmax (2, settings.eventsPerTouch);
+        settings.numSimultaneousTouches = juce::jlimit (1, maxSimultaneousTouches, settings.numSimultaneousTouches);
+
+        for (int i = 0; i < settings.numConnections; ++i)
+            groups.add (new SimulatedGroup (*this, i));
+
+        startMs = juce::Time::getMillisecondCounter();
+        startTicks = juce::Time::getHighResolutionTicks();
+        startThread();
+    }
+
+    ~Internal() override
+    {
+        stopThread (2000);
+
+        const juce::ScopedLock sl (lock);
+
+        for (auto* group : groups)
+            if (auto* connection = group->connection.load())
+                connection->owner = nullptr;
+    }
+
+    //==============================================================================
+    struct SimulatedGroup;
+
+    struct SimulatedConnection  : public PhysicalTopologySource::DeviceConnection
+    {
+        SimulatedConnection (Internal& o, SimulatedGroup& g)  : owner (&o), group (g) {}
+
+        ~SimulatedConnection() override
+        {
+            if (owner != nullptr)
+                owner->connectionDeleted (group);
+        }
+
+        bool sendMessageToDevice (const void* data, size_t dataSize) override
+        {
+            if (owner == nullptr)
+                return false;
+
+            // By now whoever opened the connection has set handleMessageFromDevice
+            isReady = true;
+            return owner->queuePacketFromHost (group, data, dataSize);
+        }
+
+        Internal* owner;
+        SimulatedGroup& group;
+        std::atomic<bool> isReady { false };
+    };
+
+    //==============================================================================
+    using ProgramRunner = littlefoot::Runner<BlocksProtocol::padBlockProgramAndHeapSize, BlocksProtocol::padBlockStackSize>;
+
+    static constexpr int maxSimultaneousTouches = 1 << BlocksProtocol::TouchIndex::bits;
+
+    struct SimulatedBlock
+    {
+        SimulatedBlock (const Settings& settings, Block::Type type, int groupIndex, int blockIndex)
+            : index ((BlocksProtocol::TopologyIndex) blockIndex)
+        {
+            auto serialText = juce::String (getSerialPrefix (type)) + "SIM"
+                                + juce::String (groupIndex * maxBlocksPerConnection + blockIndex).paddedLeft ('0', 10);
+
+            for (size_t i = 0; i < BlocksProtocol::BlockSerialNumber::maxLength; ++i)
+                serial.data[i] = (juce::uint8) serialText[(int) i];
+
+            serial.length = (juce::uint8) BlocksProtocol::BlockSerialNumber::maxLength;
+
+            BlocksProtocol::BlockDataSheet dataSheet (serial);
+
+            setString (name, juce::String ("Simulated ") + dataSheet.description);
+            setString (version, "1.0.0");
+
+            heapSize = (int) dataSheet.programAndHeapSize;
+            heap.calloc ((size_t) heapSize);
+
+            hasTouchSurface = dataSheet.hasTouchSurface;
+            numButtons = dataSheet.buttons.size();
+            eastPort = findPort (dataSheet, Block::ConnectionPort::DeviceEdge::east);
+            westPort = findPort (dataSheet, Block::ConnectionPort::DeviceEdge::west);
+
+            if (settings.runPrograms)
+            {
+                runner = std::make_unique<ProgramRunner>();
+                runner->setNativeFunctions (getNativeFunctions().begin(), getNativeFunctions().size(), nullptr);
+            }
+        }
+
+        void setHeapByte (int offset, juce::uint8 value) noexcept
+        {
+            if (offset < heapSize)
+            {
+                heap[offset] = value;
+
+                if (runner != nullptr)
+                    runner->setDataByte ((littlefoot::uint32) offset, value);
+            }
+        }
+
+        void clearHeap() noexcept
+        {
+            for (int i = 0; i < heapSize; ++i)
+                setHeapByte (i, 0);
+        }
+
+        void endTouches() noexcept
+        {
+            for (auto& touch : touches)
+                touch.isActive = false;
+
+            buttonDown = -1;
+        }
+
+        BlocksProtocol::TopologyIndex index;
+        BlocksProtocol::BlockSerialNumber serial;
+        BlocksProtocol::BlockName name;
+        BlocksProtocol::VersionNumber version;
+        int heapSize = 0, numButtons = 0, eastPort = 0, westPort = 0;
+        bool hasTouchSurface = false;
+
+        bool isInAPIMode = false;
+        juce::uint32 lastPacketIndex = 0;
+        juce::HeapBlock<juce::uint8> heap;
+        juce::int32 configValues[BlocksProtocol::maxConfigId + 1] = {};
+
+        std::unique_ptr<ProgramRunner> runner;
+        bool isProgramRunning = false, heapHasChanged = false;
+        double repaintsDue = 0.0;
+
+        struct TouchState
+        {
+            bool isActive = false;
+            int eventsLeft = 0;
+            float x = 0, y = 0, z = 0;
+        };
+
+        TouchState touches[maxSimultaneousTouches];
+        int nextTouch = 0, buttonDown = -1;
+        double touchEventsDue = 0.0, buttonEventsDue = 0.0;
+
+    private:
+        static const char* getSerialPrefix (Block::Type type) noexcept
+        {
+            switch (type)
+            {
+                case Block::Type::lightPadBlock:            return "LPB";
+                case Block::Type::liveBlock:                return "LIC";
+                case Block::Type::loopBlock:                return "LOC";
+                case Block::Type::developerControlBlock:    return "DCB";
+                case Block::Type::touchBlock:               return "TCB";
+                case Block::Type::seaboardBlock:            return "SBB";
+                case Block::Type::lumiKeysBlock:            return "LKB";
+                case Block::Type::unknown:
+                default:                                    break;
+            }
+
+            jassertfalse; // only the known types of block can be simulated
+            return "LPB";
+        }
+
+        template <size_t maxSize>
+        static void setString (BlocksProtocol::BlockStringData<maxSize>& dest, const juce::String& text) noexcept
+        {
+            dest.length = (juce::uint8) juce::jmin ((int) maxSize - 1, (int) text.getNumBytesAsUTF8());
+            memcpy (dest.data, text.toRawUTF8(), dest.length);
+        }
+
+        static int findPort (const BlocksProtocol::BlockDataSheet& dataSheet, Block::ConnectionPort::DeviceEdge edge) noexcept
+        {
+            for (int i = 0; i < dataSheet.ports.size(); ++i)
+                if (dataSheet.ports[i].edge == edge)
+                    return i;
+
+            jassertfalse;
+            return 0;
+        }
+
+        static littlefoot::int32 doNothing (void*, const littlefoot::int32*) noexcept  { return 0; }
+
+        static const juce::Array<littlefoot::NativeFunction>& getNativeFunctions()
+        {
+            static const juce::Array<littlefoot::NativeFunction> functions = []
+            {
+                juce::Array<littlefoot::NativeFunction> result;
+
+                for (auto f = PhysicalTopologySource::getStandardLittleFootFunctions(); *f != nullptr; ++f)
+                    result.add (littlefoot::NativeFunction (*f, doNothing));
+
+                return result;
+            }();
+
+            return functions;
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (SimulatedBlock)
+    };
+
+    //==============================================================================
+    struct SimulatedGroup
+    {
+        SimulatedGroup (Internal& o, int groupIndex)
+            : owner (o), name ("Simulated BLOCKS " + juce::String (groupIndex + 1))
+        {
+            for (int i = 0; i < owner.settings.blockTypes.size(); ++i)
+                blocks.add (new SimulatedBlock (owner.settings, owner.settings.blockTypes.getUnchecked (i), groupIndex, i));
+        }
+
+        Internal& owner;
+        const juce::String name;
+        juce::OwnedArray<SimulatedBlock> blocks;
+
+        std::atomic<SimulatedConnection*> connection { nullptr };
+        std::atomic<bool> wasReconnected { false };
+
+        juce::SpinLock packetsFromHostLock;
+        PacketFifo packetsFromHost;
+
+        SimulatedDevicePacket packet;
+
+        JUCE_DECLARE_NON_COPYABLE (SimulatedGroup)
+    };
+
+    //==============================================================================
+    juce::StringArray scanForDevices()
+    {
+        lastScannedDevices.clear();
+
+        for (auto* group : groups)
+            lastScannedDevices.add (group->name);
+
+        return lastScannedDevices;
+    }
+
+    PhysicalTopologySource::DeviceConnection* openDevice (int index)
+    {
+        const juce::ScopedLock sl (lock);
+
+        for (auto* group : groups)
+        {
+            if (group->connection == nullptr && group->name == lastScannedDevices[index])
+            {
+                group->wasReconnected = true;
+                group->connection = new SimulatedConnection (*this, *group);
+                return group->connection;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void connectionDeleted (SimulatedGroup& group)
+    {
+        const juce::ScopedLock sl (lock);
+        group.connection = nullptr;
+    }
+
+    bool queuePacketFromHost (SimulatedGroup& group, const void* data, size_t dataSize)
+    {
+        {
+            const juce::SpinLock::ScopedLockType sl (group.packetsFromHostLock);
+
+            if (! group.packetsFromHost.push (data, dataSize))
+                return false;
+        }
+
+        ++numPacketsToDevices;
+        numBytesToDevices += (juce::int64) dataSize;
+        notify();
+        return true;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.numBlocksInAPIMode = numBlocksInAPIMode;
+        stats.numPacketsFromDevices = numPacketsFromDevices;
+        stats.numBytesFromDevices = numBytesFromDevices;
+        stats.numPacketsToDevices = numPacketsToDevices;
+        stats.numBytesToDevices = numBytesToDevices;
+        stats.numTouchEventsSent = numTouchEventsSent;
+        stats.numButtonEventsSent = numButtonEventsSent;
+        stats.numHeapPacketsReceived = numHeapPacketsReceived;
+        stats.numProgramsStarted = numProgramsStarted;
+        stats.numProgramErrors = numProgramErrors;
+        stats.elapsedSeconds = juce::Time::highResolutionTicksToSeconds (juce::Time::getHighResolutionTicks() - startTicks);
+        return stats;
+    }
+
+    void resetStats()
+    {
+        numPacketsFromDevices = 0;
+        numBytesFromDevices = 0;
+        numPacketsToDevices = 0;
+        numBytesToDevices = 0;
+        numTouchEventsSent = 0;
+        numButtonEventsSent = 0;
+        numHeapPacketsReceived = 0;
+        numProgramsStarted = 0;
+        numProgramErrors = 0;
+        startTicks = juce::Time::getHighResolutionTicks();
+    }
+
+    //==============================================================================
+    Settings settings;
+    juce::StringArray lastScannedDevices;
+
+    std::atomic<int> numBlocksInAPIMode { 0 }, numPacketsFromDevices { 0 }, numPacketsToDevices { 0 };
+    std::atomic<juce::int64> numBytesFromDevices { 0 }, numBytesToDevices { 0 };
+    std::atomic<int> numTouchEventsSent { 0 }, numButtonEventsSent { 0 }, numHeapPacketsReceived { 0 };
+    std::atomic<int> numProgramsStarted { 0 }, numProgramErrors { 0 };
+    std::atomic<juce::int64> startTicks { 0 };
+
+private:
+    juce::CriticalSection lock;
+    juce::OwnedArray<SimulatedGroup> groups;
+    juce::Random random;
+    juce::uint32 startMs = 0;
+
+    static constexpr int tickIntervalMs = 1;
+    static constexpr juce::uint32 maxMillisecondsPerProgramCall = 20;
+    static constexpr float maxTouchMovement = 0.02f;
+
+    juce::uint32 getDeviceTime() const noexcept
+    {
+        return juce::Time::getMillisecondCounter() - startMs;
+    }
+
+    void run() override
+    {
+        auto lastTime = juce::Time::getMillisecondCounterHiRes();
+
+        while (! threadShouldExit())
+        {
+            auto now = juce::Time::getMillisecondCounterHiRes();
+            auto elapsedSeconds = (now - lastTime) / 1000.0;
+            lastTime = now;
+
+            for (auto* group : groups)
+            {
+                if (group->wasReconnected.exchange (false))
+                    unplug (*group);
+
+                group->packetsFromHost.popAll ([this, group] (const juce::uint8* data, int size, juce::int64)
+                {
+                    processPacketFromHost (*group, data, size);
+                });
+
+                if (group->connection != nullptr)
+                    sendEvents (*group, elapsedSeconds);
+
+                if (settings.runPrograms)
+                    runPrograms (*group, elapsedSeconds);
+            }
+
+            wait (tickIntervalMs);
+        }
+    }
+
+    /** Puts the blocks of a group back into the state they'd be in after being plugged in. */
+    void unplug (SimulatedGroup& group)
+    {
+        for (auto* block : group.blocks)
+        {
+            setAPIMode (*block, false);
+            block->endTouches();
+        }
+    }
+
+    void setAPIMode (SimulatedBlock& block, bool shouldBeInAPIMode)
+    {
+        if (block.isInAPIMode != shouldBeInAPIMode)
+        {
+            block.isInAPIMode = shouldBeInAPIMode;
+            numBlocksInAPIMode += shouldBeInAPIMode ? 1 : -1;
+        }
+    }
+
+    //==============================================================================
+    void beginPacket (SimulatedGroup& group, const SimulatedBlock& block)
+    {
+        group.packet.begin (block.index, getDeviceTime());
+    }
+
+    void sendPacket (SimulatedGroup& group)
+    {
+        size_t size;
+        auto* data = group.packet.finish (size);
+
+        const juce::ScopedLock sl (lock);
+
+        if (auto* connection = group.connection.load())
+        {
+            if (connection->isReady && connection->handleMessageFromDevice != nullptr)
+            {
+                connection->handleMessageFromDevice (data, size);
+                ++numPacketsFromDevices;
+                numBytesFromDevices += (juce::int64) size;
+            }
+        }
+    }
+
+    /** Makes sure that there's room for a message in the packet being built, sending it and starting another if not. */
+    void ensureCapacity (SimulatedGroup& group, const SimulatedBlock& block, int bitsNeeded)
+    {
+        if (! group.packet.hasCapacity (bitsNeeded))
+        {
+            sendPacket (group);
+            beginPacket (group, block);
+        }
+    }
+
+    void sendACK (SimulatedGroup& group, SimulatedBlock& block)
+    {
+        beginPacket (group, block);
+        group.packet << BlocksProtocol::MessageFromDevice::packetACK
+                     << BlocksProtocol::PacketCounter (block.lastPacketIndex);
+        sendPacket (group);
+    }
+
+    template <size_t maxSize>
+    static void writeString (SimulatedDevicePacket& packet, BlocksProtocol::MessageFromDevice type,
+                             const SimulatedBlock& block, const BlocksProtocol::BlockStringData<maxSize>& text)
+    {
+        packet << type
+               << BlocksProtocol::IntegerWithBitSize<BlocksProtocol::topologyIndexBits> (block.index)
+               << BlocksProtocol::IntegerWithBitSize<7> (text.length);
+
+        for (int i = 0; i < text.length; ++i)
+            packet << BlocksProtocol::IntegerWithBitSize<7> (text.data[i] & 0x7fu);
+    }
+
+    void sendVersionAndName (SimulatedGroup& group, SimulatedBlock& block)
+    {
+        beginPacket (group, block);
+        writeString (group.packet, BlocksProtocol::MessageFromDevice::deviceVersion, block, block.version);
+        writeString (group.packet, BlocksProtocol::MessageFromDevice::deviceName, block, block.name);
+        sendPacket (group);
+    }
+
+    void sendTopology (SimulatedGroup& group)
+    {
+        using namespace BlocksProtocol;
+
+        auto& blocks = group.blocks;
+        auto numDevices = blocks.size();
+        auto numConnections = juce::jmax (0, numDevices - 1);
+        auto numPackets = juce::jmax (1, (numDevices + maxBlocksInTopologyPacket - 1) / maxBlocksInTopologyPacket,
+                                      (numConnections + maxConnectionsInTopologyPacket - 1) / maxConnectionsInTopologyPacket);
+        bool lastPacketWasFull = false;
+
+        // The host waits for more of the topology after any packet that's full
+        for (int i = 0; i < numPackets; ++i)
+        {
+            auto firstDevice = i * maxBlocksInTopologyPacket;
+            auto firstConnection = i * maxConnectionsInTopologyPacket;
+            auto devicesInPacket = juce::jlimit (0, (int) maxBlocksInTopologyPacket, numDevices - firstDevice);
+            auto connectionsInPacket = juce::jlimit (0, (int) maxConnectionsInTopologyPacket, numConnections - firstConnection);
+
+            group.packet.begin (0, getDeviceTime());
+            group.packet << (i == 0 ? MessageFromDevice::deviceTopology : MessageFromDevice::deviceTopologyExtend)
+                         << ProtocolVersion (currentProtocolVersion)
+                         << DeviceCount ((juce::uint32) devicesInPacket)
+                         << ConnectionCount ((juce::uint32) connectionsInPacket);
+
+            for (int d = firstDevice; d < firstDevice + devicesInPacket; ++d)
+            {
+                auto& block = *blocks.getUnchecked (d);
+
+                for (size_t c = 0; c < BlockSerialNumber::maxLength; ++c)
+                    group.packet << IntegerWithBitSize<7> (block.serial.data[c]);
+
+                group.packet << IntegerWithBitSize<topologyIndexBits> (block.index)
+                             << BatteryLevel (BatteryLevel::maxValue)
+                             << BatteryCharging (0);
+            }
+
+            for (int c = firstConnection; c < firstConnection + connectionsInPacket; ++c)
+            {
+                auto& west = *blocks.getUnchecked (c);
+                auto& east = *blocks.getUnchecked (c + 1);
+
+                group.packet << IntegerWithBitSize<topologyIndexBits> (west.index)
+                             << ConnectorPort ((juce::uint32) west.eastPort)
+                             << IntegerWithBitSize<topologyIndexBits> (east.index)
+                             << ConnectorPort ((juce::uint32) east.westPort);
+            }
+
+            sendPacket (group);
+
+            lastPacketWasFull = devicesInPacket == maxBlocksInTopologyPacket
+                                 || connectionsInPacket == maxConnectionsInTopologyPacket;
+        }
+
+        if (lastPacketWasFull)
+        {
+            group.packet.begin (0, getDeviceTime());
+            group.packet << MessageFromDevice::deviceTopologyEnd << ProtocolVersion (currentProtocolVersion);
+            sendPacket (group);
+        }
+    }
+
+    //==============================================================================
+    void processPacketFromHost (SimulatedGroup& group, const juce::uint8* data, int size)
+    {
+        constexpr auto headerSize = (int) sizeof (BlocksProtocol::roliSysexHeader);
+
+        if (size < headerSize + 3 || data[size - 1] != 0xf7
+             || memcmp (data, BlocksProtocol::roliSysexHeader, (size_t) headerSize) != 0)
+            return;
+
+        auto deviceIndex = (BlocksProtocol::TopologyIndex) (data[headerSize] & 63);
+        auto* packetData = data + headerSize + 1;
+        auto packetSize = (juce::uint32) (size - headerSize - 2);
+
+        if (! BlocksProtocol::Packed7BitArrayReader::checksumIsOK (packetData, packetSize))
+            return;
+
+        BlocksProtocol::Packed7BitArrayReader reader (packetData, (int) packetSize - 1);
+
+        while (reader.getRemainingBits() >= BlocksProtocol::MessageType::bits)
+        {
+            auto type = reader.read<BlocksProtocol::MessageType>().get();
+
+            if (type == 0 || ! handleMessageFromHost (group, reader, (BlocksProtocol::MessageFromHost) type, deviceIndex))
+                break;
+        }
+    }
+
+    /** Calls a function for each block that a message to a topology index is for. */
+    template <typename Function>
+    static void forEachTarget (SimulatedGroup& group, BlocksProtocol::TopologyIndex deviceIndex, Function&& function)
+    {
+        for (auto* block : group.blocks)
+            if (deviceIndex == BlocksProtocol::topologyIndexForBroadcast || block->index == deviceIndex)
+                function (*block);
+    }
+
+    bool handleMessageFromHost (SimulatedGroup& group, BlocksProtocol::Packed7BitArrayReader& reader,
+                                BlocksProtocol::MessageFromHost type, BlocksProtocol::TopologyIndex deviceIndex)
+    {
+        using namespace BlocksProtocol;
+
+        switch (type)
+        {
+            case MessageFromHost::deviceCommandMessage:
+            {
+                if (reader.getRemainingBits() < DeviceCommand::bits)
+                    return false;
+
+                auto command = reader.read<DeviceCommand>().get();
+
+                if (command == requestTopologyMessage)
+                    sendTopology (group);
+                else
+                    forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b) { handleCommand (group, b, command); });
+
+                return true;
+            }
+
+            case MessageFromHost::sharedDataChange:
+                return handleDataChanges (group, reader, deviceIndex);
+
+            case MessageFromHost::programEventMessage:
+                return skipBits (reader, 32 * (int) numProgramMessageInts);
+
+            case MessageFromHost::firmwareUpdatePacket:
+                return reader.getRemainingBits() >= FirmwareUpdatePacketSize::bits
+                        && skipBits (reader, 7 * (int) reader.read<FirmwareUpdatePacketSize>().get());
+
+            case MessageFromHost::configMessage:
+                return handleConfigMessage (group, reader, deviceIndex);
+
+            case MessageFromHost::factoryReset:
+            case MessageFromHost::blockReset:
+                forEachTarget (group, deviceIndex, [] (SimulatedBlock& b) { b.clearHeap(); });
+                return true;
+
+            case MessageFromHost::setName:
+                return handleSetName (group, reader, deviceIndex);
+
+            default:
+                return false;
+        }
+    }
+
+    static bool skipBits (BlocksProtocol::Packed7BitArrayReader& reader, int numBits)
+    {
+        if (reader.getRemainingBits() < numBits)
+            return false;
+
+        for (; numBits > 0; numBits -= 32)
+            reader.readBits (juce::jmin (32, numBits));
+
+        return true;
+    }
+
+    void handleCommand (SimulatedGroup& group, SimulatedBlock& block, juce::uint32 command)
+    {
+        switch (command)
+        {
+            case BlocksProtocol::beginAPIMode:
+                setAPIMode (block, true);
+                sendVersionAndName (group, block);
+                sendACK (group, block);
+                break;
+
+            case BlocksProtocol::endAPIMode:
+                setAPIMode (block, false);
+                block.endTouches();
+                break;
+
+            case BlocksProtocol::ping:
+                if (block.isInAPIMode)
+                    sendACK (group, block);
+
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    bool handleDataChanges (SimulatedGroup& group, BlocksProtocol::Packed7BitArrayReader& reader,
+                            BlocksProtocol::TopologyIndex deviceIndex)
+    {
+        auto start = reader;
+        juce::uint32 packetIndex = 0;
+
+        if (! readDataChanges (reader, nullptr, packetIndex))
+            return false;
+
+        // Broadcast changes are applied to each block in turn, and each one acknowledges them
+        forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b)
+        {
+            if (b.isInAPIMode)
+            {
+                auto changes = start;
+                readDataChanges (changes, &b, packetIndex);
+                b.heapHasChanged = true;
+
+                b.lastPacketIndex = packetIndex & BlocksProtocol::PacketCounter::maxValue;
+                ++numHeapPacketsReceived;
+                sendACK (group, b);
+            }
+        });
+
+        return true;
+    }
+
+    /** Reads the changes in a sharedDataChange message, and makes them to a block's heap if one is given. */
+    static bool readDataChanges (BlocksProtocol::Packed7BitArrayReader& reader, SimulatedBlock* block, juce::uint32& packetIndex)
+    {
+        using namespace BlocksProtocol;
+
+        if (reader.getRemainingBits() < PacketIndex::bits)
+            return false;
+
+        packetIndex = reader.read<PacketIndex>().get();
+
+        int position = 0;
+        juce::uint8 lastValue = 0;
+
+        auto setBytes = [&] (int num, juce::uint8 value)
+        {
+            for (int i = 0; i < num; ++i, ++position)
+                if (block != nullptr)
+                    block->setHeapByte (position, value);
+
+            lastValue = value;
+        };
+
+        for (;;)
+        {
+            if (reader.getRemainingBits() < DataChangeCommand::bits)
+                return false;
+
+            switch (reader.read<DataChangeCommand>().get())
+            {
+                case endOfPacket:
+                case endOfChanges:
+                    return true;
+
+                case skipBytesFew:
+                    if (reader.getRemainingBits() < ByteCountFew::bits)
+                        return false;
+
+                    position += (int) reader.read<ByteCountFew>().get();
+                    break;
+
+                case skipBytesMany:
+                    if (reader.getRemainingBits() < ByteCountMany::bits)
+                        return false;
+
+                    position += (int) reader.read<ByteCountMany>().get();
+                    break;
+
+                case setSequenceOfBytes:
+                    for (;;)
+                    {
+                        if (reader.getRemainingBits() < ByteValue::bits + ByteSequenceContinues::bits)
+                            return false;
+
+                        setBytes (1, (juce::uint8) reader.read<ByteValue>().get());
+
+                        if (reader.read<ByteSequenceContinues>().get() == 0)
+                            break;
+                    }
+
+                    break;
+
+                case setFewBytesWithValue:
+                    if (reader.getRemainingBits() < ByteCountFew::bits + ByteValue::bits)
+                        return false;
+
+                    {
+                        auto num = (int) reader.read<ByteCountFew>().get();
+                        setBytes (num, (juce::uint8) reader.read<ByteValue>().get());
+                    }
+
+                    break;
+
+                case setFewBytesWithLastValue:
+                    if (reader.getRemainingBits() < ByteCountFew::bits)
+                        return false;
+
+                    setBytes ((int) reader.read<ByteCountFew>().get(), lastValue);
+                    break;
+
+                case setManyBytesWithValue:
+                    if (reader.getRemainingBits() < ByteCountMany::bits + ByteValue::bits)
+                        return false;
+
+                    {
+                        auto num = (int) reader.read<ByteCountMany>().get();
+                        setBytes (num, (juce::uint8) reader.read<ByteValue>().get());
+                    }
+
+                    break;
+
+                default:
+                    return false;
+            }
+        }
+    }
+
+    bool handleConfigMessage (SimulatedGroup& group, BlocksProtocol::Packed7BitArrayReader& reader,
+                              BlocksProtocol::TopologyIndex deviceIndex)
+    {
+        using namespace BlocksProtocol;
+
+        if (reader.getRemainingBits() < ConfigCommand::bits)
+            return false;
+
+        switch (reader.read<ConfigCommand>().get())
+        {
+            case setConfig:
+            {
+                if (reader.getRemainingBits() < ConfigItemIndex::bits + ConfigItemValue::bits)
+                    return false;
+
+                auto item = reader.read<ConfigItemIndex>().get();
+                auto value = (juce::int32) reader.read<ConfigItemValue>().get();
+
+                forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b) { b.configValues[item] = value; });
+                return true;
+            }
+
+            case requestConfig:
+            {
+                if (reader.getRemainingBits() < ConfigItemValue::bits + ConfigItemIndex::bits)
+                    return false;
+
+                reader.read<ConfigItemValue>();
+                auto item = reader.read<ConfigItemIndex>().get();
+
+                forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b)
+                {
+                    beginPacket (group, b);
+                    group.packet << MessageFromDevice::configMessage
+                                 << ConfigCommand (updateConfig)
+                                 << ConfigItemIndex (item)
+                                 << ConfigItemValue ((juce::uint32) b.configValues[item])
+                                 << ConfigItemValue (0)
+                                 << ConfigItemValue (127);
+                    sendPacket (group);
+                });
+
+                return true;
+            }
+
+            case requestFactorySync:
+                forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b)
+                {
+                    beginPacket (group, b);
+                    group.packet << MessageFromDevice::configMessage << ConfigCommand (factorySyncEnd);
+                    sendPacket (group);
+                });
+
+                return true;
+
+            case requestUserSync:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    bool handleSetName (SimulatedGroup& group, BlocksProtocol::Packed7BitArrayReader& reader,
+                        BlocksProtocol::TopologyIndex deviceIndex)
+    {
+        if (reader.getRemainingBits() < 7)
+            return false;
+
+        auto length = (int) reader.readBits (7);
+
+        if (reader.getRemainingBits() < 7 * (length + 1))
+            return false;
+
+        BlocksProtocol::BlockName name;
+
+        for (int i = 0; i < length; ++i)
+        {
+            auto c = (juce::uint8) reader.readBits (7);
+
+            if (i < (int) BlocksProtocol::BlockName::maxLength)
+                name.data[name.length++] = c;
+        }
+
+        reader.readBits (7);
+
+        forEachTarget (group, deviceIndex, [&] (SimulatedBlock& b)
+        {
+            b.name = name;
+            sendVersionAndName (group, b);
+        });
+
+        return true;
+    }
+
+    //==============================================================================
+    void sendEvents (SimulatedGroup& group, double elapsedSeconds)
+    {
+        using namespace BlocksProtocol;
+
+        const auto touchBits = settings.sendTouchVelocity ? (int) BitSizes::touchMessageWithVelocity
+                                                          : (int) BitSizes::touchMessage;
+
+        for (auto* block : group.blocks)
+        {
+            if (! block->isInAPIMode)
+                continue;
+
+            int numTouchEvents = 0, numButtonEvents = 0;
+
+            if (block->hasTouchSurface)
+            {
+                block->touchEventsDue += elapsedSeconds * settings.touchEventsPerSecond;
+                numTouchEvents = (int) block->touchEventsDue;
+                block->touchEventsDue -= numTouchEvents;
+            }
+
+            if (block->numButtons > 0)
+            {
+                block->buttonEventsDue += elapsedSeconds * settings.buttonEventsPerSecond;
+                numButtonEvents = (int) block->buttonEventsDue;
+                block->buttonEventsDue -= numButtonEvents;
+            }
+
+            if (numTouchEvents + numButtonEvents == 0)
+                continue;
+
+            // The events that are due are packed together, as a block does with the events of one scan
+            beginPacket (group, *block);
+
+            for (int i = 0; i < numTouchEvents; ++i)
+            {
+                ensureCapacity (group, *block, touchBits);
+                writeTouchEvent (group.packet, *block);
+            }
+
+            for (int i = 0; i < numButtonEvents; ++i)
+            {
+                ensureCapacity (group, *block, BitSizes::controlButtonMessage);
+                writeButtonEvent (group.packet, *block);
+            }
+
+            sendPacket (group);
+
+            numTouchEventsSent += numTouchEvents;
+            numButtonEventsSent += numButtonEvents;
+        }
+    }
+
+    void writeTouchEvent (SimulatedDevicePacket& packet, SimulatedBlock& block)
+    {
+        using namespace BlocksProtocol;
+
+        auto touchIndex = block.nextTouch;
+        auto& touch = block.touches[touchIndex];
+        block.nextTouch = (block.nextTouch + 1) % settings.numSimultaneousTouches;
+
+        auto dx = 0.0f, dy = 0.0f, dz = 0.0f;
+        bool isStart = false, isEnd = false;
+
+        if (! touch.isActive)
+        {
+            touch.isActive = true;
+            touch.eventsLeft = settings.eventsPerTouch - 1;
+            touch.x = random.nextFloat();
+            touch.y = random.nextFloat();
+            touch.z = 0.2f + 0.8f * random.nextFloat();
+            dz = touch.z;
+            isStart = true;
+        }
+        else if (--touch.eventsLeft <= 0)
+        {
+            touch.isActive = false;
+            dz = -touch.z;
+            isEnd = true;
+        }
+        else
+        {
+            dx = maxTouchMovement * (2.0f * random.nextFloat() - 1.0f);
+            dy = maxTouchMovement * (2.0f * random.nextFloat() - 1.0f);
+            touch.x = juce::jlimit (0.0f, 1.0f, touch.x + dx);
+            touch.y = juce::jlimit (0.0f, 1.0f, touch.y + dy);
+        }
+
+        if (settings.sendTouchVelocity)
+            packet << (isStart ? MessageFromDevice::touchStartWithVelocity
+                               : (isEnd ? MessageFromDevice::touchEndWithVelocity : MessageFromDevice::touchMoveWithVelocity));
+        else
+            packet << (isStart ? MessageFromDevice::touchStart
+                               : (isEnd ? MessageFromDevice::touchEnd : MessageFromDevice::touchMove));
+
+        packet << PacketTimestampOffset (0)
+               << TouchIndex ((juce::uint32) touchIndex)
+               << TouchPosition::Xcoord::fromUnipolarFloat (touch.x)
+               << TouchPosition::Ycoord::fromUnipolarFloat (touch.y)
+               << TouchPosition::Zcoord::fromUnipolarFloat (isEnd ? 0.0f : touch.z);
+
+        if (settings.sendTouchVelocity)
+            packet << TouchVelocity::VXcoord::fromBipolarFloat (dx / maxTouchMovement)
+                   << TouchVelocity::VYcoord::fromBipolarFloat (dy / maxTouchMovement)
+                   << TouchVelocity::VZcoord::fromBipolarFloat (dz);
+    }
+
+    void writeButtonEvent (SimulatedDevicePacket& packet, SimulatedBlock& block)
+    {
+        using namespace BlocksProtocol;
+
+        bool isDown = block.buttonDown < 0;
+
+        if (isDown)
+            block.buttonDown = random.nextInt (block.numButtons);
+
+        packet << (isDown ? MessageFromDevice::controlButtonDown : MessageFromDevice::controlButtonUp)
+               << PacketTimestampOffset (0)
+               << ControlButtonID ((juce::uint32) block.buttonDown);
+
+        if (! isDown)
+            block.buttonDown = -1;
+    }
+
+    //==============================================================================
+    void runPrograms (SimulatedGroup& group, double elapsedSeconds)
+    {
+        static const auto initialiseFunction = littlefoot::NativeFunction::createID ("initialise/v");
+        static const auto repaintFunction    = littlefoot::NativeFunction::createID ("repaint/v");
+
+        for (auto* block : group.blocks)
+        {
+            if (! block->isInAPIMode || block->runner == nullptr)
+                continue;
+
+            auto& runner = *block->runner;
+
+            // The runner forgets its memory layout whenever the program changes, and works
+            // it out again on the next call, once the whole program has arrived
+            if (! runner.isProgramValid())
+                block->isProgramRunning = false;
+
+            // Rather than checksumming the program on every tick, it's only looked for after a change
+            if (! block->isProgramRunning && block->heapHasChanged)
+            {
+                block->heapHasChanged = false;
+                callFunction (runner, initialiseFunction);
+
+                if (! runner.isProgramValid())
+                    continue;
+
+                block->isProgramRunning = true;
+                block->repaintsDue = 0.0;
+                ++numProgramsStarted;
+            }
+
+            block->repaintsDue += elapsedSeconds * settings.repaintsPerSecond;
+
+            if (block->repaintsDue >= 1.0)
+            {
+                block->repaintsDue = juce::jmin (1.0, block->repaintsDue - 1.0);
+                callFunction (runner, repaintFunction);
+            }
+        }
+    }
+
+    void callFunction (ProgramRunner& runner, littlefoot::FunctionID function)
+    {
+        ProgramRunner::FunctionExecutionContext context (runner, function);
+
+        if (! context.isValid())
+            return;
+
+        auto deadline = juce::Time::getMillisecondCounter() + maxMillisecondsPerProgramCall;
+        auto result = context.run ([deadline] { return juce::Time::getMillisecondCounter() > deadline; });
+
+        if (result != ProgramRunner::ErrorCode::ok)
+            ++numProgramErrors;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (Internal)
+};
+
+SimulatedDeviceDetector::SimulatedDeviceDetector (const Settings& settings)
+    : internal (std::make_unique<Internal> (settings))
+{
+}
+
+SimulatedDeviceDetector::~SimulatedDeviceDetector() = default;
+
+SimulatedDeviceDetector::Stats SimulatedDeviceDetector::getStats() const     { return internal->getStats(); }
+void SimulatedDeviceDetector::resetStats()                                   { internal->resetStats(); }
+
+juce::StringArray SimulatedDeviceDetector::scanForDevices()
+{
+    return internal->scanForDevices();
+}
+
+PhysicalTopologySource::DeviceConnection* SimulatedDeviceDetector::openDevice (int index)
+{
+    return internal->openDevice (index);
+}
+
+} // namespace roli
@@ -0,0 +1,137 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    A DeviceDetector whose devices are blocks simulated in the same process, so that
+    the topology code, the heap synchronisation and anything built on them can be
+    run and load-tested without any hardware.
+
+    Each simulated connection behaves like a USB connection to a master block, with
+    the rest of its blocks joined to it in a row. The blocks answer topology requests,
+    send their version and name when API mode begins, acknowledge pings and heap
+    packets, and keep a copy of their heaps. While in API mode they send touches and
+    button presses at the rates given in the Settings.
+
+    The blocks can also run the littlefoot programs that are uploaded to them, by
+    calling their initialise() and repaint() functions. The native functions that a
+    program calls don't do anything, so this checks that programs arrive intact and
+    costs the time that running them takes, but doesn't draw anything.
+
+    All the blocks are simulated on one background thread, which is also the thread
+    that their messages are passed to the host on. The detector must outlive any
+    PhysicalTopologySource that uses it.
+
+    @code
+    SimulatedDeviceDetector::Settings settings;
+    settings.numConnections = 2;
+    settings.blockTypes.clear();
+    settings.blockTypes.insertMultiple (0, Block::Type::lightPadBlock, 32);
+    settings.touchEventsPerSecond = 160.0;
+
+    SimulatedDeviceDetector simulator (settings);
+    PhysicalTopologySource source (simulator);
+    @endcode
+
+    @tags{Blocks}
+*/
+class SimulatedDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    /** The number of blocks that can be simulated on each connection. */
+    static constexpr int maxBlocksPerConnection = 63;
+
+    /** Describes the blocks to simulate and the events that they send. */
+    struct Settings
+    {
+        /** The number of connections, each of which has its own set of blocks. */
+        int numConnections = 1;
+
+        /** The types of the blocks on each connection. The first is the master block,
+            and each of the others is joined to the east of the one before it.
+        */
+        juce::Array<Block::Type> blockTypes { Block::Type::lightPadBlock };
+
+        /** The number of touch events that each block with a touch surface sends per second. */
+        double touchEventsPerSecond = 0.0;
+
+        /** The number of events in each touch, including its start and end. */
+        int eventsPerTouch = 16;
+
+        /** The number of touches that each block has in progress at once, up to 32. */
+        int numSimultaneousTouches = 1;
+
+        /** Whether the touch events include velocities. */
+        bool sendTouchVelocity = false;
+
+        /** The number of button presses and releases that each block with buttons sends per second. */
+        double buttonEventsPerSecond = 0.0;
+
+        /** Whether the blocks run the programs that are uploaded to them. */
+        bool runPrograms = false;
+
+        /** How many times per second a running program's repaint() function is called. */
+        double repaintsPerSecond = 25.0;
+
+        /** The seed for the positions of the touches and the choice of buttons, so that runs can be repeated. */
+        juce::int64 randomSeed = 1;
+    };
+
+    /** Creates the simulated blocks, which are then found by the next scan for devices. */
+    SimulatedDeviceDetector (const Settings&);
+
+    /** Destructor. */
+    ~SimulatedDeviceDetector() override;
+
+    /** Statistics for the simulation. */
+    struct Stats
+    {
+        int numBlocksInAPIMode = 0;
+        int numPacketsFromDevices = 0;
+        juce::int64 numBytesFromDevices = 0;
+        int numPacketsToDevices = 0;
+        juce::int64 numBytesToDevices = 0;
+        int numTouchEventsSent = 0;
+        int numButtonEventsSent = 0;
+        int numHeapPacketsReceived = 0;
+        int numProgramsStarted = 0;
+        int numProgramErrors = 0;
+        double elapsedSeconds = 0.0;
+    };
+
+    /** Returns the statistics since the simulation started or resetStats() was called. */
+    Stats getStats() const;
+
+    /** Clears the statistics, apart from the number of blocks in API mode. */
+    void resetStats();
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SimulatedDeviceDetector)
+};
+
+} // namespace roli
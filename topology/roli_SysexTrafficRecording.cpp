@@ -0,0 +1,647 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+//==============================================================================
+/*  Records are added on the MIDI threads and the message thread, so each of those
+    threads pushes them into its own lock-free queue, and a background thread moves
+    them from the queues into the file.
+*/
+struct RecordingDeviceDetector::Internal  : private juce::Thread
+{
+    Internal (PhysicalTopologySource::DeviceDetector& d, const juce::File& logFile)
+        : juce::Thread ("Blocks recorder"), detector (d)
+    {
+        logFile.deleteFile();
+        stream = std::make_unique<juce::FileOutputStream> (logFile);
+
+        if (stream->openedOk())
+        {
+            stream->writeInt ((int) SysexTrafficLog::magic);
+            stream->writeInt ((int) SysexTrafficLog::version);
+        }
+        else
+        {
+            stream.reset();
+        }
+
+        startTicks = juce::Time::getHighResolutionTicks();
+
+        if (stream != nullptr)
+            startThread();
+    }
+
+    ~Internal() override
+    {
+        midiConnectionTaps.clear();
+
+        stopThread (2000);
+        writeQueuedRecords();
+        stream.reset();
+    }
+
+    /** Adds a record to a queue, for the background thread to write. This never blocks,
+        but each queue must only be used by one thread at a time.
+    */
+    void addRecord (PacketFifo& queue, int connectionIndex, SysexTrafficLog::RecordType type, const void* data, size_t dataSize)
+    {
+        if (stream == nullptr)
+            return;
+
+        auto elapsed = juce::Time::highResolutionTicksToSeconds (juce::Time::getHighResolutionTicks() - startTicks);
+
+        juce::uint8 record[PacketFifo::maxPacketSize];
+
+        if (dataSize > sizeof (record) - recordPrefixSize)
+        {
+            ++numRecordsDropped;
+            return;
+        }
+
+        auto index = (juce::uint16) connectionIndex;
+        memcpy (record, &index, sizeof (index));
+        record[sizeof (index)] = (juce::uint8) type;
+
+        if (dataSize > 0)
+            memcpy (record + recordPrefixSize, data, dataSize);
+
+        if (! queue.push (record, recordPrefixSize + dataSize, (juce::int64) (elapsed * 1000000.0)))
+            ++numRecordsDropped;
+    }
+
+    /** Returns a queue for the records of a thread that receives messages from a device. */
+    PacketFifo& createIncomingQueue()
+    {
+        const juce::ScopedLock sl (incomingQueuesLock);
+        return *incomingQueues.add (new PacketFifo());
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            wait (writeIntervalMs);
+            writeQueuedRecords();
+        }
+    }
+
+    /*  The records from all the queues are written in time order, so a record can only
+        end up after a later one if it was still being added when the queues were read.
+    */
+    void writeQueuedRecords()
+    {
+        queuedRecords.clearQuick();
+        queuedRecordData.setSize (0);
+
+        auto addToBatch = [this] (const void* data, int size, juce::int64 time)
+        {
+            queuedRecords.add ({ time, (int) queuedRecordData.getSize(), size });
+            queuedRecordData.append (data, (size_t) size);
+        };
+
+        messageThreadQueue.popAll (addToBatch);
+
+        {
+            const juce::ScopedLock sl (incomingQueuesLock);
+
+            for (auto* queue : incomingQueues)
+                queue->popAll (addToBatch);
+        }
+
+        std::stable_sort (queuedRecords.begin(), queuedRecords.end(),
+                          [] (const QueuedRecord& a, const QueuedRecord& b) { return a.time < b.time; });
+
+        for (auto& r : queuedRecords)
+        {
+            auto* record = static_cast<const juce::uint8*> (queuedRecordData.getData()) + r.offset;
+            juce::uint16 connectionIndex;
+            memcpy (&connectionIndex, record, sizeof (connectionIndex));
+
+            stream->writeInt64 (r.time);
+            stream->writeInt (r.size - recordPrefixSize);
+            stream->writeShort ((short) connectionIndex);
+            stream->writeByte ((char) record[sizeof (connectionIndex)]);
+            stream->writeByte (0);
+            stream->write (record + recordPrefixSize, (size_t) (r.size - recordPrefixSize));
+        }
+
+        if (! queuedRecords.isEmpty())
+            stream->flush();
+    }
+
+    PhysicalTopologySource::DeviceConnection* openDevice (int index)
+    {
+        auto* connection = detector.openDevice (index);
+
+        if (connection == nullptr)
+            return nullptr;
+
+        auto connectionIndex = nextConnectionIndex++;
+        auto name = lastScannedDevices[index];
+        addRecord (messageThreadQueue, connectionIndex, SysexTrafficLog::RecordType::deviceOpened, name.toRawUTF8(), name.getNumBytesAsUTF8());
+
+        // MIDI connections are tapped rather than wrapped, because other parts of the
+        // topology code need to be able to treat them as MIDI connections
+        if (auto* midiConnection = dynamic_cast<MIDIDeviceConnection*> (connection))
+        {
+            midiConnectionTaps.add (new MIDIConnectionTap (*this, connectionIndex, *midiConnection));
+            return connection;
+        }
+
+        return new RecordingConnection (*this, connectionIndex, connection);
+    }
+
+    //==============================================================================
+    struct RecordingConnection  : public PhysicalTopologySource::DeviceConnection
+    {
+        RecordingConnection (Internal& o, int index, PhysicalTopologySource::DeviceConnection* c)
+            : owner (o), connectionIndex (index), incomingQueue (o.createIncomingQueue()), connection (c)
+        {
+            connection->handleMessageFromDevice = [this] (const void* data, size_t dataSize)
+            {
+                owner.addRecord (incomingQueue, connectionIndex, SysexTrafficLog::RecordType::fromDevice, data, dataSize);
+
+                messageCallback.read ([data, dataSize] (const MessageCallback& callback)
+                {
+                    if (callback != nullptr)
+                        callback (data, dataSize);
+                });
+            };
+        }
+
+        ~RecordingConnection() override
+        {
+            connection.reset();
+            owner.addRecord (owner.messageThreadQueue, connectionIndex, SysexTrafficLog::RecordType::deviceClosed, nullptr, 0);
+        }
+
+        bool sendMessageToDevice (const void* data, size_t dataSize) override
+        {
+            owner.addRecord (owner.messageThreadQueue, connectionIndex, SysexTrafficLog::RecordType::toDevice, data, dataSize);
+            return connection->sendMessageToDevice (data, dataSize);
+        }
+
+        // The wrapped connection only starts using the callback above once this one has its own
+        void callbacksChanged() override
+        {
+            messageCallback.update ([this] (MessageCallback& c) { c = handleMessageFromDevice; });
+            connection->callbacksChanged();
+        }
+
+        juce::int64 getLastMessageID() override                         { return connection->getLastMessageID(); }
+        juce::int64 getMessageWriteTime (juce::int64 messageID) override  { return connection->getMessageWriteTime (messageID); }
+        bool canControlDevice() override                                { return connection->canControlDevice(); }
+
+        using MessageCallback = std::function<void (const void* data, size_t dataSize)>;
+
+        Internal& owner;
+        const int connectionIndex;
+        PacketFifo& incomingQueue;
+        CopyOnWriteValue<MessageCallback> messageCallback;
+        std::unique_ptr<PhysicalTopologySource::DeviceConnection> connection;
+    };
+
+    struct MIDIConnectionTap  : private MIDIDeviceConnection::Listener
+    {
+        MIDIConnectionTap (Internal& o, int index, MIDIDeviceConnection& c)
+            : owner (o), connectionIndex (index), incomingQueue (o.createIncomingQueue()), connection (&c)
+        {
+            // Incoming messages arrive on the MIDI thread, and outgoing ones are sent on the message thread
+            connection->monitorMessage = [this] (const void* data, size_t dataSize, bool isFromDevice)
+            {
+                if (isFromDevice)
+                    owner.addRecord (incomingQueue, connectionIndex, SysexTrafficLog::RecordType::fromDevice, data, dataSize);
+                else
+                    owner.addRecord (owner.messageThreadQueue, connectionIndex, SysexTrafficLog::RecordType::toDevice, data, dataSize);
+            };
+
+            connection->callbacksChanged();
+            connection->addListener (this);
+        }
+
+        ~MIDIConnectionTap() override
+        {
+            if (connection != nullptr)
+            {
+                connection->removeListener (this);
+                connection->monitorMessage = nullptr;
+                connection->callbacksChanged();
+            }
+        }
+
+        void handleIncomingMidiMessage (const juce::MidiMessage&) override {}
+
+        void connectionBeingDeleted (const MIDIDeviceConnection&) override
+        {
+            owner.addRecord (owner.messageThreadQueue, connectionIndex, SysexTrafficLog::RecordType::deviceClosed, nullptr, 0);
+            connection = nullptr;
+        }
+
+        Internal& owner;
+        const int connectionIndex;
+        PacketFifo& incomingQueue;
+        MIDIDeviceConnection* connection;
+    };
+
+    //==============================================================================
+    std::unique_ptr<PhysicalTopologySource::DeviceDetector> ownedDetector;
+    PhysicalTopologySource::DeviceDetector& detector;
+    juce::StringArray lastScannedDevices;
+    int nextConnectionIndex = 0;
+
+    juce::OwnedArray<MIDIConnectionTap> midiConnectionTaps;
+
+    static constexpr int recordPrefixSize = 3;
+    static constexpr int writeIntervalMs = 20;
+
+    struct QueuedRecord
+    {
+        juce::int64 time;
+        int offset, size;
+    };
+
+    PacketFifo messageThreadQueue;
+    juce::CriticalSection incomingQueuesLock;
+    juce::OwnedArray<PacketFifo> incomingQueues;
+    std::atomic<int> numRecordsDropped { 0 };
+
+    juce::Array<QueuedRecord> queuedRecords;
+    juce::MemoryBlock queuedRecordData;
+
+    std::unique_ptr<juce::FileOutputStream> stream;
+    juce::int64 startTicks = 0;
+};
+
+RecordingDeviceDetector::RecordingDeviceDetector (const juce::File& logFile)
+{
+    auto midiDetector = std::make_unique<MIDIDeviceDetector>();
+    internal = std::make_unique<Internal> (*midiDetector, logFile);
+    internal->ownedDetector = std::move (midiDetector);
+    internal->detector.setDevicesChangedCallback ([this] { notifyDevicesChanged(); });
+}
+
+RecordingDeviceDetector::RecordingDeviceDetector (PhysicalTopologySource::DeviceDetector& detectorToRecord, const juce::File& logFile)
+    : internal (std::make_unique<Internal> (detectorToRecord, logFile))
+{
+    internal->detector.setDevicesChangedCallback ([this] { notifyDevicesChanged(); });
+}
+
+RecordingDeviceDetector::~RecordingDeviceDetector()
+{
+    internal->detector.setDevicesChangedCallback (nullptr);
+}
+
+bool RecordingDeviceDetector::isRecording() const
+{
+    return internal->stream != nullptr;
+}
+
+int RecordingDeviceDetector::getNumRecordsDropped() const
+{
+    return internal->numRecordsDropped.load();
+}
+
+juce::StringArray RecordingDeviceDetector::scanForDevices()
+{
+    internal->lastScannedDevices = internal->detector.scanForDevices();
+    return internal->lastScannedDevices;
+}
+
+PhysicalTopologySource::DeviceConnection* RecordingDeviceDetector::openDevice (int index)
+{
+    return internal->openDevice (index);
+}
+
+bool RecordingDeviceDetector::isLockedFromOutside() const
+{
+    return internal->detector.isLockedFromOutside();
+}
+
+//==============================================================================
+struct ReplayDeviceDetector::Internal  : private juce::Thread
+{
+    Internal (const juce::File& logFile, ReplaySpeed s)
+        : juce::Thread ("Blocks replay"), speed (s)
+    {
+        log = std::make_unique<juce::MemoryMappedFile> (logFile, juce::MemoryMappedFile::readOnly);
+
+        if (log->getData() == nullptr
+             || log->getSize() < (size_t) SysexTrafficLog::fileHeaderSize
+             || juce::ByteOrder::littleEndianInt (log->getData()) != SysexTrafficLog::magic
+             || juce::ByteOrder::littleEndianInt (addBytesToPointer (log->getData(), 4)) != SysexTrafficLog::version)
+            log.reset();
+    }
+
+    ~Internal() override
+    {
+        stopThread (2000);
+
+        const juce::ScopedLock sl (lock);
+
+        for (auto& device : devices)
+            if (device.connection != nullptr)
+                device.connection->owner = nullptr;
+    }
+
+    void startReplay()
+    {
+        if (log != nullptr && ! isThreadRunning() && ! finished)
+            startThread();
+    }
+
+    //==============================================================================
+    /** The replay thread only passes messages to a connection once callbacksChanged()
+        has been called, and then calls a copy of the callback that's taken under the
+        lock that the thread holds while doing so.
+    */
+    struct ReplayConnection  : public PhysicalTopologySource::DeviceConnection
+    {
+        ReplayConnection (Internal& o, int index)  : owner (&o), connectionIndex (index) {}
+
+        ~ReplayConnection() override
+        {
+            if (owner != nullptr)
+                owner->connectionDeleted (connectionIndex);
+        }
+
+        bool sendMessageToDevice (const void*, size_t) override
+        {
+            if (owner != nullptr)
+                ++owner->numMessagesToDevices;
+
+            return true;
+        }
+
+        void callbacksChanged() override
+        {
+            if (owner != nullptr)
+                owner->callbacksChanged (*this);
+        }
+
+        Internal* owner;
+        const int connectionIndex;
+
+        // Used while holding the owner's lock
+        std::function<void (const void* data, size_t dataSize)> messageCallback;
+        bool isReady = false;
+    };
+
+    struct Device
+    {
+        int connectionIndex;
+        juce::String name;
+        bool isOpen;
+        ReplayConnection* connection;
+    };
+
+    juce::StringArray scanForDevices()
+    {
+        const juce::ScopedLock sl (lock);
+        lastScannedDevices.clear();
+
+        for (auto& device : devices)
+            if (device.isOpen)
+                lastScannedDevices.add (device.name);
+
+        return lastScannedDevices;
+    }
+
+    PhysicalTopologySource::DeviceConnection* openDevice (int index)
+    {
+        const juce::ScopedLock sl (lock);
+
+        for (auto& device : devices)
+        {
+            if (device.isOpen && device.connection == nullptr && device.name == lastScannedDevices[index])
+            {
+                device.connection = new ReplayConnection (*this, device.connectionIndex);
+                return device.connection;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void connectionDeleted (int connectionIndex)
+    {
+        const juce::ScopedLock sl (lock);
+
+        if (auto* device = findDevice (connectionIndex))
+            device->connection = nullptr;
+    }
+
+    void callbacksChanged (ReplayConnection& connection)
+    {
+        const juce::ScopedLock sl (lock);
+        connection.messageCallback = connection.handleMessageFromDevice;
+        connection.isReady = true;
+    }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.numMessagesFromDevices = numMessagesFromDevices;
+        stats.numBytesFromDevices = numBytesFromDevices;
+        stats.numMessagesToDevices = numMessagesToDevices;
+
+        auto endTicks = finished ? finishTicks.load() : juce::Time::getHighResolutionTicks();
+
+        if (startTicks != 0)
+            stats.elapsedSeconds = juce::Time::highResolutionTicksToSeconds (endTicks - startTicks - pausedTicks);
+
+        return stats;
+    }
+
+    //==============================================================================
+    std::unique_ptr<juce::MemoryMappedFile> log;
+    const ReplaySpeed speed;
+
+    std::atomic<int> numMessagesFromDevices { 0 }, numMessagesToDevices { 0 };
+    std::atomic<juce::int64> numBytesFromDevices { 0 };
+    std::atomic<juce::int64> startTicks { 0 }, pausedTicks { 0 }, finishTicks { 0 };
+    std::atomic<bool> finished { false };
+
+private:
+    juce::CriticalSection lock;
+    juce::Array<Device> devices;
+    juce::StringArray lastScannedDevices;
+
+    static constexpr int maxWaitForDeviceMs = 5000;
+
+    Device* findDevice (int connectionIndex)
+    {
+        for (auto& device : devices)
+            if (device.connectionIndex == connectionIndex)
+                return &device;
+
+        return nullptr;
+    }
+
+    template <typename Type>
+    static const Type* addBytesToPointer (const Type* p, size_t numBytes) noexcept
+    {
+        return reinterpret_cast<const Type*> (static_cast<const char*> (p) + numBytes);
+    }
+
+    void run() override
+    {
+        auto data = static_cast<const juce::uint8*> (log->getData());
+        auto size = log->getSize();
+        size_t pos = SysexTrafficLog::fileHeaderSize;
+
+        startTicks = juce::Time::getHighResolutionTicks();
+
+        while (! threadShouldExit() && pos + SysexTrafficLog::recordHeaderSize <= size)
+        {
+            auto* header = data + pos;
+            auto time = (juce::int64) juce::ByteOrder::littleEndianInt64 (header);
+            auto dataSize = (size_t) juce::ByteOrder::littleEndianInt (header + 8);
+            auto connectionIndex = (int) juce::ByteOrder::littleEndianShort (header + 12);
+            auto type = (SysexTrafficLog::RecordType) header[14];
+
+            pos += SysexTrafficLog::recordHeaderSize;
+
+            if (pos + dataSize > size)
+                break;
+
+            auto* recordData = data + pos;
+            pos += dataSize;
+
+            if (speed == ReplaySpeed::realTime)
+                waitUntil (time);
+
+            switch (type)
+            {
+                case SysexTrafficLog::RecordType::fromDevice:
+                {
+                    const juce::ScopedLock sl (lock);
+
+                    if (auto* device = findDevice (connectionIndex))
+                    {
+                        if (device->connection != nullptr && device->connection->messageCallback != nullptr)
+                        {
+                            device->connection->messageCallback (recordData, dataSize);
+                            ++numMessagesFromDevices;
+                            numBytesFromDevices += (juce::int64) dataSize;
+                        }
+                    }
+
+                    break;
+                }
+
+                case SysexTrafficLog::RecordType::deviceOpened:
+                {
+                    {
+                        const juce::ScopedLock sl (lock);
+                        devices.add ({ connectionIndex, juce::String::fromUTF8 ((const char*) recordData, (int) dataSize), true, nullptr });
+                    }
+
+                    waitForDeviceToOpen (connectionIndex);
+                    break;
+                }
+
+                case SysexTrafficLog::RecordType::deviceClosed:
+                {
+                    const juce::ScopedLock sl (lock);
+
+                    if (auto* device = findDevice (connectionIndex))
+                        device->isOpen = false;
+
+                    break;
+                }
+
+                case SysexTrafficLog::RecordType::toDevice:
+                default:
+                    break;
+            }
+        }
+
+        finishTicks = juce::Time::getHighResolutionTicks();
+        finished = true;
+    }
+
+    void waitUntil (juce::int64 recordTimeMicros)
+    {
+        auto targetTicks = startTicks + pausedTicks + juce::Time::secondsToHighResolutionTicks ((double) recordTimeMicros / 1000000.0);
+
+        while (! threadShouldExit())
+        {
+            auto ticksLeft = targetTicks - juce::Time::getHighResolutionTicks();
+
+            if (ticksLeft <= 0)
+                break;
+
+            auto msLeft = juce::Time::highResolutionTicksToSeconds (ticksLeft) * 1000.0;
+
+            if (msLeft > 2.0)
+                wait ((int) msLeft - 1);
+            else
+                juce::Thread::yield();
+        }
+    }
+
+    void waitForDeviceToOpen (int connectionIndex)
+    {
+        auto waitStart = juce::Time::getHighResolutionTicks();
+
+        for (int i = 0; i < maxWaitForDeviceMs && ! threadShouldExit(); ++i)
+        {
+            {
+                const juce::ScopedLock sl (lock);
+
+                if (auto* device = findDevice (connectionIndex))
+                    if (device->connection != nullptr && device->connection->isReady)
+                        break;
+            }
+
+            wait (1);
+        }
+
+        pausedTicks += juce::Time::getHighResolutionTicks() - waitStart;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (Internal)
+};
+
+ReplayDeviceDetector::ReplayDeviceDetector (const juce::File& logFile, ReplaySpeed speed)
+    : internal (std::make_unique<Internal> (logFile, speed))
+{
+}
+
+ReplayDeviceDetector::~ReplayDeviceDetector() = default;
+
+bool ReplayDeviceDetector::isValid() const                  { return internal->log != nullptr; }
+void ReplayDeviceDetector::startReplay()                    { internal->startReplay(); }
+bool ReplayDeviceDetector::isFinished() const               { return internal->finished; }
+ReplayDeviceDetector::Stats ReplayDeviceDetector::getStats() const     { return internal->getStats(); }
+
+juce::StringArray ReplayDeviceDetector::scanForDevices()
+{
+    return internal->scanForDevices();
+}
+
+PhysicalTopologySource::DeviceConnection* ReplayDeviceDetector::openDevice (int index)
+{
+    return internal->openDevice (index);
+}
+
+} // namespace roli
@@ -0,0 +1,177 @@
+/*
+  ==============================================================================
+
+   Copyright (c) 2020 - ROLI Ltd
+
+   Permission to use, copy, modify, and/or distribute this software for any
+   purpose with or without fee is hereby granted, provided that the above
+   copyright notice and this permission notice appear in all copies.
+
+   THE SOFTWARE IS PROVIDED “AS IS” AND ROLI LTD DISCLAIMS ALL WARRANTIES WITH
+   REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS. IN NO EVENT SHALL ROLI LTD BE LIABLE FOR ANY SPECIAL, DIRECT,
+   INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+   LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+   OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+   PERFORMANCE OF THIS SOFTWARE.
+
+  ==============================================================================
+*/
+
+namespace roli
+{
+
+/**
+    The layout of the log files written by RecordingDeviceDetector and played back
+    by ReplayDeviceDetector.
+
+    A log starts with the 4-byte magic number and a 4-byte version, and is followed
+    by a sequence of records, each made up of a recordHeaderSize header and then
+    the record's data. All values are little-endian, and nothing is padded, so a
+    log can be memory-mapped and read in place.
+
+    Record header:
+    - int64:  microseconds since the recording started
+    - uint32: number of bytes of data following the header
+    - uint16: the connection that the record belongs to, numbered in the order they were opened
+    - uint8:  the RecordType
+    - uint8:  reserved
+
+    The data of a deviceOpened record is the device's name, as UTF-8. fromDevice
+    records hold the bytes that were passed to DeviceConnection::handleMessageFromDevice,
+    and toDevice records hold the packets passed to DeviceConnection::sendMessageToDevice.
+
+    @tags{Blocks}
+*/
+struct SysexTrafficLog
+{
+    enum class RecordType : juce::uint8
+    {
+        fromDevice,
+        toDevice,
+        deviceOpened,
+        deviceClosed
+    };
+
+    static constexpr juce::uint32 magic = 0x474c4b42; // "BKLG"
+    static constexpr juce::uint32 version = 1;
+    static constexpr int fileHeaderSize = 8;
+    static constexpr int recordHeaderSize = 16;
+};
+
+//==============================================================================
+/**
+    A DeviceDetector that records all the Blocks messages sent to and from the
+    devices of another detector, so that they can be played back later with a
+    ReplayDeviceDetector.
+
+    Use it in place of the detector it records, e.g.
+    @code
+    RecordingDeviceDetector recorder (logFile);
+    PhysicalTopologySource source (recorder);
+    @endcode
+
+    The recorder must outlive any PhysicalTopologySource that uses it.
+
+    @tags{Blocks}
+*/
+class RecordingDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    /** Records the traffic of the standard MIDI Blocks devices into a file.
+        Any existing file is replaced.
+    */
+    RecordingDeviceDetector (const juce::File& logFile);
+
+    /** Records the traffic of the devices of another detector, which must outlive this one.
+        Any existing file is replaced.
+    */
+    RecordingDeviceDetector (PhysicalTopologySource::DeviceDetector& detectorToRecord, const juce::File& logFile);
+
+    /** Destructor. */
+    ~RecordingDeviceDetector() override;
+
+    /** Returns false if the log file couldn't be opened for writing. */
+    bool isRecording() const;
+
+    /** Records are written to the file on a background thread, so that recording never
+        holds up the threads that send and receive messages. This returns the number of
+        records that were lost because the thread fell too far behind.
+    */
+    int getNumRecordsDropped() const;
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+    bool isLockedFromOutside() const override;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RecordingDeviceDetector)
+};
+
+//==============================================================================
+/**
+    A DeviceDetector that plays back a log written by a RecordingDeviceDetector.
+
+    The devices in the log appear and disappear as they did when it was recorded,
+    and the messages they sent are passed to whatever opened them, either with the
+    original timing or as fast as possible. Messages sent to the devices are counted
+    and then ignored. This makes it possible to run repeatable benchmarks and
+    reproduce problems without any physical devices.
+
+    Replaying starts when startReplay() is called. Whenever a device appears in the
+    log, playback waits until the device has been opened and callbacksChanged() has
+    been called on its connection, and that time isn't included in the stats. The replayer must outlive any PhysicalTopologySource
+    that uses it.
+
+    @tags{Blocks}
+*/
+class ReplayDeviceDetector  : public PhysicalTopologySource::DeviceDetector
+{
+public:
+    enum class ReplaySpeed
+    {
+        realTime,
+        asFastAsPossible
+    };
+
+    /** Creates a replayer for a log file. */
+    ReplayDeviceDetector (const juce::File& logFile, ReplaySpeed speed = ReplaySpeed::realTime);
+
+    /** Destructor. */
+    ~ReplayDeviceDetector() override;
+
+    /** Returns false if the log file couldn't be opened or isn't a valid log. */
+    bool isValid() const;
+
+    /** Starts playing back the log. */
+    void startReplay();
+
+    /** Returns true once every record in the log has been played back. */
+    bool isFinished() const;
+
+    /** Statistics for a replay. */
+    struct Stats
+    {
+        int numMessagesFromDevices = 0;
+        juce::int64 numBytesFromDevices = 0;
+        int numMessagesToDevices = 0;
+        double elapsedSeconds = 0.0;
+    };
+
+    /** Returns the statistics for the replay so far. */
+    Stats getStats() const;
+
+    juce::StringArray scanForDevices() override;
+    PhysicalTopologySource::DeviceConnection* openDevice (int index) override;
+
+private:
+    struct Internal;
+    std::unique_ptr<Internal> internal;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReplayDeviceDetector)
+};
+
+} // namespace roli
@@ -115,4 +115,89 @@ struct BlockTopology
     }
 };
 
+
+/** Indexes the blocks in a BlockTopology by UID, along with the connections to each
+    block, so that they can be found without searching the whole topology.
+
+    A BlockTopology is a plain value that's copied and changed freely, so the index is
+    kept alongside it by whatever owns the topology, and must be told about each change.
+
+    @tags{Blocks}
+*/
+struct BlockTopologyIndex
+{
+    BlockTopologyIndex() = default;
+    explicit BlockTopologyIndex (const BlockTopology& topology)     { rebuild (topology); }
+
+    /** Replaces the contents of the index with the blocks and connections of a topology. */
+    void rebuild (const BlockTopology& topology)
+    {
+        blocksByUID.clear();
+
+        for (auto& block : topology.blocks)
+            addBlock (block);
+
+        setConnections (topology.connections);
+    }
+
+    void clear() noexcept
+    {
+        blocksByUID.clear();
+        connectionsByUID.clear();
+    }
+
+    void addBlock (const Block::Ptr& block)         { blocksByUID[block->uid] = block; }
+    void removeBlock (Block::UID uid)               { blocksByUID.erase (uid); }
+
+    /** Replaces the indexed connections. */
+    void setConnections (const juce::Array<BlockDeviceConnection>& connections)
+    {
+        connectionsByUID.clear();
+
+        for (auto& connection : connections)
+        {
+            connectionsByUID[connection.device1].add (connection);
+
+            if (connection.device2 != connection.device1)
+                connectionsByUID[connection.device2].add (connection);
+        }
+    }
+
+    /** Returns the block with a given UID, or nullptr. */
+    Block* getBlockWithUID (Block::UID uid) const noexcept
+    {
+        auto found = blocksByUID.find (uid);
+        return found != blocksByUID.end() ? found->second.get() : nullptr;
+    }
+
+    /** Returns the connections that have a given block at either end. */
+    const juce::Array<BlockDeviceConnection>& getConnectionsToBlock (Block::UID uid) const noexcept
+    {
+        static const juce::Array<BlockDeviceConnection> noConnections;
+
+        auto found = connectionsByUID.find (uid);
+        return found != connectionsByUID.end() ? found->second : noConnections;
+    }
+
+    /** Returns the same blocks, in the same order, as BlockTopology::getDirectlyConnectedBlocks(). */
+    Block::Array getDirectlyConnectedBlocks (Block::UID blockUID) const
+    {
+        Block::Array connectedBlocks;
+
+        for (const auto& connection : getConnectionsToBlock (blockUID))
+        {
+            auto connectedDeviceUID = connection.device1 == blockUID ? connection.device2 : connection.device1;
+
+            if (auto* block = getBlockWithUID (connectedDeviceUID))
+                connectedBlocks.addIfNotAlreadyThere (block);
+        }
+
+        return connectedBlocks;
+    }
+
+private:
+    std::unordered_map<Block::UID, Block::Ptr> blocksByUID;
+    std::unordered_map<Block::UID, juce::Array<BlockDeviceConnection>> connectionsByUID;
+};
+
 } // namespace roli